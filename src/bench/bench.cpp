@@ -0,0 +1,1885 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#include "core/api.h"
+#include "core/download.h"
+#include "core/cache.h"
+#include "core/encoding.h"
+#include "core/engine.h"
+#include "core/filename.h"
+#include "core/hash.h"
+#include "core/inflate.h"
+#include "core/limiter.h"
+#include "core/manifest.h"
+#include "core/progress.h"
+#include "core/setting.h"
+#include "core/scheduler.h"
+#include "core/simd.h"
+#include "core/text.h"
+#include "core/throttle.h"
+#include "core/transfer.h"
+
+#ifndef _WIN32
+#include "test_server.h"
+#endif
+
+#ifdef CFS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace
+{
+  class BenchAPI : public API
+  {
+  public:
+    BenchAPI() : API(WIDE("bench")) {}
+    ~BenchAPI()
+    {
+      shutdown();
+    }
+
+    // Names the files of a batch with pattern instead of the default.
+    void set_filename_template(const wstr &pattern)
+    {
+      pattern_ = pattern;
+    }
+
+    // Makes the save dialog answer filename instead of being cancelled.
+    void save_to(const wstr &filename)
+    {
+      save_to_ = filename;
+    }
+
+  protected:
+    HRESULT show_save_dialog(LPCWSTR default_filename, int &text_encoding, wstr &dest) const override
+    {
+      (void)default_filename;
+      (void)text_encoding;
+      if (save_to_.empty())
+      {
+        return HRESULT_FROM_WIN32(ERROR_CANCELLED);
+      }
+      dest = save_to_;
+      return S_OK;
+    }
+    HRESULT show_folder_dialog(wstr &dest) const override
+    {
+      dest = WIDE("cfs_bench_");
+      return S_OK;
+    }
+    void get_setting(setting &dest) const override
+    {
+      default_setting(dest);
+      // nothing is kept from one run to the next, and a failure fails at once
+      dest.write_manifest = false;
+      dest.download_retries = 0;
+      dest.filename_pattern = pattern_;
+    }
+    HRESULT get_cache_folder(wstr &dest) const override
+    {
+      (void)dest;
+      return E_NOTIMPL;
+    }
+    void post_event(const picojson::object &message) const override
+    {
+      (void)message;
+    }
+
+  private:
+    wstr save_to_;
+    wstr pattern_;
+  };
+}
+
+static const struct
+{
+  const char *name;
+  int level;
+} simd_levels[] = {
+    {"scalar", SIMD_NONE},
+    {"sse4.1", SIMD_SSE41},
+    {"avx2", SIMD_AVX2},
+};
+
+// Calls fn(name, level) for each instruction set supported by this CPU.
+template <class F>
+static void for_each_simd_level(F fn)
+{
+  for (const auto &l : simd_levels)
+  {
+    set_simd_level(l.level);
+    if (simd_level() == l.level)
+    {
+      fn(l.name, l.level);
+    }
+  }
+  set_simd_level(SIMD_AVX2);
+}
+
+// Random mix of code units that hits every branch of the transcoders,
+// including unpaired surrogates and pairs that straddle vector blocks.
+static void generate_tricky_text(size_t units, wstr &dest)
+{
+  static const WCHAR pool[] = {0x41, 0x7f, 0x80, 0xe9, 0x7ff, 0x800, 0x3042, 0x4e9c, 0xd842, 0xdfb7, 0xfffd, 0xffff};
+  uint32_t r = 1;
+  dest.resize(units);
+  for (size_t i = 0; i < units; ++i)
+  {
+    r = r * 1103515245 + 12345;
+    dest[i] = (r >> 16) % 4 == 0 ? pool[(r >> 8) % (sizeof(pool) / sizeof(pool[0]))] : WIDE('a') + (r >> 20) % 26;
+  }
+}
+
+// Replaces the characters that have no Shift_JIS code so the whole text goes through the encoder.
+static wstr bmp_only(const wstr &text)
+{
+  wstr r = text;
+  for (WCHAR &c : r)
+  {
+    if (c >= 0xd800 && c <= 0xdfff)
+    {
+      c = 0x3042;
+    }
+  }
+  return r;
+}
+
+static void check_sjis(bench_runner &b, const wstr &text)
+{
+  const wstr bmp = bmp_only(text);
+  std::string expected;
+  size_t unmappable = 0;
+  set_simd_level(SIMD_NONE);
+  if (FAILED(to_sjis(bmp.c_str(), (int)bmp.size(), expected, unmappable)) || unmappable != bmp.size())
+  {
+    b.fail("to_sjis", "unmappable");
+  }
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        std::string sjis;
+                        to_sjis(bmp.c_str(), (int)bmp.size(), sjis, unmappable);
+                        if (sjis != expected)
+                        {
+                          return b.fail("to_sjis", name);
+                        }
+                        // an unmappable character at every position of a vector block
+                        for (size_t pos = 0; pos < 40; ++pos)
+                        {
+                          wstr s(48, WIDE('a'));
+                          s[pos / 2] = 0x3042;
+                          s[pos] = 0xd842;
+                          const HRESULT hr = to_sjis(s.c_str(), (int)s.size(), sjis, unmappable);
+                          if (hr != HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION) || unmappable != pos ||
+                              sjis.size() != (pos / 2 < pos ? pos + 1 : pos))
+                          {
+                            return b.fail("to_sjis unmappable", name);
+                          }
+                        } });
+
+  std::string sjis;
+  to_sjis(WIDE("\x30a2\xff71\x7e8a\x2170\x2160\xffe2\x2235\xe000") WIDE("\\~"), -1, sjis, unmappable);
+  if (sjis != "\x83\x41\xb1\xfa\x5c\xfa\x40\x87\x54\x81\xca\x81\xe6\xf0\x40\\~")
+  {
+    b.fail("to_sjis table", "mismatch");
+  }
+  if (to_sjis(WIDE("a\xa5"), -1, sjis, unmappable) != HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION) || unmappable != 1)
+  {
+    b.fail("to_sjis yen sign", "mismatch");
+  }
+}
+
+static void check_encoding(bench_runner &b, const wstr &text)
+{
+  wstr tricky;
+  generate_tricky_text(4099, tricky);
+  std::string expected_text, expected_tricky;
+  set_simd_level(SIMD_NONE);
+  to_u8(text.c_str(), (int)text.size(), expected_text);
+  to_u8(tricky.c_str(), (int)tricky.size(), expected_tricky);
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        std::string u8;
+                        to_u8(text.c_str(), (int)text.size(), u8);
+                        if (u8 != expected_text)
+                        {
+                          return b.fail("to_u8", name);
+                        }
+                        for (size_t len = 0; len < tricky.size(); len += 1 + len / 3)
+                        {
+                          to_u8(tricky.c_str(), (int)len, u8);
+                          if (u8 != expected_tricky.substr(0, u8.size()))
+                          {
+                            return b.fail("to_u8 tricky", name);
+                          }
+                        } });
+  // random bytes, mostly invalid UTF-8
+  std::string garbage(4099, '\0');
+  {
+    uint32_t r = 7;
+    for (char &c : garbage)
+    {
+      r = r * 1103515245 + 12345;
+      c = (char)(r >> 16);
+    }
+  }
+  wstr expected_u16, expected_garbage;
+  to_u16(expected_text.c_str(), (int)expected_text.size(), expected_u16);
+  to_u16(garbage.c_str(), (int)garbage.size(), expected_garbage);
+  if (expected_u16 != text)
+  {
+    b.fail("to_u16", "scalar");
+  }
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        wstr u16;
+                        to_u16(expected_text.c_str(), (int)expected_text.size(), u16);
+                        if (u16 != expected_u16)
+                        {
+                          return b.fail("to_u16", name);
+                        }
+                        for (size_t len = 0; len < expected_tricky.size(); len += 1 + len / 3)
+                        {
+                          to_u16(expected_tricky.c_str(), (int)len, u16);
+                          wstr scalar;
+                          set_simd_level(SIMD_NONE);
+                          to_u16(expected_tricky.c_str(), (int)len, scalar);
+                          set_simd_level(SIMD_AVX2);
+                          if (u16 != scalar)
+                          {
+                            return b.fail("to_u16 tricky", name);
+                          }
+                        }
+                        to_u16(garbage.c_str(), (int)garbage.size(), u16);
+                        if (u16 != expected_garbage)
+                        {
+                          return b.fail("to_u16 invalid", name);
+                        } });
+
+  std::string u8;
+  to_u8(WIDE("a\xd842") WIDE("b\xdfb7\xd842\xdfb7"), -1, u8);
+  if (u8 != "a\xef\xbf\xbd" "b\xef\xbf\xbd" "\xf0\xa0\xae\xb7")
+  {
+    b.fail("to_u8 surrogates", "mismatch");
+  }
+  check_sjis(b, text);
+}
+
+static void bench_encoding(bench_runner &b, const wstr &text)
+{
+  check_encoding(b, text);
+
+  std::string u8;
+  wstr u16;
+  if (FAILED(to_u8(text.c_str(), (int)text.size(), u8)) ||
+      FAILED(to_u16(u8.c_str(), (int)u8.size(), u16)) ||
+      u16 != text)
+  {
+    return b.fail("to_u8/to_u16 round trip", "mismatch");
+  }
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        char buf[64];
+                        snprintf(buf, sizeof(buf), "to_u8 [%s]", name);
+                        b.run(buf, text.size() * sizeof(WCHAR), [&]()
+                              { return to_u8(text.c_str(), (int)text.size(), u8); }); });
+  b.run("to_u8 (null-terminated)", text.size() * sizeof(WCHAR), [&]()
+        { return to_u8(text.c_str(), -1, u8); });
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        char buf[64];
+                        snprintf(buf, sizeof(buf), "to_u16 [%s]", name);
+                        b.run(buf, u8.size(), [&]()
+                              { return to_u16(u8.c_str(), (int)u8.size(), u16); }); });
+  b.run("to_u16 (null-terminated)", u8.size(), [&]()
+        { return to_u16(u8.c_str(), -1, u16); });
+
+  const wstr bmp = bmp_only(text);
+  std::string sjis;
+  size_t unmappable = 0;
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        char buf[64];
+                        snprintf(buf, sizeof(buf), "to_sjis [%s]", name);
+                        b.run(buf, bmp.size() * sizeof(WCHAR), [&]()
+                              { return to_sjis(bmp.c_str(), (int)bmp.size(), sjis, unmappable); }); });
+}
+
+// Compares u16_swap with the copy-and-swap loop write_text used before, on 1 MB of text.
+static void bench_swap(bench_runner &b, const wstr &text)
+{
+  wstr src;
+  while (src.size() < 512 * 1024)
+  {
+    src += text;
+  }
+  src.resize(512 * 1024);
+  wstr ws, expected(src.size(), 0);
+  for (size_t pos = 0; pos < src.size(); ++pos)
+  {
+    expected[pos] = ((src[pos] & 0x00ff) << 8) | ((src[pos] & 0xff00) >> 8);
+  }
+  b.run("u16 swap [loop]", src.size() * sizeof(WCHAR), [&]()
+        {
+          ws = src;
+          for (wstr::size_type pos = 0; pos < ws.size(); ++pos)
+          {
+            ws[pos] = ((ws[pos] & 0x00ff) << 8) | ((ws[pos] & 0xff00) >> 8);
+          }
+          return S_OK; });
+  wstr dest(src.size(), 0);
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        for (size_t len = 0; len < 100; ++len)
+                        {
+                          u16_swap(src.c_str() + 1, len, &dest[0]);
+                          if (dest.compare(0, len, expected, 1, len) != 0)
+                          {
+                            return b.fail("u16_swap", name);
+                          }
+                        }
+                        char buf[64];
+                        snprintf(buf, sizeof(buf), "u16 swap [%s]", name);
+                        b.run(buf, src.size() * sizeof(WCHAR), [&]()
+                              {
+                                u16_swap(src.c_str(), src.size(), &dest[0]);
+                                return S_OK; });
+                        if (b.enabled(buf) && dest != expected)
+                        {
+                          return b.fail("u16_swap", name);
+                        } });
+}
+
+static bool read_file(LPCWSTR filepath, std::string &dest)
+{
+  file_t f = INVALID_FILE_HANDLE;
+  if (FAILED(file_open(filepath, f)))
+  {
+    return false;
+  }
+  dest.clear();
+  char buf[4096];
+  size_t read = 0;
+  while (SUCCEEDED(file_read(f, buf, sizeof(buf), read)) && read > 0)
+  {
+    dest.append(buf, read);
+  }
+  file_close(f);
+  return true;
+}
+
+// Checks that the chunked output is identical to encoding the whole text at once.
+static void check_write_text(bench_runner &b, const wstr &text)
+{
+  std::string u8, sjis;
+  size_t unmappable = 0;
+  to_u8(text.c_str(), (int)text.size(), u8);
+  const wstr bmp = bmp_only(text);
+  to_sjis(bmp.c_str(), (int)bmp.size(), sjis, unmappable);
+  std::string u16le, u16be;
+  for (const WCHAR c : text)
+  {
+    u16le += (char)(c & 0xff);
+    u16le += (char)(c >> 8);
+    u16be += (char)(c >> 8);
+    u16be += (char)(c & 0xff);
+  }
+  const struct
+  {
+    const char *name;
+    int encoding;
+    const wstr &src;
+    std::string expected;
+    HRESULT hr;
+  } cases[] = {
+      {"utf8", ENCODING_UTF8, text, u8, S_OK},
+      {"utf8bom", ENCODING_UTF8BOM, text, "\xef\xbb\xbf" + u8, S_OK},
+      {"utf16le", ENCODING_UTF16LE, text, u16le, S_OK},
+      {"utf16lebom", ENCODING_UTF16LEBOM, text, "\xff\xfe" + u16le, S_OK},
+      {"utf16be", ENCODING_UTF16BE, text, u16be, S_OK},
+      {"utf16bebom", ENCODING_UTF16BEBOM, text, "\xfe\xff" + u16be, S_OK},
+      {"sjis", ENCODING_SHIFTJIS, bmp, sjis, S_OK},
+      {"sjis fallback", ENCODING_SHIFTJIS, text, "\xef\xbb\xbf" + u8, S_FALSE},
+  };
+  std::string r;
+  for (const auto &c : cases)
+  {
+    Hasher h;
+    const HRESULT hr = write_text(WIDE("cfs_bench.txt"), c.src.c_str(), c.encoding, &h);
+    if (hr != c.hr || !read_file(WIDE("cfs_bench.txt"), r) || r != c.expected ||
+        h.length() != r.size() || h.digest() != Hasher::hash(r.data(), r.size()))
+    {
+      b.fail("write_text", c.name);
+    }
+  }
+}
+
+static void bench_write_text(bench_runner &b, const wstr &text)
+{
+  check_write_text(b, text);
+
+  static const struct
+  {
+    const char *name;
+    int encoding;
+  } encodings[] = {
+      {"write_text utf8", ENCODING_UTF8},
+      {"write_text utf8bom", ENCODING_UTF8BOM},
+      {"write_text utf16le", ENCODING_UTF16LE},
+      {"write_text utf16lebom", ENCODING_UTF16LEBOM},
+      {"write_text utf16be", ENCODING_UTF16BE},
+      {"write_text utf16bebom", ENCODING_UTF16BEBOM},
+      {"write_text sjis", ENCODING_SHIFTJIS},
+  };
+  // surrogate pairs would make Shift_JIS fall back to UTF-8
+  const wstr bmp = bmp_only(text);
+  for (const auto &e : encodings)
+  {
+    b.run(e.name, bmp.size() * sizeof(WCHAR), [&]()
+          { return write_text(WIDE("cfs_bench.txt"), bmp.c_str(), e.encoding); });
+  }
+  file_delete(WIDE("cfs_bench.txt"));
+}
+
+static void check_sanitize(bench_runner &b)
+{
+  wstr src;
+  generate_tricky_text(4099, src);
+  for (size_t i = 0; i < src.size(); i += 7)
+  {
+    src[i] = (WCHAR)(1 + i % 0x7f);
+  }
+  std::vector<WCHAR> expected(src.size()), d(src.size());
+  set_simd_level(SIMD_NONE);
+  sanitize_chars(src.c_str(), src.size(), expected.data());
+  for (size_t i = 0; i < src.size(); ++i)
+  {
+    const WCHAR c = src[i];
+    const bool bad = c < 0x20 || c == 0x7f || (c < 0x80 && strchr("\"*/:<>?\\|", (char)c));
+    if (expected[i] != (bad ? WIDE('_') : c))
+    {
+      return b.fail("sanitize", "scalar");
+    }
+  }
+  for_each_simd_level([&](const char *name, int)
+                      {
+                        for (size_t len = 0; len < src.size(); len += 1 + len / 3)
+                        {
+                          sanitize_chars(src.c_str(), len, d.data());
+                          if (!std::equal(d.begin(), d.begin() + len, expected.begin()))
+                          {
+                            return b.fail("sanitize", name);
+                          }
+                        } });
+
+  static const struct
+  {
+    LPCWSTR src;
+    LPCWSTR expected;
+  } names[] = {
+      {WIDE("a:b?.wav"), WIDE("a_b_.wav")},
+      {WIDE("con"), WIDE("con_")},
+      {WIDE("NUL.txt"), WIDE("NUL_.txt")},
+      {WIDE("Com1 .wav"), WIDE("Com1_ .wav")},
+      {WIDE("LPT0"), WIDE("LPT0")},
+      {WIDE("CONSOLE"), WIDE("CONSOLE")},
+      {WIDE("auxiliary.txt"), WIDE("auxiliary.txt")},
+      {WIDE("end. ."), WIDE("end___")},
+      {WIDE("..."), WIDE("___")},
+      {WIDE(""), WIDE("")},
+  };
+  wstr r;
+  for (const auto &n : names)
+  {
+    sanitize(n.src, r);
+    if (r != n.expected)
+    {
+      b.fail("sanitize name", "mismatch");
+    }
+  }
+}
+
+static void check_filename_template(bench_runner &b)
+{
+  static const struct
+  {
+    LPCWSTR pattern;
+    LPCWSTR character;
+    LPCWSTR text;
+    int seq;
+    LPCWSTR expected;
+  } cases[] = {
+      {WIDE("{seq:05}_{character}_{text:5}"), WIDE("a/b"), WIDE("0123456789"), 42, WIDE("00042_a_b_0123…")},
+      {WIDE("{seq:3}_{text:5}"), WIDE(""), WIDE("01234"), 7, WIDE("  7_01234")},
+      {WIDE("{seq}{{x}}{text:3}"), WIDE(""), WIDE("a\xd842\xdfb7\xd842\xdfb7"), 123456, WIDE("123456{x}a\xd842\xdfb7\xd842\xdfb7")},
+      {WIDE("{text:3}"), WIDE(""), WIDE("a\xd842\xdfb7") WIDE("bc"), 0, WIDE("a\xd842\xdfb7…")},
+      // が written as か + U+3099, and an emoji ZWJ sequence
+      {WIDE("{text:2}"), WIDE(""), WIDE("\x304b\x3099\x304b\x3099\x304b"), 0, WIDE("\x304b\x3099…")},
+      {WIDE("{text:2}"), WIDE(""), WIDE("\xd83d\xdc69\x200d\xd83d\xdcbb!?"), 0, WIDE("\xd83d\xdc69\x200d\xd83d\xdcbb…")},
+      {WIDE("{character:2}"), WIDE("con"), WIDE(""), 0, WIDE("co")},
+      {WIDE("{character}"), WIDE("con"), WIDE(""), 0, WIDE("con_")},
+      {WIDE("{text}. "), WIDE(""), WIDE("a?b"), 0, WIDE("a_b__")},
+  };
+  filename_template t;
+  wstr r;
+  for (const auto &c : cases)
+  {
+    if (FAILED(compile_filename_template(c.pattern, t)))
+    {
+      b.fail("compile_filename_template", "failed");
+      continue;
+    }
+    format_filename(t, {c.character, c.text, c.seq}, WIDE(".wav"), r);
+    if (r != wstr(c.expected) + WIDE(".wav"))
+    {
+      b.fail("format_filename", "mismatch");
+    }
+  }
+  static const LPCWSTR invalid[] = {
+      WIDE("{text"), WIDE("}"), WIDE("{unknown}"), WIDE("{text:0}"), WIDE("{text:x}"), WIDE("{seq:1000}"), WIDE("{date:%Q}"), WIDE("{date:%}")};
+  for (const LPCWSTR p : invalid)
+  {
+    if (compile_filename_template(p, t) != E_INVALIDARG)
+    {
+      b.fail("compile_filename_template", "accepted an invalid pattern");
+    }
+  }
+  // the default reproduces the names of the earlier versions
+  compile_filename_template(default_filename_template, t);
+  format_filename(t, {WIDE("アルパカ"), WIDE("こんにちは、今日は良い天気ですね"), 1}, WIDE(".wav"), r);
+  if (r.size() != 15 + 1 + 4 + 1 + 10 + 4 || r.compare(16, 15, WIDE("アルパカ_こんにちは、今日は…")) != 0)
+  {
+    b.fail("format_filename", "default pattern");
+  }
+}
+
+static void bench_filename(bench_runner &b, const wstr &text)
+{
+  check_sanitize(b);
+  check_filename_template(b);
+  wstr s;
+  b.run("sanitize", text.size() * sizeof(WCHAR), [&]()
+        {
+          sanitize(text.c_str(), s);
+          return S_OK; });
+
+  // a single script line, which is what the filename usually gets
+  const wstr line = text.substr(0, 64);
+  filename_template t;
+  compile_filename_template(default_filename_template, t);
+  filename_params params = {WIDE("アルパカ"), line.c_str(), 0};
+  b.run("format_filename", line.size() * sizeof(WCHAR), [&]()
+        {
+          ++params.seq;
+          format_filename(t, params, WIDE(".wav"), s);
+          return S_OK; });
+  compile_filename_template(WIDE("{date:%Y%m%d}_{seq:05}_{character}_{text:20}"), t);
+  b.run("format_filename (seq, text:20)", line.size() * sizeof(WCHAR), [&]()
+        {
+          ++params.seq;
+          format_filename(t, params, WIDE(".wav"), s);
+          return S_OK; });
+  // the whole script as a single line only costs the prefix that is used
+  params.text = text.c_str();
+  b.run("format_filename (long text)", line.size() * sizeof(WCHAR), [&]()
+        {
+          ++params.seq;
+          format_filename(t, params, WIDE(".wav"), s);
+          return S_OK; });
+  b.run("compile_filename_template", 0, [&]()
+        { return compile_filename_template(WIDE("{date:%Y%m%d}_{seq:05}_{character}_{text:20}"), t); });
+}
+
+static void bench_json(bench_runner &b, const wstr &text)
+{
+  picojson::object obj;
+  {
+    std::string u8;
+    to_u8(text.c_str(), (int)text.size(), u8);
+    obj["text"].set<std::string>(u8);
+    obj["textEncoding"].set<std::string>("utf8bom");
+  }
+  const picojson::value v(obj);
+  const size_t bytes = v.serialize().size();
+  b.run("save_json", bytes, [&]()
+        { return save_json(WIDE("cfs_bench.json"), v); });
+  picojson::value r;
+  b.run("load_json", bytes, [&]()
+        { return load_json(WIDE("cfs_bench.json"), r); });
+  file_delete(WIDE("cfs_bench.json"));
+
+  // the settings file is replaced through a temporary file, which must not be left behind
+  setting s, l;
+  default_setting(s);
+  s.text_encoding = ENCODING_SHIFTJIS;
+  s.filename_pattern = WIDE("{seq:03}_{text:8}");
+  s.receive_timeout = 5000;
+  s.download_retries = 0;
+  s.max_bytes_per_second = 1 << 20;
+  std::string r2;
+  if (FAILED(save_setting(WIDE("cfs_bench.json"), s)) || FAILED(save_setting(WIDE("cfs_bench.json"), s)) ||
+      FAILED(load_setting(WIDE("cfs_bench.json"), l)) || l.text_encoding != s.text_encoding ||
+      l.filename_pattern != s.filename_pattern || l.receive_timeout != s.receive_timeout ||
+      l.download_retries != s.download_retries || l.max_bytes_per_second != s.max_bytes_per_second ||
+      read_file(WIDE("cfs_bench.json.tmp"), r2))
+  {
+    b.fail("save_setting", "round trip");
+  }
+  file_delete(WIDE("cfs_bench.json"));
+}
+
+static void bench_wav(bench_runner &b, const std::vector<uint8_t> &wav)
+{
+  b.run("file_write wav", wav.size(), [&]()
+        {
+          file_t f = INVALID_FILE_HANDLE;
+          HRESULT hr = file_create(WIDE("cfs_bench.wav"), f);
+          if (FAILED(hr))
+          {
+            return hr;
+          }
+          hr = file_write(f, wav.data(), wav.size());
+          file_close(f);
+          return hr; });
+  file_delete(WIDE("cfs_bench.wav"));
+
+  // The source hands out at most 16 KiB per call like InternetReadFile does.
+  // With a delay, it also simulates the time spent waiting for the network.
+  const auto make_source = [&wav](size_t &pos, const std::chrono::microseconds delay) -> transfer_source
+  {
+    return [&wav, &pos, delay](void *buf, size_t size, size_t &read) -> HRESULT
+    {
+      if (delay.count() > 0)
+      {
+        std::this_thread::sleep_for(delay);
+      }
+      read = std::min(std::min(size, wav.size() - pos), (size_t)16384);
+      memcpy(buf, wav.data() + pos, read);
+      pos += read;
+      return S_OK;
+    };
+  };
+  for (const int delay : {0, 200})
+  {
+    char name[64];
+    const auto d = std::chrono::microseconds(delay);
+    snprintf(name, sizeof(name), "download loop 4 KiB%s", delay ? " (network)" : "");
+    b.run(name, wav.size(), [&]()
+          {
+            size_t pos = 0;
+            const transfer_source source = make_source(pos, d);
+            file_t f = INVALID_FILE_HANDLE;
+            HRESULT hr = file_create(WIDE("cfs_bench.wav"), f);
+            if (FAILED(hr))
+            {
+              return hr;
+            }
+            char buf[4096];
+            size_t read = 0;
+            do
+            {
+              hr = source(buf, sizeof(buf), read);
+              if (SUCCEEDED(hr) && read > 0)
+              {
+                hr = file_write(f, buf, read);
+              }
+            } while (SUCCEEDED(hr) && read > 0);
+            file_close(f);
+            return hr; });
+    snprintf(name, sizeof(name), "transfer_to_file%s", delay ? " (network)" : "");
+    b.run(name, wav.size(), [&]()
+          {
+            size_t pos = 0;
+            file_t f = INVALID_FILE_HANDLE;
+            const HRESULT hr = file_create(WIDE("cfs_bench.wav"), f);
+            if (FAILED(hr))
+            {
+              return hr;
+            }
+            return transfer_to_file(make_source(pos, d), wav.size(), f); });
+    snprintf(name, sizeof(name), "transfer_to_file hashed%s", delay ? " (network)" : "");
+    b.run(name, wav.size(), [&]()
+          {
+            size_t pos = 0;
+            file_t f = INVALID_FILE_HANDLE;
+            HRESULT hr = file_create(WIDE("cfs_bench.wav"), f);
+            if (FAILED(hr))
+            {
+              return hr;
+            }
+            Hasher h;
+            hr = transfer_to_file(make_source(pos, d), wav.size(), f, nullptr, &h);
+            return SUCCEEDED(hr) && h.digest() != Hasher::hash(wav.data(), wav.size()) ? E_FAIL : hr; });
+  }
+  {
+    std::string r;
+    if (b.enabled("transfer_to_file") && (!read_file(WIDE("cfs_bench.wav"), r) || r.size() != wav.size() || memcmp(r.data(), wav.data(), wav.size()) != 0))
+    {
+      b.fail("transfer_to_file", "mismatch");
+    }
+  }
+  {
+    // a body that does not match the announced length must not look like a success
+    const struct
+    {
+      uint64_t content_length;
+      HRESULT hr;
+    } cases[] = {
+        {wav.size() + 1, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF)},
+        {wav.size() - 1, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)},
+    };
+    for (const auto &c : cases)
+    {
+      size_t pos = 0;
+      file_t f = INVALID_FILE_HANDLE;
+      if (FAILED(file_create(WIDE("cfs_bench.wav"), f)) ||
+          transfer_to_file(make_source(pos, std::chrono::microseconds(0)), c.content_length, f) != c.hr)
+      {
+        b.fail("transfer_to_file", "length check");
+      }
+    }
+  }
+  file_delete(WIDE("cfs_bench.wav"));
+}
+
+static void bench_hash(bench_runner &b, const std::vector<uint8_t> &wav)
+{
+  {
+    // reference values of XXH64
+    const char abc[] = "abc";
+    const char fox[] = "Nobody inspects the spammish repetition";
+    if (Hasher::hash("", 0) != 0xef46db3751d8e999ULL || Hasher::hash(abc, 3) != 0x44bc2cf5ad770999ULL ||
+        Hasher::hash(fox, sizeof(fox) - 1) != 0xfbcea83c8a378bf1ULL)
+    {
+      b.fail("Hasher", "reference");
+    }
+    // feeding the data in pieces must not change the result
+    Hasher h;
+    for (size_t pos = 0, n = 1; pos < wav.size(); pos += n, n = n * 3 % 1000 + 1)
+    {
+      h.update(wav.data() + pos, std::min(n, wav.size() - pos));
+    }
+    if (h.digest() != Hasher::hash(wav.data(), wav.size()))
+    {
+      b.fail("Hasher", "streaming");
+    }
+  }
+  uint64_t sink = 0;
+  b.run("Hasher wav", wav.size(), [&]()
+        {
+          sink += Hasher::hash(wav.data(), wav.size());
+          return S_OK; });
+  (void)sink;
+}
+
+#ifdef CFS_HAVE_ZLIB
+// windowBits of deflateInit2: 16 + 15 for gzip, 15 for zlib, -15 for raw deflate
+static std::vector<uint8_t> deflate_with(const std::vector<uint8_t> &src, const int window_bits)
+{
+  std::vector<uint8_t> dest;
+  z_stream z = {};
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    return dest;
+  }
+  dest.resize(deflateBound(&z, (uLong)src.size()));
+  z.next_in = (Bytef *)src.data();
+  z.avail_in = (uInt)src.size();
+  z.next_out = dest.data();
+  z.avail_out = (uInt)dest.size();
+  const int r = deflate(&z, Z_FINISH);
+  deflateEnd(&z);
+  dest.resize(r == Z_STREAM_END ? z.total_out : 0);
+  return dest;
+}
+
+// Decodes src fed in pieces of odd sizes into an output buffer that is often too small.
+static HRESULT inflate_pieces(const int encoding, const std::vector<uint8_t> &src, const size_t out_size, std::vector<uint8_t> &dest)
+{
+  dest.clear();
+  Inflater inf(encoding);
+  std::vector<uint8_t> out(out_size);
+  for (size_t pos = 0, n = 1; pos < src.size() || !inf.done(); n = n * 3 % 1000 + 1)
+  {
+    const size_t len = std::min(n, src.size() - pos);
+    size_t consumed = 0, written = 0;
+    const HRESULT hr = inf.decode(src.data() + pos, len, out.data(), out.size(), consumed, written);
+    if (FAILED(hr))
+    {
+      return hr;
+    }
+    if (consumed == 0 && written == 0 && !inf.done())
+    {
+      // no progress with all the input given means the stream is cut short
+      return pos == src.size() ? HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) : E_FAIL;
+    }
+    pos += consumed;
+    dest.insert(dest.end(), out.begin(), out.begin() + written);
+  }
+  return S_OK;
+}
+
+static void bench_inflate(bench_runner &b, const std::vector<uint8_t> &wav)
+{
+  if (parse_content_encoding(" GZip") != CONTENT_GZIP || parse_content_encoding("deflate") != CONTENT_DEFLATE ||
+      parse_content_encoding("") != CONTENT_IDENTITY || parse_content_encoding("br") != CONTENT_UNSUPPORTED)
+  {
+    b.fail("Inflater", "Content-Encoding");
+  }
+  const std::vector<uint8_t> gz = deflate_with(wav, 16 + MAX_WBITS);
+  static const struct
+  {
+    const char *name;
+    int encoding;
+    int window_bits;
+  } cases[] = {
+      {"gzip", CONTENT_GZIP, 16 + MAX_WBITS},
+      {"deflate", CONTENT_DEFLATE, MAX_WBITS},
+      // "deflate" without the zlib header, as some servers send it
+      {"raw deflate", CONTENT_DEFLATE, -MAX_WBITS},
+  };
+  std::vector<uint8_t> out;
+  for (const auto &c : cases)
+  {
+    const std::vector<uint8_t> src = deflate_with(wav, c.window_bits);
+    if (src.empty() || FAILED(inflate_pieces(c.encoding, src, 777, out)) || out != wav)
+    {
+      b.fail("Inflater", c.name);
+    }
+  }
+  // a cut body never reaches the end of the stream, and a damaged one does not decode
+  std::vector<uint8_t> cut(gz.begin(), gz.begin() + gz.size() / 2);
+  if (inflate_pieces(CONTENT_GZIP, cut, 4096, out) != HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+  {
+    b.fail("Inflater", "truncated");
+  }
+  std::vector<uint8_t> bad = gz;
+  bad[0] ^= 0xff;
+  if (SUCCEEDED(inflate_pieces(CONTENT_GZIP, bad, 4096, out)))
+  {
+    b.fail("Inflater", "damaged");
+  }
+  out.resize(256 * 1024);
+  b.run("Inflater wav (gzip)", wav.size(), [&]()
+        {
+          Inflater inf(CONTENT_GZIP);
+          size_t pos = 0;
+          while (!inf.done())
+          {
+            size_t consumed = 0, written = 0;
+            const HRESULT hr = inf.decode(gz.data() + pos, gz.size() - pos, out.data(), out.size(), consumed, written);
+            if (FAILED(hr))
+            {
+              return hr;
+            }
+            if (consumed == 0 && written == 0)
+            {
+              return E_FAIL;
+            }
+            pos += consumed;
+          }
+          return S_OK; });
+}
+#endif
+
+static void check_cache(bench_runner &b, const std::vector<uint8_t> &wav)
+{
+  const LPCWSTR dir = WIDE("cfs_bench_cache_");
+  const LPCWSTR url1 = WIDE("https://coefont.studio/a/0001.wav?sig=1");
+  const uint64_t k1 = AudioCache::key(WIDE("アルパカ"), WIDE("こんにちは"), url1);
+  const uint64_t k2 = AudioCache::key(WIDE("アルパカ"), WIDE("こんばんは"), url1);
+  if (k1 != AudioCache::key(WIDE("アルパカ"), WIDE("こんにちは"), WIDE("https://coefont.studio/a/0001.wav?sig=2")) ||
+      k1 == k2 || k1 == AudioCache::key(WIDE("アルパカこ"), WIDE("んにちは"), url1))
+  {
+    b.fail("AudioCache", "key");
+  }
+  {
+    file_t f = INVALID_FILE_HANDLE;
+    if (FAILED(file_create(WIDE("cfs_bench.wav"), f)) || FAILED(file_write(f, wav.data(), wav.size())) || FAILED(file_close(f)))
+    {
+      return b.fail("AudioCache", "cannot write");
+    }
+  }
+  std::string r;
+  {
+    // room for one file only: storing the second evicts the first
+    AudioCache c;
+    if (FAILED(c.open(dir, wav.size())) || c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_FALSE ||
+        FAILED(c.store(k1, WIDE("cfs_bench.wav"), Hasher::hash(wav.data(), wav.size()))) || c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_OK ||
+        !read_file(WIDE("cfs_bench_hit.wav"), r) || r.size() != wav.size() || memcmp(r.data(), wav.data(), wav.size()) != 0 ||
+        FAILED(c.store(k2, WIDE("cfs_bench.wav"), Hasher::hash(wav.data(), wav.size()))) || c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_FALSE)
+    {
+      b.fail("AudioCache", "store and fetch");
+    }
+  }
+  {
+    // the index written by the first instance is loaded by the next one
+    AudioCache c;
+    file_delete(WIDE("cfs_bench_hit.wav"));
+    uint64_t hash = 0, size = 0;
+    if (FAILED(c.open(dir, wav.size())) || c.fetch(k2, WIDE("cfs_bench_hit.wav"), &hash, &size) != S_OK ||
+        hash != Hasher::hash(wav.data(), wav.size()) || size != wav.size() ||
+        c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_FALSE)
+    {
+      b.fail("AudioCache", "index");
+    }
+    c.set_max_bytes(0);
+  }
+  {
+    // a clip edited in place after it was saved does not reach the cache, and a cache file
+    // changed from outside is dropped rather than handed out
+    const auto overwrite = [](LPCWSTR filepath)
+    {
+      file_t f = INVALID_FILE_HANDLE;
+      return SUCCEEDED(file_create(filepath, f)) && SUCCEEDED(file_write(f, "edited", 6)) && SUCCEEDED(file_close(f));
+    };
+    AudioCache c;
+    wstr cached;
+    hash_to_hex(k1, cached);
+    cached = dir + cached + WIDE(".wav");
+    if (FAILED(c.open(dir, wav.size())) || FAILED(c.store(k1, WIDE("cfs_bench.wav"), Hasher::hash(wav.data(), wav.size()))) ||
+        c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_OK || !overwrite(WIDE("cfs_bench.wav")) || !overwrite(WIDE("cfs_bench_hit.wav")) ||
+        c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_OK || !read_file(WIDE("cfs_bench_hit.wav"), r) || r.size() != wav.size() ||
+        memcmp(r.data(), wav.data(), wav.size()) != 0)
+    {
+      b.fail("AudioCache", "shared with a saved clip");
+    }
+    if (!overwrite(cached.c_str()) || c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_FALSE || c.fetch(k1, WIDE("cfs_bench_hit.wav")) != S_FALSE)
+    {
+      b.fail("AudioCache", "changed cache file");
+    }
+    c.set_max_bytes(0);
+  }
+  file_delete(WIDE("cfs_bench_hit.wav"));
+  file_delete(WIDE("cfs_bench.wav"));
+  file_delete(WIDE("cfs_bench_cache_index.dat"));
+}
+
+static void check_manifest(bench_runner &b)
+{
+  // the files are in the current folder, and so is their manifest
+  const wstr manifest = Manifest::filename;
+  file_delete(manifest.c_str());
+  {
+    Manifest m;
+    m.add(WIDE("cfs_bench_1.wav"), 3, 0x0123456789abcdefULL);
+    m.add(WIDE("cfs_bench_1.txt"), 4, 0xfedcba9876543210ULL);
+    if (FAILED(m.flush()))
+    {
+      b.fail("Manifest", "flush");
+    }
+    // the last line is written when m is destroyed
+    m.add(WIDE("cfs_bench_2.wav"), 5, 1);
+  }
+  std::string r;
+  if (!read_file(manifest.c_str(), r) ||
+      r.find("{\"file\":\"cfs_bench_1.wav\",\"size\":3,") != 0 ||
+      r.find("\"xxh64\":\"0123456789abcdef\"}\n{\"file\":\"cfs_bench_1.txt\"") == std::string::npos ||
+      !r.ends_with("\"xxh64\":\"0000000000000001\"}\n"))
+  {
+    b.fail("Manifest", "content");
+  }
+  file_delete(manifest.c_str());
+}
+
+static void check_progress(bench_runner &b)
+{
+  std::mutex mtx;
+  std::vector<picojson::array> reports;
+  Progress p(10, [&](const picojson::array &jobs)
+             {
+               std::lock_guard<std::mutex> lock(mtx);
+               reports.push_back(jobs); });
+  p.start("a", 1);
+  p.start("b", 2);
+  // a burst of updates from both jobs has to be coalesced, not reported one by one
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 100000; ++i)
+  {
+    p.add(i & 1 ? "a" : "b", 10, i < 2 ? 1000000 : 0);
+  }
+  p.file_done("b");
+  p.add("unknown", 1, 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(350));
+  p.finish("a");
+  p.add("a", 1, 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  p.stop();
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::lock_guard<std::mutex> lock(mtx);
+  if (reports.empty() || (double)reports.size() > seconds * 10 + 1)
+  {
+    b.fail("Progress", "reports are not throttled");
+    return;
+  }
+  // the last report of each job has its final state
+  picojson::object a, bj;
+  for (const picojson::array &r : reports)
+  {
+    for (const picojson::value &v : r)
+    {
+      const picojson::object &o = v.get<picojson::object>();
+      const std::string &id = o.at("jobId").get<std::string>();
+      if (id == "a")
+      {
+        a = o;
+      }
+      else if (id == "b")
+      {
+        bj = o;
+      }
+      else
+      {
+        b.fail("Progress", "reported an unknown job");
+      }
+    }
+  }
+  if (a.empty() || bj.empty() ||
+      a["bytes"].get<double>() != 500000 || a["total"].get<double>() != 1000000 ||
+      bj["bytes"].get<double>() != 500000 || bj["done"].get<double>() != 1 || bj["count"].get<double>() != 2)
+  {
+    b.fail("Progress", "unexpected values");
+  }
+}
+
+static void check_throttle(bench_runner &b)
+{
+  Throttle t;
+  if (FAILED(t.consume(1 << 30, false, nullptr)))
+  {
+    b.fail("Throttle", "unlimited");
+  }
+  // 512 KiB at 1 MiB/s, of which the first 256 KiB fit in the bucket
+  t.set_rate(1 << 20);
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 8; ++i)
+  {
+    t.consume(64 * 1024, false, nullptr);
+  }
+  const double batch = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (batch < 0.2 || batch > 1.0)
+  {
+    b.fail("Throttle", "batch rate");
+  }
+  // interactive transfers do not wait but leave the batch to make up for them
+  const auto before = std::chrono::steady_clock::now();
+  t.consume(256 * 1024, true, nullptr);
+  if (std::chrono::steady_clock::now() - before > std::chrono::milliseconds(50))
+  {
+    b.fail("Throttle", "interactive transfer waited");
+  }
+  std::atomic<bool> cancelled(true);
+  if (t.consume(64 * 1024, false, &cancelled) != E_ABORT)
+  {
+    b.fail("Throttle", "cancel");
+  }
+}
+
+static void check_limiter(bench_runner &b)
+{
+  Limiter l(2, 4);
+  std::atomic<bool> cancelled(true);
+  if (FAILED(l.acquire(false, nullptr)) || FAILED(l.acquire(false, nullptr)) ||
+      l.acquire(false, &cancelled) != E_ABORT || FAILED(l.acquire(true, &cancelled)))
+  {
+    b.fail("Limiter", "acquire");
+  }
+  const transfer_sample ok = {200, false, 0.01, 0};
+  for (int i = 0; i < 3; ++i)
+  {
+    l.release(ok);
+  }
+  // rounds that move more data in the same time raise the limit up to the maximum
+  uint64_t bytes = 1 << 20;
+  for (int round = 0; round < 6; ++round)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    const int n = l.limit();
+    for (int i = 0; i < n; ++i)
+    {
+      l.acquire(false, nullptr);
+    }
+    for (int i = 0; i < n; ++i)
+    {
+      l.release({200, false, 0.01, bytes});
+    }
+    bytes *= 4;
+  }
+  if (l.limit() != 4)
+  {
+    b.fail("Limiter", "increase");
+  }
+  // the requests in flight fail together, which counts once
+  for (int i = 0; i < 3; ++i)
+  {
+    l.acquire(false, nullptr);
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    l.release({429, false, 0.01, 0});
+  }
+  if (l.limit() != 2)
+  {
+    b.fail("Limiter", "decrease");
+  }
+  picojson::object state;
+  l.get_state(state);
+  const picojson::array &history = state["history"].get<picojson::array>();
+  if (history.size() != 4 || state["running"].get<double>() != 0 ||
+      history.front().get<picojson::object>().at("reason").get<std::string>() != "start" ||
+      history.back().get<picojson::object>().at("reason").get<std::string>() != "throttled")
+  {
+    b.fail("Limiter", "history");
+  }
+}
+
+static void bench_scheduler(bench_runner &b)
+{
+  {
+    Scheduler s(2, 8);
+    std::atomic<int> ran(0), cancelled(0);
+    std::mutex gate;
+    gate.lock();
+    const Scheduler::job fn = [&](const std::atomic<bool> &c)
+    {
+      // keep the workers busy until the queue has been tested
+      std::lock_guard<std::mutex> lock(gate);
+      ++ran;
+      if (c)
+      {
+        ++cancelled;
+      }
+    };
+    HRESULT hr = S_OK;
+    int submitted = 0;
+    for (int i = 0; i < 20 && SUCCEEDED(hr); ++i)
+    {
+      hr = s.submit("job" + std::to_string(i), fn);
+      submitted += SUCCEEDED(hr);
+    }
+    if (hr != HRESULT_FROM_WIN32(ERROR_BUSY) || submitted < 8 || submitted > 10)
+    {
+      b.fail("Scheduler", "queue is not bounded");
+    }
+    if (s.submit("job5", fn) != E_INVALIDARG)
+    {
+      b.fail("Scheduler", "accepted a duplicate id");
+    }
+    if (!s.cancel("job5") || s.cancel("unknown"))
+    {
+      b.fail("Scheduler", "cancel");
+    }
+    gate.unlock();
+    s.shutdown();
+    if (ran != submitted || cancelled < 1)
+    {
+      b.fail("Scheduler", "jobs were lost");
+    }
+    if (s.submit("", fn) != E_ABORT)
+    {
+      b.fail("Scheduler", "accepted a job after shutdown");
+    }
+  }
+  {
+    // a click has to start while the batch jobs hold every worker they may use
+    Scheduler s(3, 8);
+    std::mutex gate;
+    gate.lock();
+    std::atomic<int> batch(0);
+    for (int i = 0; i < 4; ++i)
+    {
+      s.submit("batch/" + std::to_string(i), [&](const std::atomic<bool> &)
+               {
+                 ++batch;
+                 std::lock_guard<std::mutex> lock(gate); },
+               PRIORITY_BATCH);
+    }
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool clicked = false;
+    s.submit("click", [&](const std::atomic<bool> &)
+             {
+               std::lock_guard<std::mutex> lock(mtx);
+               clicked = true;
+               cv.notify_all(); });
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      if (!cv.wait_for(lock, std::chrono::seconds(5), [&]()
+                       { return clicked; }) ||
+          batch > 2)
+      {
+        b.fail("Scheduler", "interactive job waited for the batch");
+      }
+    }
+    gate.unlock();
+    s.shutdown();
+    if (batch != 4)
+    {
+      b.fail("Scheduler", "batch jobs were lost");
+    }
+  }
+
+  Scheduler s(4, 1024);
+  std::atomic<int> done(0);
+  b.run("Scheduler submit (1000 jobs)", 0, [&]()
+        {
+          done = 0;
+          for (int i = 0; i < 1000; ++i)
+          {
+            while (s.submit("", [&done](const std::atomic<bool> &)
+                            { ++done; }) == HRESULT_FROM_WIN32(ERROR_BUSY))
+            {
+              std::this_thread::yield();
+            }
+          }
+          while (done < 1000)
+          {
+            std::this_thread::yield();
+          }
+          return S_OK; });
+}
+
+#ifndef _WIN32
+
+// Sends every click of the API through the loopback server and reports the time from the
+// call until the file is on disk, which is what the user waits for.
+static void bench_click_to_disk(bench_runner &b, test_server &server, const size_t clicks)
+{
+  const char *name = "API download click-to-disk";
+  if (!b.enabled(name))
+  {
+    return;
+  }
+  BenchAPI api;
+  api.save_to(WIDE("cfs_bench_click.wav"));
+  // as the app does once the page has loaded; shutdown has to wait for it
+  api.start_warm_up(WIDE("cfs_bench"), server.url("/clip.wav"));
+  picojson::object params;
+  std::string u8;
+  to_u8(server.url("/clip.wav").c_str(), -1, u8);
+  params["userAgent"].set<std::string>("cfs_bench");
+  params["url"].set<std::string>(u8);
+  params["character"].set<std::string>("アルパカ");
+  params["text"].set<std::string>("こんにちは");
+  std::vector<double> times;
+  std::mutex mtx;
+  std::condition_variable cv;
+  for (size_t i = 0; i < clicks; ++i)
+  {
+    bool resolved = false, ok = false;
+    const auto start = std::chrono::steady_clock::now();
+    api.dispatch("download", params, [&](const bool r, const picojson::object)
+                 {
+                   std::lock_guard<std::mutex> lock(mtx);
+                   resolved = true;
+                   ok = r;
+                   cv.notify_all(); });
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!cv.wait_for(lock, std::chrono::seconds(10), [&]()
+                     { return resolved; }) ||
+        !ok)
+    {
+      b.fail(name, "download failed");
+      return;
+    }
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9);
+  }
+  {
+    // a save that fails leaves the pair saved before as it was
+    std::string wav, txt, r;
+    if (!read_file(WIDE("cfs_bench_click.wav"), wav) || !read_file(WIDE("cfs_bench_click.txt"), txt) || txt.empty())
+    {
+      b.fail(name, "not saved");
+    }
+    to_u8(server.url("/missing.wav").c_str(), -1, u8);
+    params["url"].set<std::string>(u8);
+    bool resolved = false, ok = true;
+    api.dispatch("download", params, [&](const bool r, const picojson::object)
+                 {
+                   std::lock_guard<std::mutex> lock(mtx);
+                   resolved = true;
+                   ok = r;
+                   cv.notify_all(); });
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait_for(lock, std::chrono::seconds(10), [&]()
+                { return resolved; });
+    if (!resolved || ok || !read_file(WIDE("cfs_bench_click.wav"), r) || r != wav ||
+        !read_file(WIDE("cfs_bench_click.txt"), r) || r != txt)
+    {
+      b.fail(name, "failed save replaced the files");
+    }
+  }
+  file_delete(WIDE("cfs_bench_click.wav"));
+  file_delete(WIDE("cfs_bench_click.txt"));
+  std::sort(times.begin(), times.end());
+  b.print("API download click-to-disk p50", times[times.size() / 2]);
+  b.print("API download click-to-disk p99", times[std::min(times.size() - 1, times.size() * 99 / 100)]);
+}
+
+#ifdef CFS_HAVE_ENGINE
+
+// Fetches count clips at once through the engine and checks every file.
+// If given, limiter holds a request for each clip as the API does.
+static HRESULT engine_batch(DownloadEngine &engine, test_server &server, const size_t count, const int retries, const uint64_t expected, Limiter *limiter = nullptr)
+{
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t done = 0, ok = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const std::string name = "cfs_bench_engine_" + std::to_string(i) + ".wav";
+    engine_job job = {};
+    job.user_agent = WIDE("cfs_bench");
+    job.url = server.url("/clip.wav");
+    job.filepath = wstr(name.begin(), name.end());
+    default_download_options(job.options);
+    job.options.retries = retries;
+    if (limiter)
+    {
+      limiter->acquire(false, nullptr);
+    }
+    const HRESULT hr = engine.submit(std::move(job), [&](const HRESULT hr, const uint64_t hash, const uint64_t, const transfer_sample &sample)
+                                     {
+                                       if (limiter)
+                                       {
+                                         limiter->release(sample);
+                                       }
+                                       std::lock_guard<std::mutex> lock(mtx);
+                                       ++done;
+                                       ok += SUCCEEDED(hr) && hash == expected ? 1 : 0;
+                                       cv.notify_all(); });
+    if (FAILED(hr))
+    {
+      return hr;
+    }
+  }
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [&]()
+          { return done == count; });
+  return ok == count ? S_OK : E_FAIL;
+}
+
+// Many clips in flight at once, which is where multiplexing them on two threads pays off.
+static void bench_engine(bench_runner &b, test_server &server, const size_t clips)
+{
+  std::vector<uint8_t> clip;
+  generate_wav(2, 3, clip);
+  server.add_file("/clip.wav", clip);
+  const uint64_t expected = Hasher::hash(clip.data(), clip.size());
+  DownloadEngine engine(2, 32);
+  server.set_options({0, 0, 0, 0, false});
+  b.run("download engine (loopback)", clip.size() * clips, [&]()
+        { return engine_batch(engine, server, clips, 0, expected); });
+  server.set_options({0, 0, 16 * 1024, 0, false});
+  b.run("download engine (chunked)", clip.size() * clips, [&]()
+        { return engine_batch(engine, server, clips, 0, expected); });
+  // each request waits for the server as a real one would, so this is about the number in flight
+  server.set_options({20, 0, 0, 0, false});
+  b.run("download engine (20 ms latency)", clip.size() * clips, [&]()
+        { return engine_batch(engine, server, clips, 0, expected); });
+#ifdef CFS_HAVE_ZLIB
+  server.set_options({0, 0, 0, 0, true});
+  b.run("download engine (gzip)", clip.size() * clips, [&]()
+        { return engine_batch(engine, server, clips, 0, expected); });
+#endif
+  if (b.enabled("download engine (failures)"))
+  {
+    // every third request fails whichever clip it is for, so a clip needs a few retries to be safe
+    server.set_options({0, 0, 0, 3, false});
+    Limiter limiter(4, 8);
+    const HRESULT hr = engine_batch(engine, server, 16, 8, expected, &limiter);
+    if (FAILED(hr))
+    {
+      b.fail("download engine (failures)", "not recovered", hr);
+    }
+    // the 503s and broken connections behind the retries have to reach the limiter
+    if (limiter.limit() >= 4)
+    {
+      b.fail("download engine (failures)", "limiter not cut");
+    }
+  }
+  {
+    // a redirect is not the clip, and is not saved as one
+    server.set_options({0, 0, 0, 0, false});
+    server.add_redirect("/moved.wav", "/clip.wav");
+    engine_job job = {};
+    job.user_agent = WIDE("cfs_bench");
+    job.url = server.url("/moved.wav");
+    job.filepath = WIDE("cfs_bench_engine_302.wav");
+    default_download_options(job.options);
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    HRESULT result = S_OK;
+    HRESULT hr = engine.submit(std::move(job), [&](const HRESULT hr, const uint64_t, const uint64_t, const transfer_sample &)
+                               {
+                                 std::lock_guard<std::mutex> lock(mtx);
+                                 done = true;
+                                 result = hr;
+                                 cv.notify_all(); });
+    if (SUCCEEDED(hr))
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&]()
+              { return done; });
+      hr = result;
+    }
+    uint64_t size = 0;
+    if (SUCCEEDED(hr) || SUCCEEDED(file_get_size(WIDE("cfs_bench_engine_302.wav"), size)) ||
+        SUCCEEDED(file_get_size(WIDE("cfs_bench_engine_302.wav.part"), size)))
+    {
+      b.fail("download engine (302)", "unexpected result");
+    }
+    file_delete(WIDE("cfs_bench_engine_302.wav"));
+  }
+  engine.shutdown();
+  for (size_t i = 0; i < clips; ++i)
+  {
+    const std::string name = "cfs_bench_engine_" + std::to_string(i) + ".wav";
+    file_delete(wstr(name.begin(), name.end()).c_str());
+  }
+  server.set_options({0, 0, 0, 0, false});
+}
+
+#endif
+
+// A whole batch through the API, which saves every clip with its text file.
+static void bench_download_all(bench_runner &b, test_server &server, const size_t count)
+{
+  const char *name = "API downloadAll (loopback)";
+  if (!b.enabled(name))
+  {
+    return;
+  }
+  std::vector<uint8_t> clip;
+  generate_wav(2, 4, clip);
+  server.add_file("/clip.wav", clip);
+  server.set_options({0, 0, 0, 0, true});
+  BenchAPI api;
+  api.set_filename_template(WIDE("all_{seq:04}"));
+  picojson::object p;
+  p["userAgent"].set<std::string>("cfs_bench");
+  picojson::array items;
+  std::string u8;
+  to_u8(server.url("/clip.wav").c_str(), -1, u8);
+  for (size_t i = 0; i < count; ++i)
+  {
+    picojson::object item;
+    item["url"].set<std::string>(u8);
+    item["text"].set<std::string>("こんにちは " + std::to_string(i));
+    item["character"].set<std::string>("アルパカ");
+    items.push_back(picojson::value(item));
+  }
+  p["items"].set<picojson::array>(items);
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool resolved = false;
+  picojson::object r;
+  const auto start = std::chrono::steady_clock::now();
+  api.dispatch("downloadAll", p, [&](const bool ok, const picojson::object result)
+               {
+                 std::lock_guard<std::mutex> lock(mtx);
+                 resolved = ok;
+                 r = result;
+                 cv.notify_all(); });
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait_for(lock, std::chrono::seconds(30), [&]()
+                { return resolved; });
+  }
+  const double ns = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9;
+  if (!resolved || r["saved"].get<double>() != (double)count)
+  {
+    b.fail(name, "not saved");
+  }
+#ifdef CFS_HAVE_ZLIB
+  else if (!r["compressionRatio"].is<double>() || r["compressionRatio"].get<double>() <= 1)
+  {
+    b.fail(name, "compressionRatio");
+  }
+#endif
+  else
+  {
+    b.print(name, ns);
+  }
+  std::string body;
+  {
+    // a second batch into the same folder gets names of its own instead of replacing the first
+    picojson::object item;
+    item["url"].set<std::string>(u8);
+    item["text"].set<std::string>("second");
+    item["character"].set<std::string>("アルパカ");
+    p["items"].set<picojson::array>(picojson::array{picojson::value(item)});
+    bool done = false, saved = false;
+    api.dispatch("downloadAll", p, [&](const bool ok, const picojson::object result)
+                 {
+                   std::lock_guard<std::mutex> lock(mtx);
+                   done = true;
+                   saved = ok && result.at("saved").get<double>() == 1;
+                   cv.notify_all(); });
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait_for(lock, std::chrono::seconds(30), [&]()
+                  { return done; });
+    }
+    std::string text;
+    if (resolved && (!saved || !read_file(WIDE("cfs_bench_all_0001 (2).txt"), text) || text.find("second") == std::string::npos ||
+                     !read_file(WIDE("cfs_bench_all_0001.txt"), body) || body.find("second") != std::string::npos))
+    {
+      b.fail(name, "existing file replaced");
+    }
+    file_delete(WIDE("cfs_bench_all_0001 (2).wav"));
+    file_delete(WIDE("cfs_bench_all_0001 (2).txt"));
+  }
+  const uint64_t expected = Hasher::hash(clip.data(), clip.size());
+  for (size_t i = 0; i < count; ++i)
+  {
+    char n[32];
+    snprintf(n, sizeof(n), "cfs_bench_all_%04zu", i + 1);
+    const std::string base = n;
+    const wstr wav = wstr(base.begin(), base.end()) + WIDE(".wav");
+    const wstr txt = wstr(base.begin(), base.end()) + WIDE(".txt");
+    if (resolved && (!read_file(wav.c_str(), body) || Hasher::hash(body.data(), body.size()) != expected ||
+                     !read_file(txt.c_str(), body) || body.empty()))
+    {
+      b.fail(name, "content");
+      resolved = false;
+    }
+    file_delete(wav.c_str());
+    file_delete(txt.c_str());
+  }
+}
+
+static void bench_download(bench_runner &b, const std::vector<uint8_t> &wav, const size_t clicks)
+{
+  test_server server;
+  if (FAILED(server.start()))
+  {
+    b.fail("test_server", "start");
+    return;
+  }
+  server.add_file("/clip.wav", wav);
+  const wstr url = server.url("/clip.wav");
+  const uint64_t expected = Hasher::hash(wav.data(), wav.size());
+  download_options o;
+  default_download_options(o);
+  o.retries = 0;
+  Hasher h;
+  b.run("download (loopback)", wav.size(), [&]()
+        {
+          h = Hasher();
+          return download(WIDE("cfs_bench"), url.c_str(), WIDE("cfs_bench_dl.wav"), o, nullptr, &h); });
+  if (b.enabled("download (loopback)") && h.digest() != expected)
+  {
+    b.fail("download (loopback)", "content");
+  }
+  server.set_options({0, 0, 16 * 1024, 0, false});
+  b.run("download (loopback, chunked)", wav.size(), [&]()
+        {
+          h = Hasher();
+          return download(WIDE("cfs_bench"), url.c_str(), WIDE("cfs_bench_dl.wav"), o, nullptr, &h); });
+  if (b.enabled("download (loopback, chunked)") && h.digest() != expected)
+  {
+    b.fail("download (loopback, chunked)", "content");
+  }
+#ifdef CFS_HAVE_ZLIB
+  // the body is decoded as it arrives, so the file and the hash are the same as without gzip
+  server.set_options({0, 0, 0, 0, true});
+  uint64_t received = 0;
+  b.run("download (loopback, gzip)", wav.size(), [&]()
+        {
+          h = Hasher();
+          received = 0;
+          return download(WIDE("cfs_bench"), url.c_str(), WIDE("cfs_bench_dl.wav"), o, nullptr, &h, nullptr, &received); });
+  if (b.enabled("download (loopback, gzip)") && (h.digest() != expected || received == 0 || received >= wav.size()))
+  {
+    b.fail("download (loopback, gzip)", "content");
+  }
+  if (b.enabled("download (gzip, failures)"))
+  {
+    // a compressed body that breaks off is resumed uncompressed from what has been decoded
+    server.set_options({0, 0, 0, 3, true});
+    o.retries = 3;
+    for (int i = 0; i < 4; ++i)
+    {
+      h = Hasher();
+      uint64_t size = 0;
+      if (FAILED(download(WIDE("cfs_bench"), url.c_str(), WIDE("cfs_bench_dl.wav"), o, nullptr, &h)) ||
+          h.digest() != expected || FAILED(file_get_size(WIDE("cfs_bench_dl.wav"), size)) || size != wav.size())
+      {
+        b.fail("download (gzip, failures)", "not recovered");
+        break;
+      }
+    }
+    o.retries = 0;
+  }
+#endif
+
+  // every third request fails with 503 or a broken connection, which the retries and
+  // the resumption with a Range request have to hide
+  if (b.enabled("download (failures)"))
+  {
+    server.set_options({0, 0, 0, 3, false});
+    o.retries = 3;
+    for (int i = 0; i < 4; ++i)
+    {
+      h = Hasher();
+      uint64_t size = 0;
+      if (FAILED(download(WIDE("cfs_bench"), url.c_str(), WIDE("cfs_bench_dl.wav"), o, nullptr, &h)) ||
+          h.digest() != expected || FAILED(file_get_size(WIDE("cfs_bench_dl.wav"), size)) || size != wav.size())
+      {
+        b.fail("download (failures)", "not recovered");
+        break;
+      }
+    }
+    o.retries = 0;
+  }
+  {
+    // a 404 is final and leaves nothing behind
+    const wstr missing = server.url("/missing.wav");
+    uint64_t size = 0;
+    server.set_options({0, 0, 0, 0, false});
+    if (SUCCEEDED(download(WIDE("cfs_bench"), missing.c_str(), WIDE("cfs_bench_404.wav"), o)) ||
+        SUCCEEDED(file_get_size(WIDE("cfs_bench_404.wav"), size)) || SUCCEEDED(file_get_size(WIDE("cfs_bench_404.wav.part"), size)))
+    {
+      b.fail("download (404)", "unexpected result");
+    }
+  }
+  {
+    // a redirect is not the clip, and is not saved as one
+    server.add_redirect("/moved.wav", "/clip.wav");
+    const wstr moved = server.url("/moved.wav");
+    uint64_t size = 0;
+    if (SUCCEEDED(download(WIDE("cfs_bench"), moved.c_str(), WIDE("cfs_bench_302.wav"), o)) ||
+        SUCCEEDED(file_get_size(WIDE("cfs_bench_302.wav"), size)) || SUCCEEDED(file_get_size(WIDE("cfs_bench_302.wav.part"), size)))
+    {
+      b.fail("download (302)", "unexpected result");
+    }
+  }
+  file_delete(WIDE("cfs_bench_dl.wav"));
+
+  server.set_options({2, 0, 0, 0, false});
+  bench_click_to_disk(b, server, clicks);
+#ifdef CFS_HAVE_ENGINE
+  bench_engine(b, server, clicks * 3);
+#endif
+  bench_download_all(b, server, clicks * 5);
+}
+
+#endif
+
+static void bench_api(bench_runner &b, const wstr &text)
+{
+  BenchAPI api;
+  picojson::object params;
+  {
+    std::string u8;
+    to_u8(text.substr(0, 256).c_str(), -1, u8);
+    params["userAgent"].set<std::string>("Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko)");
+    params["url"].set<std::string>("https://coefont.studio/example/0123456789abcdef.wav");
+    params["character"].set<std::string>("アルパカ");
+    params["text"].set<std::string>(u8);
+  }
+  bool ok = false;
+  const API::resolver fn = [&ok](const bool r, const picojson::object)
+  { ok = r; };
+  b.run("API::dispatch version", 0, [&]()
+        {
+          api.dispatch("version", picojson::object(), fn);
+          return ok ? S_OK : E_FAIL; });
+  {
+    // no transport on this platform, or nothing to download from: every item fails,
+    // but the batch has to resolve exactly once with the counts
+    picojson::object p;
+    p["userAgent"] = params["userAgent"];
+    picojson::array items;
+    for (int i = 0; i < 5; ++i)
+    {
+      picojson::object item;
+      item["url"].set<std::string>("http://127.0.0.1:1/missing.wav");
+      item["text"] = params["text"];
+      item["character"] = params["character"];
+      items.push_back(picojson::value(item));
+    }
+    p["items"].set<picojson::array>(items);
+    // far out of the range of int, which has to be clamped like the setting
+    p["concurrency"] = picojson::value(1e20);
+    std::mutex mtx;
+    std::condition_variable cv;
+    int calls = 0;
+    picojson::object r;
+    api.dispatch("downloadAll", p, [&](const bool ok, const picojson::object result)
+                 {
+                   std::lock_guard<std::mutex> lock(mtx);
+                   ++calls;
+                   r = result;
+                   r["ok"] = picojson::value(ok);
+                   cv.notify_all(); });
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait_for(lock, std::chrono::seconds(10), [&]()
+                { return calls > 0; });
+    if (calls != 1 || !r["ok"].get<bool>() || r["failed"].get<double>() != 5)
+    {
+      b.fail("API::dispatch downloadAll", "unexpected result");
+    }
+  }
+  {
+    // the save dialog is cancelled so this measures everything before the transfer;
+    // each call still queues the speculative download, which has to resolve as aborted
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t calls = 0, resolved = 0, succeeded = 0;
+    b.run("API::dispatch download", 0, [&]()
+          {
+            ++calls;
+            api.dispatch("download", params, [&](const bool r, const picojson::object)
+                         {
+                           std::lock_guard<std::mutex> lock(mtx);
+                           ++resolved;
+                           succeeded += r ? 1 : 0;
+                           cv.notify_all(); });
+            return S_OK; });
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait_for(lock, std::chrono::seconds(10), [&]()
+                { return resolved == calls; });
+    if (resolved != calls || succeeded != 0)
+    {
+      b.fail("API::dispatch download", "unexpected result");
+    }
+  }
+}
+
+// Reads lines of "<MB/s> <name>"; lines starting with '#' are comments.
+static bool load_baseline(const char *path, std::map<std::string, double> &dest)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f))
+  {
+    char *end = nullptr;
+    const double mbps = strtod(line, &end);
+    if (line[0] == '#' || end == line || *end != ' ')
+    {
+      continue;
+    }
+    std::string name(end + 1);
+    while (!name.empty() && (name.back() == '\n' || name.back() == '\r'))
+    {
+      name.pop_back();
+    }
+    dest[name] = mbps;
+  }
+  fclose(f);
+  return true;
+}
+
+static bool save_baseline(const char *path, const std::vector<std::pair<std::string, double>> &results)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+  {
+    return false;
+  }
+  fprintf(f, "# MB/s of each benchmark in a smoke run, which perf_smoke compares against.\n");
+  fprintf(f, "# Recorded with: cfs_bench --smoke --record <file>\n");
+  for (const auto &r : results)
+  {
+    fprintf(f, "%.2f %s\n", r.second, r.first.c_str());
+  }
+  return fclose(f) == 0;
+}
+
+int main(int argc, char **argv)
+{
+  bool smoke = false;
+  const char *filter = nullptr;
+  const char *record = nullptr;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--smoke") == 0)
+    {
+      smoke = true;
+    }
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+    {
+      record = argv[++i];
+    }
+    else
+    {
+      filter = argv[i];
+    }
+  }
+
+  // In smoke mode everything runs briefly and fails if the throughput drops below CFS_BENCH_MIN_MBPS,
+  // or more than CFS_BENCH_TOLERANCE below its entry in the baseline, unless it is being recorded.
+  double min_mbps = 0;
+  if (smoke)
+  {
+    const char *e = getenv("CFS_BENCH_MIN_MBPS");
+    min_mbps = e ? atof(e) : 1.0;
+  }
+  bench_runner b(smoke ? 0.02 : 0.5, min_mbps, filter);
+  if (smoke && !record)
+  {
+    const char *e = getenv("CFS_BENCH_BASELINE");
+#ifdef CFS_BENCH_BASELINE_FILE
+    const char *path = e ? e : CFS_BENCH_BASELINE_FILE;
+#else
+    const char *path = e;
+#endif
+    std::map<std::string, double> baseline;
+    if (path && !load_baseline(path, baseline))
+    {
+      printf("baseline %s could not be read\n", path);
+      return 1;
+    }
+    const char *t = getenv("CFS_BENCH_TOLERANCE");
+    b.set_baseline(std::move(baseline), t ? atof(t) : 0.6);
+  }
+
+  wstr text;
+  generate_text(smoke ? 64 * 1024 : 1024 * 1024, 1, text);
+  std::vector<uint8_t> wav;
+  generate_wav(smoke ? 2 : 30, 1, wav);
+
+  bench_encoding(b, text);
+  bench_swap(b, text);
+  bench_write_text(b, text);
+  bench_filename(b, text);
+  bench_json(b, text);
+  bench_wav(b, wav);
+  bench_hash(b, wav);
+#ifdef CFS_HAVE_ZLIB
+  bench_inflate(b, wav);
+#endif
+  check_cache(b, wav);
+  check_manifest(b);
+  check_progress(b);
+  check_throttle(b);
+  check_limiter(b);
+  bench_scheduler(b);
+  bench_api(b, text);
+#ifdef _WIN32
+  b.skip("download (loopback)", "needs the POSIX test server");
+#else
+  std::vector<uint8_t> long_wav;
+  generate_wav(smoke ? 10 : 60, 2, long_wav);
+  bench_download(b, long_wav, smoke ? 20 : 200);
+#endif
+  if (record && !save_baseline(record, b.results()))
+  {
+    printf("baseline %s could not be written\n", record);
+    return 1;
+  }
+  return b.failed() ? 1 : 0;
+}
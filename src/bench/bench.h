@@ -0,0 +1,148 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "core/platform.h"
+
+// Generates a deterministic corpus that resembles the scripts we usually export:
+// lines of mostly Japanese text with some ASCII and punctuation mixed in.
+void generate_text(size_t units, uint32_t seed, wstr &dest);
+
+// Generates a mono 16-bit PCM WAV file with speech-like bursts and long silences.
+void generate_wav(size_t seconds, uint32_t seed, std::vector<uint8_t> &dest);
+
+class bench_runner
+{
+  double min_seconds_;
+  double min_mbps_;
+  const char *filter_;
+  bool failed_;
+  // expected MB/s of each benchmark, and how far below it a result may fall
+  std::map<std::string, double> baseline_;
+  double tolerance_;
+  // MB/s of every benchmark that ran, in order
+  std::vector<std::pair<std::string, double>> results_;
+
+public:
+  bench_runner(double min_seconds, double min_mbps, const char *filter) : min_seconds_(min_seconds), min_mbps_(min_mbps), filter_(filter), failed_(false), tolerance_(0)
+  {
+    printf("%-32s %14s %12s\n", "name", "ns/op", "MB/s");
+  }
+
+  // Calls fn repeatedly until min_seconds elapsed and prints ns/op and MB/s.
+  // fn must return HRESULT; bytes is the amount of data processed by a single call.
+  template <class F>
+  void run(const char *name, size_t bytes, F fn)
+  {
+    if (!enabled(name))
+    {
+      return;
+    }
+    typedef std::chrono::steady_clock clock;
+    HRESULT hr = fn();
+    if (FAILED(hr))
+    {
+      return fail(name, "failed on warm-up", hr);
+    }
+    size_t iterations = 1, total = 0;
+    double elapsed = 0;
+    for (;;)
+    {
+      const auto start = clock::now();
+      for (size_t i = 0; i < iterations; ++i)
+      {
+        hr = fn();
+        if (FAILED(hr))
+        {
+          return fail(name, "failed", hr);
+        }
+      }
+      elapsed += std::chrono::duration<double>(clock::now() - start).count();
+      total += iterations;
+      if (elapsed >= min_seconds_)
+      {
+        break;
+      }
+      iterations *= 2;
+    }
+    const double ns = elapsed * 1e9 / (double)total;
+    const double mbps = bytes > 0 ? (double)bytes * (double)total / elapsed / (1024.0 * 1024.0) : 0;
+    if (bytes > 0)
+    {
+      printf("%-32s %14.1f %12.2f\n", name, ns, mbps);
+    }
+    else
+    {
+      printf("%-32s %14.1f %12s\n", name, ns, "-");
+    }
+    if (bytes == 0)
+    {
+      return;
+    }
+    results_.emplace_back(name, mbps);
+    if (mbps < min_mbps_)
+    {
+      printf("  %s: %.2f MB/s is below the threshold %.2f MB/s\n", name, mbps, min_mbps_);
+      failed_ = true;
+      return;
+    }
+    const auto it = baseline_.find(name);
+    if (it != baseline_.end() && mbps < it->second * (1.0 - tolerance_))
+    {
+      printf("  %s: %.2f MB/s is more than %.0f%% below the baseline %.2f MB/s\n", name, mbps, tolerance_ * 100.0, it->second);
+      failed_ = true;
+    }
+  }
+
+  // Fails every benchmark that falls more than tolerance, a fraction, below its entry in baseline.
+  void set_baseline(std::map<std::string, double> baseline, double tolerance)
+  {
+    baseline_ = std::move(baseline);
+    tolerance_ = tolerance;
+  }
+
+  const std::vector<std::pair<std::string, double>> &results() const
+  {
+    return results_;
+  }
+
+  bool enabled(const char *name) const
+  {
+    return !filter_ || strstr(name, filter_);
+  }
+
+  // Prints a figure measured by the caller, such as a percentile.
+  void print(const char *name, double ns)
+  {
+    if (!enabled(name))
+    {
+      return;
+    }
+    printf("%-32s %14.1f %12s\n", name, ns, "-");
+  }
+
+  void skip(const char *name, const char *reason)
+  {
+    if (!enabled(name))
+    {
+      return;
+    }
+    printf("%-32s %14s %12s  (%s)\n", name, "skipped", "-", reason);
+  }
+
+  void fail(const char *name, const char *reason, HRESULT hr = E_FAIL)
+  {
+    printf("%-32s %14s %12s  (%s: 0x%08x)\n", name, "FAILED", "-", reason, (unsigned int)hr);
+    failed_ = true;
+  }
+
+  bool failed() const
+  {
+    return failed_;
+  }
+};
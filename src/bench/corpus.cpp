@@ -0,0 +1,132 @@
+#include "bench.h"
+
+#include <math.h>
+
+namespace
+{
+  class rng
+  {
+    uint32_t s_;
+
+  public:
+    rng(uint32_t seed) : s_(seed ? seed : 0x12345678) {}
+    uint32_t next()
+    {
+      s_ ^= s_ << 13;
+      s_ ^= s_ >> 17;
+      s_ ^= s_ << 5;
+      return s_;
+    }
+    uint32_t below(uint32_t n)
+    {
+      return next() % n;
+    }
+  };
+}
+
+void generate_text(size_t units, uint32_t seed, wstr &dest)
+{
+  static const WCHAR kanji[] = WIDE("日本語音声合成文章読上今日天気明後雨晴時間会社学校先生友達電話言葉気持家族旅行映画楽写真仕事休暇料理美味食新聞番組世界自分意味場所");
+  static const WCHAR punct[] = WIDE("、。「」！？ー・…");
+  static const char *const words[] = {"CoeFont", "AviUtl", "OK", "2021", "STUDIO", "Hello", "v0.5"};
+  rng r(seed);
+  dest.resize(0);
+  dest.reserve(units + 16);
+  size_t line = 0;
+  while (dest.size() < units)
+  {
+    const uint32_t k = r.below(100);
+    if (k < 40)
+    {
+      dest += (WCHAR)(0x3041 + r.below(0x3093 - 0x3041 + 1));
+    }
+    else if (k < 55)
+    {
+      dest += (WCHAR)(0x30a1 + r.below(0x30f3 - 0x30a1 + 1));
+    }
+    else if (k < 85)
+    {
+      dest += kanji[r.below(sizeof(kanji) / sizeof(kanji[0]) - 1)];
+    }
+    else if (k < 93)
+    {
+      dest += punct[r.below(sizeof(punct) / sizeof(punct[0]) - 1)];
+    }
+    else if (k < 99)
+    {
+      for (const char *w = words[r.below(sizeof(words) / sizeof(words[0]))]; *w; ++w)
+      {
+        dest += (WCHAR)*w;
+      }
+    }
+    else
+    {
+      // U+20BB7, outside of the BMP
+      dest += (WCHAR)0xd842;
+      dest += (WCHAR)0xdfb7;
+    }
+    if (++line > 30 + r.below(40))
+    {
+      dest += WIDE("\r\n");
+      line = 0;
+    }
+  }
+  dest.resize(units);
+  if (!dest.empty() && dest.back() >= 0xd800 && dest.back() <= 0xdbff)
+  {
+    dest.back() = WIDE('.');
+  }
+}
+
+static void put16(std::vector<uint8_t> &d, uint16_t v)
+{
+  d.push_back((uint8_t)(v & 0xff));
+  d.push_back((uint8_t)(v >> 8));
+}
+
+static void put32(std::vector<uint8_t> &d, uint32_t v)
+{
+  put16(d, (uint16_t)(v & 0xffff));
+  put16(d, (uint16_t)(v >> 16));
+}
+
+void generate_wav(size_t seconds, uint32_t seed, std::vector<uint8_t> &dest)
+{
+  const uint32_t rate = 24000;
+  const uint32_t samples = (uint32_t)(seconds * rate);
+  rng r(seed);
+  dest.resize(0);
+  dest.reserve(44 + samples * 2);
+  dest.insert(dest.end(), {'R', 'I', 'F', 'F'});
+  put32(dest, 36 + samples * 2);
+  dest.insert(dest.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+  put32(dest, 16);
+  put16(dest, 1);
+  put16(dest, 1);
+  put32(dest, rate);
+  put32(dest, rate * 2);
+  put16(dest, 2);
+  put16(dest, 16);
+  dest.insert(dest.end(), {'d', 'a', 't', 'a'});
+  put32(dest, samples * 2);
+  uint32_t i = 0;
+  while (i < samples)
+  {
+    // silence between phrases
+    const uint32_t silence = rate / 10 + r.below(rate / 2);
+    for (uint32_t j = 0; j < silence && i < samples; ++j, ++i)
+    {
+      put16(dest, 0);
+    }
+    // voiced burst
+    const uint32_t voiced = rate / 5 + r.below(rate);
+    const double f0 = 100.0 + r.below(150);
+    for (uint32_t j = 0; j < voiced && i < samples; ++j, ++i)
+    {
+      const double t = (double)j / rate;
+      const double env = sin(3.14159265358979 * j / voiced);
+      const double v = env * (0.5 * sin(2 * 3.14159265358979 * f0 * t) + 0.2 * sin(2 * 3.14159265358979 * f0 * 2.7 * t)) + ((int)r.below(200) - 100) / 32768.0;
+      put16(dest, (uint16_t)(int16_t)(v * 12000));
+    }
+  }
+}
@@ -0,0 +1,350 @@
+#include "test_server.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef CFS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Bodies are written in slices of this size so that the rate limit is smooth.
+static constexpr size_t send_slice = 16 * 1024;
+
+static bool send_all(const int fd, const void *p, size_t bytes)
+{
+  const char *s = (const char *)p;
+  while (bytes > 0)
+  {
+    const ssize_t r = send(fd, s, bytes, MSG_NOSIGNAL);
+    if (r <= 0)
+    {
+      return false;
+    }
+    s += r;
+    bytes -= (size_t)r;
+  }
+  return true;
+}
+
+// Compresses src into a gzip stream, or leaves dest empty without zlib.
+static void gzip(const std::vector<uint8_t> &src, std::vector<uint8_t> &dest)
+{
+  dest.clear();
+#ifdef CFS_HAVE_ZLIB
+  z_stream z = {};
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    return;
+  }
+  dest.resize(deflateBound(&z, (uLong)src.size()));
+  z.next_in = (Bytef *)src.data();
+  z.avail_in = (uInt)src.size();
+  z.next_out = dest.data();
+  z.avail_out = (uInt)dest.size();
+  const int r = deflate(&z, Z_FINISH);
+  dest.resize(r == Z_STREAM_END ? z.total_out : 0);
+  deflateEnd(&z);
+#else
+  (void)src;
+#endif
+}
+
+static bool send_all(const int fd, const std::string &s)
+{
+  return send_all(fd, s.data(), s.size());
+}
+
+// Finds the value of the header name in the request, which is matched as "\r\nname:".
+static bool find_header(const std::string &request, const char *name, std::string &value)
+{
+  std::string lower = request;
+  std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c)
+                 { return (char)tolower(c); });
+  const size_t p = lower.find("\r\n" + std::string(name) + ":");
+  if (p == std::string::npos)
+  {
+    return false;
+  }
+  const size_t v = request.find_first_not_of(" \t", p + 3 + strlen(name));
+  const size_t e = request.find("\r\n", v);
+  value = request.substr(v, e - v);
+  return true;
+}
+
+test_server::test_server() : options_(), listener_(-1), port_(0), stopping_(false), requests_(0)
+{
+}
+
+test_server::~test_server()
+{
+  stop();
+}
+
+HRESULT test_server::start()
+{
+  listener_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener_ == -1)
+  {
+    return last_error();
+  }
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  if (bind(listener_, (sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener_, 64) == -1 ||
+      getsockname(listener_, (sockaddr *)&addr, &len) == -1)
+  {
+    const HRESULT hr = last_error();
+    close(listener_);
+    listener_ = -1;
+    return hr;
+  }
+  port_ = ntohs(addr.sin_port);
+  stopping_ = false;
+  acceptor_ = std::thread(&test_server::accept_loop, this);
+  return S_OK;
+}
+
+void test_server::stop()
+{
+  if (listener_ == -1)
+  {
+    return;
+  }
+  stopping_ = true;
+  shutdown(listener_, SHUT_RDWR);
+  acceptor_.join();
+  close(listener_);
+  listener_ = -1;
+  std::vector<std::thread> connections;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (const int fd : sockets_)
+    {
+      shutdown(fd, SHUT_RDWR);
+    }
+    connections.swap(connections_);
+  }
+  for (std::thread &t : connections)
+  {
+    t.join();
+  }
+}
+
+void test_server::set_options(const test_server_options &options)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  options_ = options;
+}
+
+void test_server::add_file(const std::string &path, std::vector<uint8_t> body)
+{
+  std::vector<uint8_t> gzipped;
+  gzip(body, gzipped);
+  std::lock_guard<std::mutex> lock(mtx_);
+  files_[path] = std::move(body);
+  gzipped_[path] = std::move(gzipped);
+}
+
+void test_server::add_redirect(const std::string &path, const std::string &location)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  redirects_[path] = location;
+}
+
+wstr test_server::url(const std::string &path) const
+{
+  const std::string u = "http://127.0.0.1:" + std::to_string(port_) + path;
+  return wstr(u.begin(), u.end());
+}
+
+void test_server::accept_loop()
+{
+  for (;;)
+  {
+    const int fd = accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+      if (stopping_)
+      {
+        return;
+      }
+      continue;
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (stopping_)
+    {
+      close(fd);
+      return;
+    }
+    sockets_.push_back(fd);
+    connections_.emplace_back(&test_server::serve, this, fd);
+  }
+}
+
+void test_server::serve(const int fd)
+{
+  std::string pending;
+  char buf[4096];
+  for (;;)
+  {
+    const size_t end = pending.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+      const ssize_t r = recv(fd, buf, sizeof(buf), 0);
+      if (r <= 0)
+      {
+        break;
+      }
+      pending.append(buf, (size_t)r);
+      continue;
+    }
+    const std::string request = pending.substr(0, end + 2);
+    pending.erase(0, end + 4);
+    if (!respond(fd, request))
+    {
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mtx_);
+  sockets_.erase(std::find(sockets_.begin(), sockets_.end(), fd));
+  close(fd);
+}
+
+// Sends one response. Returns false if the connection has to be closed.
+bool test_server::respond(const int fd, const std::string &request)
+{
+  const uint64_t n = ++requests_;
+  test_server_options o;
+  const std::vector<uint8_t> *body = nullptr;
+  const std::vector<uint8_t> *gzipped = nullptr;
+  std::string location;
+  {
+    // GET /path HTTP/1.1
+    const size_t sp1 = request.find(' ');
+    const size_t sp2 = request.find(' ', sp1 + 1);
+    const std::string path = sp1 == std::string::npos ? std::string() : request.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::lock_guard<std::mutex> lock(mtx_);
+    o = options_;
+    const auto it = files_.find(path.substr(0, path.find('?')));
+    if (it != files_.end())
+    {
+      body = &it->second;
+      gzipped = &gzipped_[it->first];
+    }
+    const auto r = redirects_.find(path);
+    if (r != redirects_.end())
+    {
+      location = r->second;
+    }
+  }
+  if (o.latency > 0)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(o.latency));
+  }
+  std::string v;
+  const bool keep_alive = !(find_header(request, "connection", v) && v == "close");
+  if (!location.empty())
+  {
+    return send_all(fd, "HTTP/1.1 302 Found\r\nLocation: " + location + "\r\nContent-Length: 0\r\n\r\n") && keep_alive;
+  }
+  if (!body)
+  {
+    return send_all(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+  }
+  const bool fail = o.fail_every > 0 && n % (uint64_t)o.fail_every == 0;
+  if (fail && (n / (uint64_t)o.fail_every) % 2 == 1)
+  {
+    return send_all(fd, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n") && keep_alive;
+  }
+
+  uint64_t offset = 0;
+  if (find_header(request, "range", v) && v.compare(0, 6, "bytes=") == 0)
+  {
+    offset = strtoull(v.c_str() + 6, nullptr, 10);
+    if (offset >= body->size())
+    {
+      return send_all(fd, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n") && keep_alive;
+    }
+  }
+  // only a whole body is compressed, as a server would with a precompressed file
+  const bool compress = o.gzip && offset == 0 && !gzipped->empty() &&
+                        find_header(request, "accept-encoding", v) && v.find("gzip") != std::string::npos;
+  if (compress)
+  {
+    body = gzipped;
+  }
+  const uint64_t size = body->size();
+  std::string headers = offset > 0 ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+  headers += "Content-Type: audio/wav\r\n";
+  if (compress)
+  {
+    headers += "Content-Encoding: gzip\r\n";
+  }
+  if (offset > 0)
+  {
+    headers += "Content-Range: bytes " + std::to_string(offset) + "-" + std::to_string(size - 1) + "/" + std::to_string(size) + "\r\n";
+  }
+  if (o.chunk_size > 0)
+  {
+    headers += "Transfer-Encoding: chunked\r\n";
+  }
+  else
+  {
+    headers += "Content-Length: " + std::to_string(size - offset) + "\r\n";
+  }
+  headers += keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+  if (!send_all(fd, headers))
+  {
+    return false;
+  }
+
+  // a failing response stops halfway and drops the connection
+  const uint64_t stop = fail ? offset + (size - offset) / 2 : size;
+  const size_t slice = o.chunk_size > 0 ? o.chunk_size : send_slice;
+  const auto start = std::chrono::steady_clock::now();
+  uint64_t sent = 0;
+  for (uint64_t p = offset; p < stop;)
+  {
+    const size_t len = (size_t)std::min<uint64_t>(slice, stop - p);
+    if (o.chunk_size > 0)
+    {
+      char line[32];
+      snprintf(line, sizeof(line), "%zx\r\n", len);
+      if (!send_all(fd, line, strlen(line)))
+      {
+        return false;
+      }
+    }
+    if (!send_all(fd, body->data() + p, len) || (o.chunk_size > 0 && !send_all(fd, "\r\n", 2)))
+    {
+      return false;
+    }
+    p += len;
+    sent += len;
+    if (o.bytes_per_second > 0)
+    {
+      std::this_thread::sleep_until(start + std::chrono::duration<double>((double)sent / (double)o.bytes_per_second));
+    }
+  }
+  if (fail)
+  {
+    return false;
+  }
+  if (o.chunk_size > 0 && !send_all(fd, "0\r\n\r\n"))
+  {
+    return false;
+  }
+  return keep_alive;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/platform.h"
+
+struct test_server_options
+{
+  // Delay before each response in milliseconds.
+  int latency;
+  // Rate of each response body in bytes per second. 0 sends as fast as possible.
+  uint64_t bytes_per_second;
+  // If not 0, bodies are sent with chunked transfer encoding in chunks of this size.
+  size_t chunk_size;
+  // If not 0, every fail_every-th request fails, alternately with 503 and with the
+  // connection dropped halfway through the body.
+  int fail_every;
+  // Whether a request from the start that accepts gzip gets the body compressed.
+  bool gzip;
+};
+
+// HTTP/1.1 server on the loopback interface serving files from memory, so that the
+// download path can be measured without the network. It supports keep-alive and
+// "Range: bytes=N-" requests, which is what download() uses, and gzip when built with zlib.
+class test_server
+{
+  std::mutex mtx_;
+  test_server_options options_;
+  std::map<std::string, std::vector<uint8_t>> files_;
+  // gzip of the files
+  std::map<std::string, std::vector<uint8_t>> gzipped_;
+  // path to Location of the paths answered with 302
+  std::map<std::string, std::string> redirects_;
+  int listener_;
+  int port_;
+  std::thread acceptor_;
+  std::vector<std::thread> connections_;
+  std::vector<int> sockets_;
+  std::atomic<bool> stopping_;
+  std::atomic<uint64_t> requests_;
+
+  void accept_loop();
+  void serve(const int fd);
+  bool respond(const int fd, const std::string &request);
+
+public:
+  test_server();
+  ~test_server();
+
+  // Listens on a free port of 127.0.0.1.
+  HRESULT start();
+  void stop();
+
+  void set_options(const test_server_options &options);
+  // Serves body at path, which starts with '/'.
+  void add_file(const std::string &path, std::vector<uint8_t> body);
+  // Answers path with a 302 to location.
+  void add_redirect(const std::string &path, const std::string &location);
+  // Returns the URL of path on this server.
+  wstr url(const std::string &path) const;
+  // Returns the number of requests received so far.
+  uint64_t requests() const
+  {
+    return requests_;
+  }
+};
@@ -0,0 +1,1127 @@
+#include "api.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+
+#include "download.h"
+#include "encoding.h"
+#include "filename.h"
+#include "http.h"
+#include "setting.h"
+#include "text.h"
+
+// How the clips of one request are fetched and recorded, shared by its jobs.
+struct save_options
+{
+  wstr user_agent;
+  download_options download;
+  AudioCache *cache;
+  Manifest *manifest;
+  Progress *progress;
+  // the job whose progress is reported, empty if it is not
+  std::string job_id;
+};
+
+// Clips fetched while the save dialog is open start with this and are left behind by a crash;
+// any older than an hour are swept, as no download takes that long.
+static LPCWSTR const temp_prefix = WIDE("~cfs");
+constexpr uint64_t stale_temp_seconds = 60 * 60;
+
+// Returns the hidden folder in folder, which ends with a separator, that holds the clips
+// fetched while the save dialog is open.
+static wstr work_folder(const wstr &folder)
+{
+  return folder + WIDE(".cfs") + folder.back();
+}
+
+// Removes what an earlier run left in dir, on a batch job so that it does not hold up anything.
+static void sweep_temp_files(Scheduler &scheduler, const wstr &dir)
+{
+  report(scheduler.submit(
+             std::string(),
+             [dir](const std::atomic<bool> &cancelled)
+             {
+               if (!cancelled)
+               {
+                 report(dir_sweep(dir.c_str(), temp_prefix, stale_temp_seconds), WIDE("[WARN] failed to sweep temporary files"));
+               }
+             },
+             PRIORITY_BATCH),
+         WIDE("[WARN] failed to queue the sweep of temporary files"));
+}
+
+// The answer of the save dialog, handed from the UI thread to the download job.
+struct pending_save
+{
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool decided;
+  HRESULT result;
+  int text_encoding;
+  wstr filename;
+  HRESULT text_result;
+  uint64_t text_size;
+  uint64_t text_hash;
+};
+
+static wstr text_filename(const wstr &filename)
+{
+  wstr textname = filename;
+  textname.resize(textname.rfind(WIDE('.')) + 1);
+  textname += WIDE("txt");
+  return textname;
+}
+
+// The text is written to textname + ".part" and moved into place only once the audio has been,
+// so that a save that fails leaves an earlier pair of files as it was.
+static HRESULT write_text_part(const wstr &textname, const wstr &text, const int text_encoding, Hasher &hash)
+{
+  return write_text((textname + WIDE(".part")).c_str(), text.c_str(), text_encoding, &hash);
+}
+
+// Moves the text written by write_text_part into place, or removes it if that fails.
+static HRESULT move_text_part(const wstr &textname)
+{
+  const wstr part = textname + WIDE(".part");
+  const HRESULT hr = file_move(part.c_str(), textname.c_str());
+  if (FAILED(hr))
+  {
+    file_delete(part.c_str());
+  }
+  return hr;
+}
+
+API::API(LPCWSTR version)
+    : version_(version),
+      filename_template_(),
+      seq_(0),
+      progress_(progress_per_second, [this](const picojson::array &jobs)
+                { post_progress(jobs); }),
+      limiter_(2, max_concurrency),
+#ifdef CFS_HAVE_ENGINE
+      engine_(2, engine_window / 2),
+#endif
+      scheduler_(8, 256),
+      speculative_(0)
+{
+}
+
+API::~API()
+{
+}
+
+void API::shutdown()
+{
+  scheduler_.shutdown();
+#ifdef CFS_HAVE_ENGINE
+  engine_.shutdown();
+#endif
+  progress_.stop();
+  cache_.flush();
+  manifest_.flush();
+}
+
+void API::start_warm_up(const wstr &user_agent, const wstr &url) const
+{
+  // a batch job never takes the worker kept free for clicks
+  report(scheduler_.submit(
+             std::string(),
+             [this, user_agent, url](const std::atomic<bool> &cancelled)
+             {
+               if (cancelled)
+               {
+                 return;
+               }
+               setting s;
+               default_setting(s);
+               get_setting(s);
+               prepare_cache(s);
+               wstr temp;
+               if (SUCCEEDED(get_temp_dir(temp)))
+               {
+                 report(dir_sweep(temp.c_str(), temp_prefix, stale_temp_seconds), WIDE("[WARN] failed to sweep temporary files"));
+               }
+               report(warm_up(user_agent.c_str(), url.c_str()), WIDE("[WARN] warm_up failed"));
+             },
+             PRIORITY_BATCH),
+         WIDE("[WARN] failed to queue warm_up"));
+}
+
+void API::dispatch(const std::string &method, picojson::object params, resolver fn) const
+{
+  if (method == "version")
+  {
+    return api_version(params, fn);
+  }
+  else if (method == "download")
+  {
+    return api_download(params, fn);
+  }
+  else if (method == "downloadAll")
+  {
+    return api_download_all(params, fn);
+  }
+  else if (method == "cancel")
+  {
+    return api_cancel(params, fn);
+  }
+  else if (method == "concurrency")
+  {
+    return api_concurrency(params, fn);
+  }
+  return error_invalid_call(fn);
+}
+
+void API::api_version(const picojson::object params, resolver fn) const
+{
+  (void)params;
+  picojson::object result;
+  std::string v;
+  to_u8(version_, -1, v);
+  result["version"].set<std::string>(v);
+  return fn(true, result);
+}
+
+void API::api_download(const picojson::object params, resolver fn) const
+{
+  wstr user_agent;
+  if (!get_string(params, "userAgent", user_agent))
+  {
+    return error_invalid_args(fn);
+  }
+  wstr url;
+  if (!get_string(params, "url", url))
+  {
+    return error_invalid_args(fn);
+  }
+  wstr character;
+  if (!get_string(params, "character", character))
+  {
+    return error_invalid_args(fn);
+  }
+  wstr text;
+  if (!get_string(params, "text", text))
+  {
+    return error_invalid_args(fn);
+  }
+  std::string job_id;
+  {
+    const auto it = params.find("jobId");
+    if (it != params.end())
+    {
+      if (!it->second.is<std::string>())
+      {
+        return error_invalid_args(fn);
+      }
+      job_id = it->second.get<std::string>();
+    }
+  }
+
+  setting s;
+  default_setting(s);
+  get_setting(s);
+  auto o = std::make_shared<save_options>();
+  get_save_options(s, *o);
+  o->user_agent = user_agent;
+  o->job_id = job_id;
+  const uint64_t cache_key = AudioCache::key(character.c_str(), text.c_str(), url.c_str());
+  wstr default_filename;
+  build_filename(s, character.c_str(), text.c_str(), default_filename);
+
+  // The clip is fetched into a temporary file while the user is choosing where to save it.
+  wstr temp_filename;
+  build_temp_filename(temp_filename);
+  const std::string id = job_id.empty() ? "#" + std::to_string(++speculative_) : job_id;
+  auto p = std::make_shared<pending_save>();
+  p->decided = false;
+  p->result = S_OK;
+  p->text_encoding = ENCODING_UTF8BOM;
+  p->text_result = E_ABORT;
+  p->text_size = 0;
+  p->text_hash = 0;
+  HRESULT hr = scheduler_.submit(
+      id,
+      [o, url, cache_key, temp_filename, p, fn](const std::atomic<bool> &cancelled)
+      { api_download_worker(o, url, cache_key, temp_filename, p, cancelled, fn); });
+  if (hr == HRESULT_FROM_WIN32(ERROR_BUSY))
+  {
+    return error_busy(fn);
+  }
+  if (hr == E_INVALIDARG)
+  {
+    return error_invalid_args(fn);
+  }
+  if (FAILED(hr))
+  {
+    return error_abort(fn);
+  }
+
+  int text_encoding = ENCODING_UTF8BOM;
+  wstr filename;
+  hr = show_save_dialog(default_filename.c_str(), text_encoding, filename);
+  HRESULT text_hr = E_ABORT;
+  Hasher text_hash;
+  if (FAILED(hr))
+  {
+    scheduler_.cancel(id);
+  }
+  else
+  {
+    const size_t sep = filename.find_last_of(WIDE("\\/"));
+    if (sep != wstr::npos)
+    {
+      wstr folder = filename.substr(0, sep + 1);
+      if (folder != last_folder_)
+      {
+        last_folder_ = std::move(folder);
+        sweep_temp_files(scheduler_, work_folder(last_folder_));
+      }
+    }
+    // the text is written here while the transfer may still be running
+    text_hr = write_text_part(text_filename(filename), text, text_encoding, text_hash);
+  }
+  // the job resolves fn once both the transfer and the dialog are done
+  std::lock_guard<std::mutex> lock(p->mtx);
+  p->decided = true;
+  p->result = hr;
+  p->text_encoding = text_encoding;
+  p->filename = std::move(filename);
+  p->text_result = text_hr;
+  p->text_size = text_hash.length();
+  p->text_hash = text_hash.digest();
+  p->cv.notify_all();
+}
+
+void API::api_cancel(const picojson::object params, resolver fn) const
+{
+  const auto it = params.find("jobId");
+  if (it == params.end() || !it->second.is<std::string>())
+  {
+    return error_invalid_args(fn);
+  }
+  picojson::object result;
+  result["cancelled"] = picojson::value(scheduler_.cancel(it->second.get<std::string>()));
+  return fn(true, result);
+}
+
+void API::api_concurrency(const picojson::object params, resolver fn) const
+{
+  (void)params;
+  picojson::object result;
+  limiter_.get_state(result);
+  return fn(true, result);
+}
+
+void API::prepare_filename_template(const setting &s) const
+{
+  if (filename_template_.ops.empty() || s.filename_pattern != filename_pattern_)
+  {
+    filename_pattern_ = s.filename_pattern;
+    if (filename_pattern_.empty() ||
+        report(compile_filename_template(filename_pattern_.c_str(), filename_template_),
+               WIDE("invalid filename template")))
+    {
+      compile_filename_template(default_filename_template, filename_template_);
+    }
+  }
+}
+
+void API::build_filename(const setting &s, LPCWSTR character, LPCWSTR text, wstr &dest) const
+{
+  prepare_filename_template(s);
+  const filename_params params = {character, text, ++seq_};
+  format_filename(filename_template_, params, WIDE(".wav"), dest);
+}
+
+void API::get_save_options(const setting &s, save_options &dest) const
+{
+  default_download_options(dest.download);
+  dest.download.connect_timeout = s.connect_timeout;
+  dest.download.receive_timeout = s.receive_timeout;
+  dest.download.retries = s.download_retries;
+  throttle_.set_rate((uint64_t)s.max_bytes_per_second);
+  dest.download.throttle = &throttle_;
+  // interactive transfers do not wait for the limiter but still tell it how the server is doing
+  dest.download.limiter = &limiter_;
+  dest.cache = prepare_cache(s);
+  dest.manifest = s.write_manifest ? &manifest_ : nullptr;
+  dest.progress = &progress_;
+}
+
+void API::post_progress(const picojson::array &jobs) const
+{
+  picojson::object params;
+  params["jobs"] = picojson::value(jobs);
+  picojson::object message;
+  message["event"].set<std::string>("progress");
+  message["params"] = picojson::value(params);
+  post_event(message);
+}
+
+AudioCache *API::prepare_cache(const setting &s) const
+{
+  if (s.cache_size <= 0)
+  {
+    return nullptr;
+  }
+  const uint64_t max_bytes = (uint64_t)s.cache_size << 20;
+  // usually opened by the warm-up already, but the cache may have been turned on since
+  std::lock_guard<std::mutex> lock(cache_mtx_);
+  if (!cache_.is_open())
+  {
+    wstr folder;
+    if (FAILED(get_cache_folder(folder)) ||
+        report(cache_.open(folder.c_str(), max_bytes), WIDE("failed to open the audio cache")))
+    {
+      return nullptr;
+    }
+  }
+  cache_.set_max_bytes(max_bytes);
+  return &cache_;
+}
+
+void API::build_temp_filename(wstr &dest) const
+{
+  // a hidden folder next to the last saved clip keeps the final move on its volume and the
+  // partial files out of sight; the first clip of a session goes through the temporary folder
+  dest.clear();
+  if (!last_folder_.empty())
+  {
+    dest = work_folder(last_folder_);
+    if (report(dir_create_hidden(dest.substr(0, dest.size() - 1).c_str()), WIDE("failed to create the work folder")))
+    {
+      dest.clear();
+    }
+  }
+  if (dest.empty() && report(get_temp_dir(dest), WIDE("failed to get the temporary folder")))
+  {
+    dest.clear();
+  }
+  const auto t = std::chrono::steady_clock::now().time_since_epoch().count();
+  dest += temp_prefix;
+  for (const char c : std::to_string(t) + "_" + std::to_string(++speculative_))
+  {
+    dest += (WCHAR)c;
+  }
+  dest += WIDE(".tmp");
+}
+
+struct download_batch
+{
+  struct item
+  {
+    wstr url;
+    wstr text;
+    wstr character;
+    // built once the folder is known
+    wstr filepath;
+    uint64_t cache_key;
+  };
+  save_options options;
+  int text_encoding;
+  std::vector<item> items;
+  std::atomic<size_t> next;
+  std::atomic<size_t> saved;
+  std::atomic<size_t> failed;
+  // the audio downloaded and the bytes it took over the network
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> received;
+  std::atomic<int> lanes;
+  std::atomic<bool> aborted;
+  API::resolver fn;
+};
+
+// Adds how much of the downloaded audio came over the network. compressionRatio is above 1
+// when the server compressed it. Clips from the cache are not counted.
+static void add_compression(picojson::object &result, const uint64_t bytes, const uint64_t received)
+{
+  result["bytes"] = picojson::value((double)bytes);
+  result["receivedBytes"] = picojson::value((double)received);
+  if (received > 0)
+  {
+    result["compressionRatio"] = picojson::value((double)bytes / (double)received);
+  }
+}
+
+// Resolves the batch when the last lane is done.
+static void finish_download_all(const std::shared_ptr<download_batch> &b)
+{
+  if (--b->lanes > 0)
+  {
+    return;
+  }
+  if (!b->options.job_id.empty())
+  {
+    b->options.progress->finish(b->options.job_id);
+  }
+  // the index of the cache is written once for the whole batch
+  if (b->options.cache)
+  {
+    report(b->options.cache->flush(), WIDE("failed to write the index of the audio cache"));
+  }
+  picojson::object result;
+  result["saved"] = picojson::value((double)b->saved);
+  result["failed"] = picojson::value((double)b->failed);
+  result["cancelled"] = picojson::value(b->aborted.load());
+  add_compression(result, b->bytes, b->received);
+  return b->fn(true, result);
+}
+
+#ifdef CFS_HAVE_ENGINE
+// Returns whether every clip of the batch can be fetched by the engine, which speaks plain http only.
+static bool use_engine(const download_batch &b)
+{
+  http_url url;
+  for (const download_batch::item &item : b.items)
+  {
+    if (FAILED(parse_http_url(item.url.c_str(), url)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+void API::api_download_all(const picojson::object params, resolver fn) const
+{
+  wstr user_agent;
+  if (!get_string(params, "userAgent", user_agent))
+  {
+    return error_invalid_args(fn);
+  }
+  const auto itemsit = params.find("items");
+  if (itemsit == params.end() || !itemsit->second.is<picojson::array>())
+  {
+    return error_invalid_args(fn);
+  }
+  const picojson::array &items = itemsit->second.get<picojson::array>();
+  std::string job_id;
+  {
+    const auto it = params.find("jobId");
+    if (it != params.end())
+    {
+      if (!it->second.is<std::string>())
+      {
+        return error_invalid_args(fn);
+      }
+      job_id = it->second.get<std::string>();
+    }
+  }
+  setting s;
+  default_setting(s);
+  get_setting(s);
+  int concurrency = s.download_concurrency;
+  {
+    const auto it = params.find("concurrency");
+    if (it != params.end() && it->second.is<double>())
+    {
+      // clamped before the conversion, which is undefined for values out of the range of int
+      const double v = it->second.get<double>();
+      concurrency = v < 0 ? 0 : v > 8 ? 8
+                                      : (int)v;
+    }
+  }
+
+  auto b = std::make_shared<download_batch>();
+  get_save_options(s, b->options);
+  b->options.user_agent = user_agent;
+  b->options.job_id = job_id;
+  b->options.download.interactive = false;
+  if (concurrency > 0)
+  {
+    b->options.download.limiter = nullptr;
+  }
+  else
+  {
+    // every lane is started, but only as many send requests as the limiter allows
+    concurrency = max_concurrency;
+  }
+  b->text_encoding = s.text_encoding;
+  b->items.reserve(items.size());
+  for (const picojson::value &v : items)
+  {
+    if (!v.is<picojson::object>())
+    {
+      return error_invalid_args(fn);
+    }
+    const picojson::object &o = v.get<picojson::object>();
+    download_batch::item item;
+    if (!get_string(o, "url", item.url) || !get_string(o, "text", item.text) || !get_string(o, "character", item.character))
+    {
+      return error_invalid_args(fn);
+    }
+    item.cache_key = AudioCache::key(item.character.c_str(), item.text.c_str(), item.url.c_str());
+    b->items.push_back(std::move(item));
+  }
+  if (b->items.empty())
+  {
+    picojson::object result;
+    result["saved"] = picojson::value(0.0);
+    result["failed"] = picojson::value(0.0);
+    return fn(true, result);
+  }
+
+  wstr folder;
+  {
+    HRESULT hr = show_folder_dialog(folder);
+    if (hr == HRESULT_FROM_WIN32(ERROR_CANCELLED))
+    {
+      return error_abort(fn);
+    }
+    if (FAILED(hr))
+    {
+      return error_internal(fn);
+    }
+  }
+  prepare_filename_template(s);
+  {
+    std::set<wstr> used;
+    // a name is taken by another clip of the batch, or by a file already in the folder, which
+    // would be replaced without asking while the save dialog asks first
+    const auto taken = [&used, &folder](const wstr &name)
+    {
+      uint64_t size = 0;
+      return used.count(name) > 0 || SUCCEEDED(file_get_size((folder + name + WIDE(".wav")).c_str(), size)) ||
+             SUCCEEDED(file_get_size((folder + name + WIDE(".txt")).c_str(), size));
+    };
+    wstr name;
+    for (size_t i = 0; i < b->items.size(); ++i)
+    {
+      download_batch::item &item = b->items[i];
+      const filename_params params = {item.character.c_str(), item.text.c_str(), (int)(i + 1)};
+      format_filename(filename_template_, params, WIDE(""), name);
+      // lines with the same beginning get the same name within the same second
+      if (taken(name))
+      {
+        const wstr base = name;
+        for (int n = 2; taken(name); ++n)
+        {
+          name = base;
+          name += WIDE(" (");
+          for (const char c : std::to_string(n))
+          {
+            name += (WCHAR)c;
+          }
+          name += WIDE(")");
+        }
+      }
+      used.insert(name);
+      item.filepath = folder + name + WIDE(".wav");
+    }
+  }
+  seq_ += (int)b->items.size();
+
+  b->next = 0;
+  b->saved = 0;
+  b->failed = 0;
+  b->bytes = 0;
+  b->received = 0;
+  b->aborted = false;
+  b->fn = fn;
+  if (!job_id.empty())
+  {
+    progress_.start(job_id, b->items.size());
+  }
+#ifdef CFS_HAVE_ENGINE
+  if (s.max_bytes_per_second == 0 && use_engine(*b))
+  {
+    // a single job keeps a window of transfers in flight on the engine, which the limiter
+    // narrows to what the server copes with unless the concurrency is fixed
+    const size_t window = b->options.download.limiter ? engine_window : (size_t)concurrency;
+    b->lanes = 1;
+    const HRESULT hr = scheduler_.submit(
+        job_id,
+        [this, b, window](const std::atomic<bool> &cancelled)
+        { api_download_all_engine(b, engine_, window, cancelled); },
+        PRIORITY_BATCH);
+    if (FAILED(hr))
+    {
+      progress_.finish(job_id);
+      return hr == HRESULT_FROM_WIN32(ERROR_BUSY) ? error_busy(fn) : error_invalid_args(fn);
+    }
+    return;
+  }
+#endif
+  const int lanes = concurrency < (int)b->items.size() ? concurrency : (int)b->items.size();
+  // one extra reference is held until all lanes are queued, so the batch cannot finish early
+  b->lanes = 1;
+  int queued = 0;
+  HRESULT hr = S_OK;
+  for (int i = 0; i < lanes; ++i)
+  {
+    ++b->lanes;
+    hr = scheduler_.submit(
+        job_id.empty() ? job_id : job_id + "/" + std::to_string(i),
+        [b](const std::atomic<bool> &cancelled)
+        { api_download_all_worker(b, cancelled); },
+        PRIORITY_BATCH);
+    if (FAILED(hr))
+    {
+      --b->lanes;
+      break;
+    }
+    ++queued;
+  }
+  if (queued == 0)
+  {
+    progress_.finish(job_id);
+    return hr == HRESULT_FROM_WIN32(ERROR_BUSY) ? error_busy(fn) : error_invalid_args(fn);
+  }
+  // the lanes that have been queued share the whole batch
+  finish_download_all(b);
+}
+
+// Returns the name of the text file saved next to the audio file filename.
+// Returns a callback that adds the transfer of one file to the progress of the job.
+static download_progress track_progress(const save_options &o)
+{
+  if (o.job_id.empty())
+  {
+    return nullptr;
+  }
+  auto last = std::make_shared<std::pair<uint64_t, uint64_t>>(0, 0);
+  Progress *progress = o.progress;
+  const std::string job_id = o.job_id;
+  return [progress, job_id, last](uint64_t bytes, uint64_t total)
+  {
+    progress->add(job_id, (int64_t)(bytes - last->first), (int64_t)(total - last->second));
+    *last = {bytes, total};
+  };
+}
+
+// Puts the audio of url at filepath, taking it from the cache if it is there.
+// hash and size receive the XXH64 and the length of the file, and received the bytes
+// that came over the network for it, which is 0 from the cache.
+static HRESULT fetch_audio(
+    const save_options &o,
+    const wstr &url,
+    const uint64_t cache_key,
+    const wstr &filepath,
+    const std::atomic<bool> &cancelled,
+    uint64_t &hash,
+    uint64_t &size,
+    uint64_t &received)
+{
+  received = 0;
+  if (cancelled)
+  {
+    return E_ABORT;
+  }
+  const download_progress progress = track_progress(o);
+  if (o.cache && o.cache->fetch(cache_key, filepath.c_str(), &hash, &size) == S_OK)
+  {
+    if (progress)
+    {
+      progress(size, size);
+    }
+    return S_OK;
+  }
+  Hasher h;
+  const HRESULT hr = download(o.user_agent.c_str(), url.c_str(), filepath.c_str(), o.download, &cancelled, &h, progress, &received);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  hash = h.digest();
+  size = h.length();
+  if (o.cache)
+  {
+    report(o.cache->store(cache_key, filepath.c_str(), hash), WIDE("failed to add to the audio cache"));
+  }
+  return S_OK;
+}
+
+// Downloads url into filename and writes text next to it.
+// The text is written before the transfer and moved into place after it; if either fails,
+// neither file is replaced. size and received are those of fetch_audio.
+// Returns S_FALSE if the text had to be written in UTF-8 instead of Shift_JIS.
+static HRESULT save_clip(
+    const save_options &o,
+    const wstr &url,
+    const uint64_t cache_key,
+    const wstr &text,
+    const int text_encoding,
+    const wstr &filename,
+    const std::atomic<bool> &cancelled,
+    uint64_t &size,
+    uint64_t &received)
+{
+  if (cancelled)
+  {
+    return E_ABORT;
+  }
+  const wstr textname = text_filename(filename);
+  Hasher text_hash;
+  // write_text leaves nothing behind when it fails
+  const HRESULT text_hr = write_text_part(textname, text, text_encoding, text_hash);
+  if (FAILED(text_hr))
+  {
+    return text_hr;
+  }
+  uint64_t hash = 0;
+  const HRESULT hr = fetch_audio(o, url, cache_key, filename, cancelled, hash, size, received);
+  if (FAILED(hr))
+  {
+    file_delete((textname + WIDE(".part")).c_str());
+    return hr;
+  }
+  const HRESULT move_hr = move_text_part(textname);
+  if (FAILED(move_hr))
+  {
+    file_delete(filename.c_str());
+    return move_hr;
+  }
+  if (o.manifest)
+  {
+    o.manifest->add(filename.c_str(), size, hash);
+    o.manifest->add(textname.c_str(), text_hash.length(), text_hash.digest());
+  }
+  return text_hr;
+}
+
+#ifdef CFS_HAVE_ENGINE
+// Writes text next to the audio at filename that has been fetched, and records both.
+// The audio is removed if the text cannot be written.
+static HRESULT record_clip(
+    const save_options &o,
+    const wstr &text,
+    const int text_encoding,
+    const wstr &filename,
+    const uint64_t hash,
+    const uint64_t size)
+{
+  const wstr textname = text_filename(filename);
+  Hasher text_hash;
+  HRESULT hr = write_text_part(textname, text, text_encoding, text_hash);
+  if (SUCCEEDED(hr))
+  {
+    const HRESULT move_hr = move_text_part(textname);
+    hr = FAILED(move_hr) ? move_hr : hr;
+  }
+  if (FAILED(hr))
+  {
+    file_delete(filename.c_str());
+    return hr;
+  }
+  if (o.manifest)
+  {
+    o.manifest->add(filename.c_str(), size, hash);
+    o.manifest->add(textname.c_str(), text_hash.length(), text_hash.digest());
+  }
+  return hr;
+}
+#endif
+
+void API::api_download_all_worker(const std::shared_ptr<download_batch> b, const std::atomic<bool> &cancelled)
+{
+  for (;;)
+  {
+    if (b->aborted)
+    {
+      break;
+    }
+    const size_t i = b->next++;
+    if (i >= b->items.size())
+    {
+      break;
+    }
+    const download_batch::item &item = b->items[i];
+    uint64_t size = 0, received = 0;
+    const HRESULT hr = save_clip(b->options, item.url, item.cache_key, item.text, b->text_encoding, item.filepath, cancelled, size, received);
+    if (hr == E_ABORT)
+    {
+      b->aborted = true;
+      break;
+    }
+    if (SUCCEEDED(hr) && received > 0)
+    {
+      b->bytes += size;
+      b->received += received;
+    }
+    ++(FAILED(hr) ? b->failed : b->saved);
+    if (!b->options.job_id.empty())
+    {
+      b->options.progress->file_done(b->options.job_id);
+    }
+  }
+  finish_download_all(b);
+}
+
+#ifdef CFS_HAVE_ENGINE
+void API::api_download_all_engine(
+    const std::shared_ptr<download_batch> b,
+    DownloadEngine &engine,
+    const size_t window,
+    const std::atomic<bool> &cancelled)
+{
+  // the engine completes the transfers on its threads; they are recorded here
+  struct finished
+  {
+    size_t index;
+    HRESULT hr;
+    uint64_t hash;
+    uint64_t size;
+    uint64_t received;
+  };
+  struct completions
+  {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<finished> list;
+  };
+  auto c = std::make_shared<completions>();
+  const save_options &o = b->options;
+  const auto done = [&b](const HRESULT hr)
+  {
+    if (hr == E_ABORT)
+    {
+      b->aborted = true;
+      return;
+    }
+    ++(FAILED(hr) ? b->failed : b->saved);
+    if (!b->options.job_id.empty())
+    {
+      b->options.progress->file_done(b->options.job_id);
+    }
+  };
+
+  size_t next = 0, running = 0;
+  std::vector<finished> list;
+  for (;;)
+  {
+    while (running < window && next < b->items.size() && !b->aborted)
+    {
+      if (cancelled)
+      {
+        b->aborted = true;
+        break;
+      }
+      const size_t i = next++;
+      const download_batch::item &item = b->items[i];
+      const download_progress progress = track_progress(o);
+      uint64_t hash = 0, size = 0;
+      if (o.cache && o.cache->fetch(item.cache_key, item.filepath.c_str(), &hash, &size) == S_OK)
+      {
+        if (progress)
+        {
+          progress(size, size);
+        }
+        done(record_clip(o, item.text, b->text_encoding, item.filepath, hash, size));
+        continue;
+      }
+      // the engine does not wait for the limiter, so a request is held for each job instead
+      Limiter *limiter = o.download.limiter;
+      if (limiter && FAILED(limiter->acquire(false, &cancelled)))
+      {
+        b->aborted = true;
+        break;
+      }
+      engine_job job = {o.user_agent, item.url, item.filepath, o.download, &cancelled, progress};
+      const HRESULT hr = engine.submit(std::move(job), [c, i, limiter](const HRESULT hr, const uint64_t hash, const uint64_t size, const transfer_sample &sample)
+                                       {
+                                         if (limiter)
+                                         {
+                                           limiter->release(sample);
+                                         }
+                                         std::lock_guard<std::mutex> lock(c->mtx);
+                                         c->list.push_back({i, hr, hash, size, sample.bytes});
+                                         c->cv.notify_one(); });
+      if (FAILED(hr))
+      {
+        if (limiter)
+        {
+          limiter->release(transfer_sample());
+        }
+        done(hr);
+        continue;
+      }
+      ++running;
+    }
+    if (running == 0)
+    {
+      break;
+    }
+    {
+      std::unique_lock<std::mutex> lock(c->mtx);
+      c->cv.wait(lock, [&c]()
+                 { return !c->list.empty(); });
+      list.swap(c->list);
+    }
+    for (const finished &f : list)
+    {
+      --running;
+      const download_batch::item &item = b->items[f.index];
+      if (FAILED(f.hr))
+      {
+        done(f.hr);
+        continue;
+      }
+      b->bytes += f.size;
+      b->received += f.received;
+      if (o.cache)
+      {
+        report(o.cache->store(item.cache_key, item.filepath.c_str(), f.hash), WIDE("failed to add to the audio cache"));
+      }
+      done(record_clip(o, item.text, b->text_encoding, item.filepath, f.hash, f.size));
+    }
+    list.clear();
+  }
+  finish_download_all(b);
+}
+#endif
+
+void API::api_download_worker(
+    const std::shared_ptr<const save_options> o,
+    const wstr url,
+    const uint64_t cache_key,
+    const wstr temp_filename,
+    const std::shared_ptr<pending_save> p,
+    const std::atomic<bool> &cancelled,
+    resolver fn)
+{
+  if (!o->job_id.empty())
+  {
+    o->progress->start(o->job_id, 1);
+  }
+  uint64_t hash = 0, size = 0, received = 0;
+  HRESULT hr = fetch_audio(*o, url, cache_key, temp_filename, cancelled, hash, size, received);
+  if (!o->job_id.empty())
+  {
+    o->progress->finish(o->job_id);
+  }
+  {
+    std::unique_lock<std::mutex> lock(p->mtx);
+    p->cv.wait(lock, [&p]()
+               { return p->decided; });
+  }
+  // both files are moved into place together once the transfer and the text are done
+  const HRESULT text_hr = p->text_result;
+  wstr textname;
+  if (SUCCEEDED(text_hr))
+  {
+    textname = text_filename(p->filename);
+    if (FAILED(hr))
+    {
+      file_delete((textname + WIDE(".part")).c_str());
+    }
+  }
+  if (SUCCEEDED(hr) && SUCCEEDED(text_hr))
+  {
+    hr = file_move(temp_filename.c_str(), p->filename.c_str());
+    if (SUCCEEDED(hr))
+    {
+      hr = move_text_part(textname);
+      if (FAILED(hr))
+      {
+        file_delete(p->filename.c_str());
+      }
+    }
+    else
+    {
+      file_delete((textname + WIDE(".part")).c_str());
+    }
+    if (SUCCEEDED(hr))
+    {
+      if (o->manifest)
+      {
+        o->manifest->add(p->filename.c_str(), size, hash);
+        o->manifest->add(textname.c_str(), p->text_size, p->text_hash);
+      }
+      picojson::object result;
+      if (text_hr == S_FALSE)
+      {
+        result["textEncoding"].set<std::string>("utf8bom");
+      }
+      if (received > 0)
+      {
+        add_compression(result, size, received);
+      }
+      return fn(true, result);
+    }
+    file_delete(temp_filename.c_str());
+    return error_write_to_file(fn);
+  }
+  file_delete(temp_filename.c_str());
+  if (hr == E_ABORT || p->result == HRESULT_FROM_WIN32(ERROR_CANCELLED))
+  {
+    return error_abort(fn);
+  }
+  if (SUCCEEDED(hr) && SUCCEEDED(p->result))
+  {
+    return error_write_to_file(fn);
+  }
+  return error_internal(fn);
+}
+
+void API::error(const char *code, const char *message, resolver fn)
+{
+  picojson::object r;
+  r["code"].set<std::string>(code);
+  r["message"].set<std::string>(message);
+  return fn(false, r);
+}
+
+void API::error_abort(resolver fn)
+{
+  return error("abort", "処理が中断されました", fn);
+}
+
+void API::error_busy(resolver fn)
+{
+  return error("busy", "ダウンロードの待ちが多すぎます", fn);
+}
+
+void API::error_internal(resolver fn)
+{
+  return error("internal error", "内部エラーです", fn);
+}
+
+void API::error_invalid_call(resolver fn)
+{
+  return error("invalid function call", "正しくない呼び出しです", fn);
+}
+
+void API::error_invalid_args(resolver fn)
+{
+  return error("invalid arguments", "引数が正しくありません", fn);
+}
+
+void API::error_open_file(resolver fn)
+{
+  return error("cannot open file", "ファイルが開けません", fn);
+}
+
+void API::error_close_file(resolver fn)
+{
+  return error("cannot close file", "ファイルが閉じられません", fn);
+}
+
+void API::error_read_from_file(resolver fn)
+{
+  return error("failed to read from file", "ファイルからの読み込みに失敗しました", fn);
+}
+
+void API::error_write_to_file(resolver fn)
+{
+  return error("failed to write to file", "ファイルへの書き込みに失敗しました", fn);
+}
+
+bool API::get_string(const picojson::object obj, const char *name, wstr &s)
+{
+  const auto it = obj.find(name);
+  if (it == obj.end() || !it->second.is<std::string>())
+  {
+    return false;
+  }
+  const std::string &v = it->second.get<std::string>();
+  if (report(
+          to_u16(v.data(), (int)v.size(), s),
+          WIDE("failed to convert to UTF-16")))
+  {
+    return false;
+  }
+  return true;
+}
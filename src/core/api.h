@@ -0,0 +1,128 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+
+#include "platform.h"
+#include "picojson.h"
+#include "cache.h"
+#include "download.h"
+#include "engine.h"
+#include "filename.h"
+#include "limiter.h"
+#include "manifest.h"
+#include "progress.h"
+#include "scheduler.h"
+#include "setting.h"
+#include "throttle.h"
+
+struct download_batch;
+struct pending_save;
+struct save_options;
+
+// Platform independent part of the API exposed to the web page.
+// UI dependent operations are provided by the derived class.
+class API
+{
+public:
+  typedef std::function<void(const bool, const picojson::object)> resolver;
+
+  API(LPCWSTR version);
+  virtual ~API();
+
+  void dispatch(const std::string &method, picojson::object params, resolver fn) const;
+
+  // Cancels the running downloads and waits for them. Called when the window is closed,
+  // and in any case before the derived class is destroyed as events may still be posted until then.
+  void shutdown();
+
+  // Opens the audio cache, removes clips left in the temporary folder by an earlier run, and
+  // connects to url in the background, so that the first download neither reads the cache index
+  // nor waits for the handshake.
+  // It runs as a job, so shutdown waits for it and the sessions can be closed afterwards.
+  void start_warm_up(const wstr &user_agent, const wstr &url) const;
+
+protected:
+  virtual HRESULT show_save_dialog(LPCWSTR default_filename, int &text_encoding, wstr &dest) const = 0;
+  // Asks for the folder to save into. dest receives the path with a trailing separator.
+  virtual HRESULT show_folder_dialog(wstr &dest) const = 0;
+  // Loads the user settings. dest keeps the defaults if they cannot be read.
+  virtual void get_setting(setting &dest) const = 0;
+  // Returns the folder for the audio cache with a trailing separator, creating it if needed.
+  // The cache is not used if this fails.
+  virtual HRESULT get_cache_folder(wstr &dest) const = 0;
+  // Sends message, {"event": name, "params": {...}}, to the page. Called from any thread.
+  virtual void post_event(const picojson::object &message) const = 0;
+
+  static void error(const char *code, const char *message, resolver fn);
+  static void error_abort(resolver fn);
+  static void error_busy(resolver fn);
+  static void error_internal(resolver fn);
+  static void error_invalid_call(resolver fn);
+  static void error_invalid_args(resolver fn);
+  static void error_open_file(resolver fn);
+  static void error_close_file(resolver fn);
+  static void error_read_from_file(resolver fn);
+  static void error_write_to_file(resolver fn);
+  static bool get_string(const picojson::object obj, const char *name, wstr &s);
+
+private:
+  LPCWSTR version_;
+  // The compiled filename pattern is kept until the setting changes.
+  mutable wstr filename_pattern_;
+  mutable filename_template filename_template_;
+  mutable int seq_;
+  // declared before the scheduler so that they outlive the jobs using them
+  mutable AudioCache cache_;
+  // held while the cache is opened, which the warm-up and a save may both try
+  mutable std::mutex cache_mtx_;
+  mutable Manifest manifest_;
+  // transfers are reported to the page this many times a second at most
+  static constexpr int progress_per_second = 4;
+  mutable Progress progress_;
+  // shared by all transfers to keep them under the limit in the setting
+  mutable Throttle throttle_;
+  // batches without a fixed concurrency run up to this many requests as the server allows
+  static constexpr int max_concurrency = 6;
+  mutable Limiter limiter_;
+#ifdef CFS_HAVE_ENGINE
+  // batches of plain http URLs are multiplexed on a few threads instead of a thread per request
+  static constexpr size_t engine_window = 64;
+  mutable DownloadEngine engine_;
+#endif
+  mutable Scheduler scheduler_;
+  // Clips are downloaded to a hidden folder next to the last saved one while the save dialog
+  // is open, so that the final rename usually stays on the same volume.
+  mutable wstr last_folder_;
+  mutable unsigned int speculative_;
+
+  void prepare_filename_template(const setting &s) const;
+  void build_filename(const setting &s, LPCWSTR character, LPCWSTR text, wstr &dest) const;
+  void get_save_options(const setting &s, save_options &dest) const;
+  void post_progress(const picojson::array &jobs) const;
+  // Returns the cache to use with the setting, or nullptr if it is disabled.
+  AudioCache *prepare_cache(const setting &s) const;
+  void build_temp_filename(wstr &dest) const;
+
+  void api_version(const picojson::object params, resolver fn) const;
+  void api_download(const picojson::object params, resolver fn) const;
+  void api_download_all(const picojson::object params, resolver fn) const;
+  void api_cancel(const picojson::object params, resolver fn) const;
+  void api_concurrency(const picojson::object params, resolver fn) const;
+  static void api_download_worker(
+      const std::shared_ptr<const save_options> o,
+      const wstr url,
+      const uint64_t cache_key,
+      const wstr temp_filename,
+      const std::shared_ptr<pending_save> p,
+      const std::atomic<bool> &cancelled,
+      resolver fn);
+  static void api_download_all_worker(const std::shared_ptr<download_batch> b, const std::atomic<bool> &cancelled);
+#ifdef CFS_HAVE_ENGINE
+  static void api_download_all_engine(
+      const std::shared_ptr<download_batch> b,
+      DownloadEngine &engine,
+      const size_t window,
+      const std::atomic<bool> &cancelled);
+#endif
+};
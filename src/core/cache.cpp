@@ -0,0 +1,356 @@
+#include "cache.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+namespace
+{
+  constexpr uint32_t index_magic = 0x43534643; // "CFSC"
+  constexpr uint32_t index_version = 2;
+
+  // The index is a header followed by one record per file, in the byte order of this machine.
+  struct index_header
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t clock;
+    uint64_t count;
+  };
+
+  struct index_record
+  {
+    uint64_t key;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t last_used;
+  };
+
+  // Copies src to dest and checks that the copy has the expected length and XXH64.
+  // The cache never shares a file with a saved clip, which the user may edit in place.
+  // dest is removed if anything fails.
+  HRESULT copy_checked(LPCWSTR src, LPCWSTR dest, const uint64_t size, const uint64_t hash)
+  {
+    file_t in = INVALID_FILE_HANDLE, out = INVALID_FILE_HANDLE;
+    HRESULT hr = file_open(src, in);
+    if (FAILED(hr))
+    {
+      return hr;
+    }
+    hr = file_create(dest, out);
+    if (FAILED(hr))
+    {
+      file_close(in);
+      return hr;
+    }
+    Hasher h;
+    uint8_t buf[64 * 1024];
+    size_t read = 0;
+    while (SUCCEEDED(hr = file_read(in, buf, sizeof(buf), read)) && read > 0)
+    {
+      h.update(buf, read);
+      hr = file_write(out, buf, read);
+      if (FAILED(hr))
+      {
+        break;
+      }
+    }
+    file_close(in);
+    const HRESULT closed = file_close(out);
+    if (SUCCEEDED(hr))
+    {
+      hr = closed;
+    }
+    if (SUCCEEDED(hr) && (h.length() != size || h.digest() != hash))
+    {
+      hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    if (FAILED(hr))
+    {
+      file_delete(dest);
+    }
+    return hr;
+  }
+}
+
+AudioCache::AudioCache() : open_(false), dirty_(false), max_bytes_(0), total_(0), clock_(0), temps_(0)
+{
+}
+
+AudioCache::~AudioCache()
+{
+  flush();
+}
+
+HRESULT AudioCache::open(LPCWSTR dir, const uint64_t max_bytes)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  dir_ = dir;
+  max_bytes_ = max_bytes;
+  entries_.clear();
+  total_ = 0;
+  clock_ = 0;
+  open_ = true;
+
+  const wstr index = dir_ + WIDE("index.dat");
+  file_t file = INVALID_FILE_HANDLE;
+  HRESULT hr = file_open(index.c_str(), file);
+  if (FAILED(hr))
+  {
+    // nothing cached yet
+    return hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) ? S_OK : hr;
+  }
+  std::vector<uint8_t> data;
+  {
+    uint8_t buf[64 * 1024];
+    size_t read = 0;
+    while (SUCCEEDED(hr = file_read(file, buf, sizeof(buf), read)) && read > 0)
+    {
+      data.insert(data.end(), buf, buf + read);
+    }
+  }
+  file_close(file);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  index_header h = {};
+  if (data.size() < sizeof(h))
+  {
+    return S_OK;
+  }
+  memcpy(&h, data.data(), sizeof(h));
+  if (h.magic != index_magic || h.version != index_version || (data.size() - sizeof(h)) / sizeof(index_record) < h.count)
+  {
+    // start over rather than trust a broken index; unknown files are left alone
+    dirty_ = true;
+    return S_OK;
+  }
+  clock_ = h.clock;
+  entries_.reserve((size_t)h.count);
+  for (uint64_t i = 0; i < h.count; ++i)
+  {
+    index_record r;
+    memcpy(&r, data.data() + sizeof(h) + i * sizeof(r), sizeof(r));
+    entries_[r.key] = {r.size, r.hash, r.last_used};
+    total_ += r.size;
+  }
+  evict();
+  return S_OK;
+}
+
+bool AudioCache::is_open() const
+{
+  return open_;
+}
+
+void AudioCache::set_max_bytes(const uint64_t max_bytes)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (max_bytes_ != max_bytes)
+  {
+    max_bytes_ = max_bytes;
+    evict();
+  }
+}
+
+uint64_t AudioCache::key(LPCWSTR character, LPCWSTR text, LPCWSTR url)
+{
+  const wstr u = url;
+  size_t begin = u.find(WIDE("://"));
+  begin = begin == wstr::npos ? 0 : u.find(WIDE('/'), begin + 3);
+  if (begin == wstr::npos)
+  {
+    begin = u.size();
+  }
+  size_t end = u.find_first_of(WIDE("?#"), begin);
+  if (end == wstr::npos)
+  {
+    end = u.size();
+  }
+  // each part ends with a null character so that moving text between them changes the key
+  Hasher h;
+  h.update(character, (std::char_traits<WCHAR>::length(character) + 1) * sizeof(WCHAR));
+  h.update(text, (std::char_traits<WCHAR>::length(text) + 1) * sizeof(WCHAR));
+  h.update(u.data() + begin, (end - begin) * sizeof(WCHAR));
+  return h.digest();
+}
+
+HRESULT AudioCache::fetch(const uint64_t key, LPCWSTR filepath, uint64_t *hash, uint64_t *size)
+{
+  wstr path;
+  entry e;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto it = entries_.find(key);
+    if (!open_ || it == entries_.end())
+    {
+      return S_FALSE;
+    }
+    it->second.last_used = ++clock_;
+    dirty_ = true;
+    e = it->second;
+    path = path_of(key);
+  }
+  // like a download, the copy only replaces filepath once it is complete
+  const wstr part = wstr(filepath) + WIDE(".part");
+  HRESULT hr = copy_checked(path.c_str(), part.c_str(), e.size, e.hash);
+  if (SUCCEEDED(hr))
+  {
+    hr = file_move(part.c_str(), filepath);
+    if (FAILED(hr))
+    {
+      file_delete(part.c_str());
+      return hr;
+    }
+  }
+  if (FAILED(hr))
+  {
+    // removed or changed from outside, or evicted meanwhile
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto it = entries_.find(key);
+    if (it != entries_.end() && it->second.hash == e.hash)
+    {
+      file_delete(path.c_str());
+      total_ -= it->second.size;
+      entries_.erase(it);
+      dirty_ = true;
+    }
+    return S_FALSE;
+  }
+  if (hash)
+  {
+    *hash = e.hash;
+  }
+  if (size)
+  {
+    *size = e.size;
+  }
+  return S_OK;
+}
+
+HRESULT AudioCache::store(const uint64_t key, LPCWSTR filepath, const uint64_t hash)
+{
+  uint64_t size = 0;
+  HRESULT hr = file_get_size(filepath, size);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  wstr path, temp;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!open_)
+    {
+      return E_FAIL;
+    }
+    path = path_of(key);
+    // a name of its own for each copy, so that two stores of the same key do not collide
+    temp = path + WIDE(".");
+    for (const char c : std::to_string(++temps_))
+    {
+      temp += (WCHAR)c;
+    }
+    temp += WIDE(".tmp");
+  }
+  // the copy is made without the lock, as it may be slow and the other transfers need the cache
+  hr = copy_checked(filepath, temp.c_str(), size, hash);
+  if (SUCCEEDED(hr))
+  {
+    hr = file_move(temp.c_str(), path.c_str());
+    if (FAILED(hr))
+    {
+      file_delete(temp.c_str());
+    }
+  }
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  std::lock_guard<std::mutex> lock(mtx_);
+  entry &e = entries_[key];
+  total_ = total_ - e.size + size;
+  e.size = size;
+  e.hash = hash;
+  e.last_used = ++clock_;
+  dirty_ = true;
+  evict();
+  return S_OK;
+}
+
+HRESULT AudioCache::flush()
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  return open_ && dirty_ ? save_index() : S_OK;
+}
+
+wstr AudioCache::path_of(const uint64_t key) const
+{
+  wstr name;
+  hash_to_hex(key, name);
+  return dir_ + name + WIDE(".wav");
+}
+
+// Removes the least recently used files until the total fits. Called with mtx_ held.
+void AudioCache::evict()
+{
+  while (total_ > max_bytes_ && !entries_.empty())
+  {
+    auto oldest = entries_.begin();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+      if (it->second.last_used < oldest->second.last_used)
+      {
+        oldest = it;
+      }
+    }
+    file_delete(path_of(oldest->first).c_str());
+    total_ -= oldest->second.size;
+    entries_.erase(oldest);
+    dirty_ = true;
+  }
+}
+
+// Called with mtx_ held.
+HRESULT AudioCache::save_index()
+{
+  std::vector<uint8_t> data(sizeof(index_header) + entries_.size() * sizeof(index_record));
+  const index_header h = {index_magic, index_version, clock_, (uint64_t)entries_.size()};
+  memcpy(data.data(), &h, sizeof(h));
+  uint8_t *p = data.data() + sizeof(h);
+  for (const auto &e : entries_)
+  {
+    const index_record r = {e.first, e.second.size, e.second.hash, e.second.last_used};
+    memcpy(p, &r, sizeof(r));
+    p += sizeof(r);
+  }
+
+  const wstr index = dir_ + WIDE("index.dat");
+  const wstr temp = index + WIDE(".tmp");
+  file_t file = INVALID_FILE_HANDLE;
+  HRESULT hr = file_create(temp.c_str(), file);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  hr = file_write(file, data.data(), data.size());
+  const HRESULT closed = file_close(file);
+  if (SUCCEEDED(hr))
+  {
+    hr = closed;
+  }
+  if (SUCCEEDED(hr))
+  {
+    hr = file_move(temp.c_str(), index.c_str());
+  }
+  if (FAILED(hr))
+  {
+    file_delete(temp.c_str());
+    return hr;
+  }
+  dirty_ = false;
+  return S_OK;
+}
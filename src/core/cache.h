@@ -0,0 +1,58 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+
+#include "platform.h"
+
+// On-disk cache of downloaded audio, keyed by what the audio was made from.
+// A hit is copied into place, so saving the same clip again needs no network. The cache keeps
+// copies of its own rather than links, since a saved clip may be edited afterwards.
+// When the files exceed the size limit, the least recently used ones are removed.
+class AudioCache
+{
+public:
+  AudioCache();
+  ~AudioCache();
+
+  // Loads the index kept in dir, which is prepended to the names of the cache files,
+  // normally a folder with a trailing separator.
+  HRESULT open(LPCWSTR dir, const uint64_t max_bytes);
+  bool is_open() const;
+  void set_max_bytes(const uint64_t max_bytes);
+
+  // Only the path of url is used, as the query string of a signed URL changes every time.
+  static uint64_t key(LPCWSTR character, LPCWSTR text, LPCWSTR url);
+
+  // Places the cached audio for key at filepath. Returns S_FALSE if it is not cached, or if
+  // the cached file no longer matches its hash, which also drops it.
+  // If given, hash and size receive the content hash and the length of the file.
+  HRESULT fetch(const uint64_t key, LPCWSTR filepath, uint64_t *hash = nullptr, uint64_t *size = nullptr);
+  // Keeps a copy of the complete file filepath as the audio for key. hash is the XXH64 of its
+  // content. The index is only written by flush.
+  HRESULT store(const uint64_t key, LPCWSTR filepath, const uint64_t hash);
+  // Writes the index if it has changed since it was last written.
+  HRESULT flush();
+
+private:
+  struct entry
+  {
+    uint64_t size;
+    uint64_t hash;
+    uint64_t last_used;
+  };
+  std::mutex mtx_;
+  wstr dir_;
+  bool open_;
+  bool dirty_;
+  uint64_t max_bytes_;
+  uint64_t total_;
+  uint64_t clock_;
+  // numbers the temporary files of store
+  uint64_t temps_;
+  std::unordered_map<uint64_t, entry> entries_;
+
+  wstr path_of(const uint64_t key) const;
+  void evict();
+  HRESULT save_index();
+};
@@ -0,0 +1,239 @@
+#include "encoding.h"
+
+#include "cp932_data.h"
+#include "simd.h"
+
+namespace
+{
+  constexpr size_t cp932_columns = sizeof(cp932_rows[0]) / sizeof(cp932_rows[0][0]);
+
+  constexpr int cp932_trail(const size_t column)
+  {
+    return column < 0x3f ? (int)(0x40 + column) : (int)(0x80 + column - 0x3f);
+  }
+
+  // Fills flat with the CP932 code for each BMP code point, 0 if there is none.
+  // Codes below 0x100 are single-byte codes, the others are lead << 8 | trail.
+  constexpr void build_cp932_flat(uint16_t *flat)
+  {
+    for (int c = 0; c < 0x80; ++c)
+    {
+      flat[c] = (uint16_t)c;
+    }
+    flat[0x80] = 0x80;
+    flat[0xf8f0] = 0xa0;
+    for (int c = 0xff61; c <= 0xff9f; ++c)
+    {
+      flat[c] = (uint16_t)(c - 0xff61 + 0xa1);
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+      flat[0xf8f1 + c] = (uint16_t)(0xfd + c);
+    }
+    // Some characters have more than one code. Like WideCharToMultiByte, prefer
+    // the lowest code except that the NEC selected IBM extensions (0xED, 0xEE)
+    // lose to the IBM extensions (0xFA-0xFC).
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      for (size_t row = 0; row < sizeof(cp932_leads); ++row)
+      {
+        const uint8_t lead = cp932_leads[row];
+        if ((lead == 0xed || lead == 0xee) != (pass == 1))
+        {
+          continue;
+        }
+        for (size_t column = 0; column < cp932_columns; ++column)
+        {
+          const uint16_t u = cp932_rows[row][column];
+          if (u && !flat[u])
+          {
+            flat[u] = (uint16_t)((lead << 8) | cp932_trail(column));
+          }
+        }
+      }
+    }
+    // user-defined area: U+E000-U+E757 <-> 0xF040-0xF9FC
+    for (size_t i = 0; i < 10 * cp932_columns; ++i)
+    {
+      flat[0xe000 + i] = (uint16_t)(((0xf0 + i / cp932_columns) << 8) | cp932_trail(i % cp932_columns));
+    }
+  }
+
+  constexpr size_t count_cp932_pages()
+  {
+    uint16_t flat[65536] = {};
+    build_cp932_flat(flat);
+    size_t pages = 1; // page 0 is shared by all unmapped pages
+    for (int page = 0; page < 256; ++page)
+    {
+      for (int c = 0; c < 256; ++c)
+      {
+        if (flat[page * 256 + c])
+        {
+          ++pages;
+          break;
+        }
+      }
+    }
+    return pages;
+  }
+
+  template <size_t N>
+  struct cp932_table
+  {
+    uint8_t index[256];
+    uint16_t pages[N][256];
+  };
+
+  // Two-level lookup table: index maps the high byte of a code point to a page.
+  template <size_t N>
+  constexpr cp932_table<N> build_cp932_table()
+  {
+    uint16_t flat[65536] = {};
+    build_cp932_flat(flat);
+    cp932_table<N> t = {};
+    size_t used = 1;
+    for (int page = 0; page < 256; ++page)
+    {
+      bool empty = true;
+      for (int c = 0; c < 256; ++c)
+      {
+        if (flat[page * 256 + c])
+        {
+          empty = false;
+          break;
+        }
+      }
+      if (empty)
+      {
+        continue;
+      }
+      t.index[page] = (uint8_t)used;
+      for (int c = 0; c < 256; ++c)
+      {
+        t.pages[used][c] = flat[page * 256 + c];
+      }
+      ++used;
+    }
+    return t;
+  }
+
+  constexpr size_t cp932_pages = count_cp932_pages();
+  static_assert(cp932_pages <= 256);
+  constexpr cp932_table<cp932_pages> cp932 = build_cp932_table<cp932_pages>();
+  static_assert(cp932.pages[cp932.index[0x30]][0x42] == 0x82a0); // あ
+  static_assert(cp932.pages[cp932.index[0x7e]][0x8a] == 0xfa5c); // 纊
+  static_assert(cp932.pages[cp932.index[0xff]][0x71] == 0xb1);   // ｱ
+  static_assert(cp932.pages[cp932.index[0x00]][0xa5] == 0);      // ¥
+}
+
+// Converts src[i] until the end of the buffer or an unmappable character.
+static inline uint8_t *u16_to_sjis_tail(const WCHAR *src, const size_t n, size_t &i, uint8_t *d)
+{
+  while (i < n)
+  {
+    const WCHAR c = src[i];
+    if (c < 0x80)
+    {
+      *d++ = (uint8_t)c;
+      ++i;
+      continue;
+    }
+    const uint16_t v = cp932.pages[cp932.index[c >> 8]][c & 0xff];
+    if (v == 0)
+    {
+      break;
+    }
+    if (v < 0x100)
+    {
+      *d++ = (uint8_t)v;
+    }
+    else
+    {
+      d[0] = (uint8_t)(v >> 8);
+      d[1] = (uint8_t)(v & 0xff);
+      d += 2;
+    }
+    ++i;
+  }
+  return d;
+}
+
+#ifdef CFS_SIMD_X86
+
+CFS_TARGET_SSE41 static size_t u16_to_sjis_sse41(const WCHAR *src, const size_t n, uint8_t *dest, size_t &consumed)
+{
+  const __m128i ascii = _mm_set1_epi16((short)0xff80);
+  uint8_t *d = dest;
+  size_t i = 0;
+  while (i + 8 <= n)
+  {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    if (_mm_testz_si128(v, ascii))
+    {
+      _mm_storel_epi64((__m128i *)d, _mm_packus_epi16(v, v));
+      d += 8;
+      i += 8;
+      continue;
+    }
+    const size_t end = i + 8;
+    d = u16_to_sjis_tail(src, end, i, d);
+    if (i != end)
+    {
+      consumed = i;
+      return (size_t)(d - dest);
+    }
+  }
+  d = u16_to_sjis_tail(src, n, i, d);
+  consumed = i;
+  return (size_t)(d - dest);
+}
+
+CFS_TARGET_AVX2 static size_t u16_to_sjis_avx2(const WCHAR *src, const size_t n, uint8_t *dest, size_t &consumed)
+{
+  const __m256i ascii = _mm256_set1_epi16((short)0xff80);
+  uint8_t *d = dest;
+  size_t i = 0;
+  while (i + 16 <= n)
+  {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (_mm256_testz_si256(v, ascii))
+    {
+      const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+      _mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(packed));
+      d += 16;
+      i += 16;
+      continue;
+    }
+    const size_t end = i + 16;
+    d = u16_to_sjis_tail(src, end, i, d);
+    if (i != end)
+    {
+      consumed = i;
+      return (size_t)(d - dest);
+    }
+  }
+  size_t rest = 0;
+  const size_t written = u16_to_sjis_sse41(src + i, n - i, d, rest);
+  consumed = i + rest;
+  return (size_t)(d - dest) + written;
+}
+
+#endif
+
+size_t u16_to_sjis(LPCWSTR src, const size_t n, char *dest, size_t &consumed)
+{
+#ifdef CFS_SIMD_X86
+  switch (simd_level())
+  {
+  case SIMD_AVX2:
+    return u16_to_sjis_avx2(src, n, (uint8_t *)dest, consumed);
+  case SIMD_SSE41:
+    return u16_to_sjis_sse41(src, n, (uint8_t *)dest, consumed);
+  }
+#endif
+  size_t i = 0;
+  const uint8_t *d = u16_to_sjis_tail(src, n, i, (uint8_t *)dest);
+  consumed = i;
+  return (size_t)(d - (const uint8_t *)dest);
+}
@@ -0,0 +1,333 @@
+#include "download.h"
+
+#include <chrono>
+#include <memory>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "inflate.h"
+#include "transfer.h"
+
+void default_download_options(download_options &dest)
+{
+  dest.connect_timeout = 15000;
+  dest.receive_timeout = 30000;
+  dest.retries = 3;
+  dest.throttle = nullptr;
+  dest.limiter = nullptr;
+  dest.transport = nullptr;
+  dest.interactive = true;
+}
+
+// Waits before attempt + 1: 0.5 s, 1 s, 2 s, ... up to 8 s.
+// Returns false if cancelled becomes true meanwhile.
+static bool wait_for_retry(const int attempt, const std::atomic<bool> *cancelled)
+{
+  const int ms = 500 << (attempt < 4 ? attempt : 4);
+  for (int waited = 0; waited < ms; waited += 100)
+  {
+    if (cancelled && cancelled->load())
+    {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return !(cancelled && cancelled->load());
+}
+
+HRESULT warm_up(LPCWSTR user_agent, LPCWSTR url)
+{
+  return default_transport().warm_up(user_agent, url);
+}
+
+void close_sessions()
+{
+  default_transport().close();
+}
+
+// Requests url from offset and appends the body to partpath; offset is advanced by the bytes written.
+// A request from the start accepts a compressed body, which is decoded on the way to the file.
+// retryable is set if the failure came from the connection or the server and may go away.
+// sample receives the status, the latency and the length of the response as it came over the network.
+static HRESULT fetch(
+    Transport &transport,
+    LPCWSTR user_agent,
+    LPCWSTR url,
+    LPCWSTR partpath,
+    uint64_t &offset,
+    const download_options &options,
+    const std::atomic<bool> *cancelled,
+    Hasher &hasher,
+    const download_progress &progress,
+    transfer_sample &sample,
+    bool &retryable)
+{
+  retryable = false;
+  sample = {};
+  http_request request = {user_agent, url, std::string(), options.connect_timeout, options.receive_timeout, cancelled};
+  if (offset > 0)
+  {
+    request.headers = "Range: bytes=" + std::to_string(offset) + "-\r\n";
+  }
+  else
+  {
+    request.headers = accept_encoding_header();
+  }
+  const auto sent = std::chrono::steady_clock::now();
+  std::unique_ptr<HttpResponse> r;
+  HRESULT hr = transport.open(request, r);
+  if (FAILED(hr))
+  {
+    // a URL that cannot be requested stays that way
+    retryable = hr != E_ABORT && hr != E_INVALIDARG && hr != E_NOTIMPL;
+    sample.failed = retryable;
+    return hr;
+  }
+  const int status = r->status();
+  sample.status = status;
+  sample.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - sent).count();
+  if (status >= 400)
+  {
+    retryable = status == 408 || status == 429 || status >= 500;
+    return E_FAIL;
+  }
+  // only the whole file, or the rest of it when a range was asked for, is a body to save;
+  // the socket transport does not follow redirects, and 204 or 304 carry no audio
+  if (status != 200 && !(status == 206 && offset > 0))
+  {
+    r->cancel();
+    return E_FAIL;
+  }
+  uint64_t content_length = 0;
+  int encoding = CONTENT_IDENTITY;
+  {
+    std::string v;
+    if (r->header("Content-Length", v))
+    {
+      content_length = strtoull(v.c_str(), nullptr, 10);
+    }
+    if (r->header("Content-Encoding", v))
+    {
+      encoding = parse_content_encoding(v);
+    }
+  }
+  // only a response from the start can be decoded, as the part file holds decoded bytes
+  if (encoding == CONTENT_UNSUPPORTED || (encoding != CONTENT_IDENTITY && offset > 0 && status == 206))
+  {
+    r->cancel();
+    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+  }
+
+  file_t file = INVALID_FILE_HANDLE;
+  if (offset > 0 && status == 206)
+  {
+    uint64_t size = 0;
+    hr = file_append(partpath, file, size);
+    if (SUCCEEDED(hr) && size != offset)
+    {
+      // the part file does not end where it was expected to, so neither it nor the hash
+      // can be trusted; start over
+      file_close(file);
+      offset = 0;
+      retryable = true;
+      return E_FAIL;
+    }
+  }
+  else
+  {
+    // the server ignored the range, start over
+    offset = 0;
+    hasher = Hasher();
+    hr = file_create(partpath, file);
+  }
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+
+  uint64_t received = 0, decoded = 0;
+  bool network_failed = false;
+  bool complete = false;
+  const uint64_t start = offset;
+  const uint64_t total = content_length > 0 ? offset + content_length : 0;
+  if (progress)
+  {
+    progress(start, total);
+  }
+  // Reads what the server sent. For a compressed body the progress counts compressed bytes,
+  // which is what content_length is about.
+  const auto read_wire = [&r, &options, cancelled, &received, &network_failed, &complete, &progress, start, total](void *buf, size_t size, size_t &read) -> HRESULT
+  {
+    if (cancelled && cancelled->load())
+    {
+      read = 0;
+      return E_ABORT;
+    }
+    const HRESULT hr = r->read(buf, size, read);
+    if (FAILED(hr))
+    {
+      read = 0;
+      network_failed = hr != E_ABORT;
+      return hr;
+    }
+    if (read == 0)
+    {
+      complete = true;
+      return S_OK;
+    }
+    received += read;
+    if (progress)
+    {
+      progress(start + received, total);
+    }
+    // holding back the next read lets TCP slow the sender down
+    return options.throttle ? options.throttle->consume(read, options.interactive, cancelled) : S_OK;
+  };
+  transfer_source source = [&read_wire, &decoded](void *buf, size_t size, size_t &read) -> HRESULT
+  {
+    const HRESULT hr = read_wire(buf, size, read);
+    decoded += read;
+    return hr;
+  };
+  std::unique_ptr<Inflater> inflater;
+  std::vector<uint8_t> wire;
+  size_t wire_pos = 0, wire_size = 0;
+  if (encoding != CONTENT_IDENTITY)
+  {
+    inflater.reset(new Inflater(encoding));
+    wire.resize(64 * 1024);
+    // decodes straight into the buffers of transfer_to_file
+    source = [&](void *buf, size_t size, size_t &read) -> HRESULT
+    {
+      read = 0;
+      for (;;)
+      {
+        HRESULT hr = S_OK;
+        if (wire_pos == wire_size && !inflater->done())
+        {
+          hr = read_wire(wire.data(), wire.size(), wire_size);
+          wire_pos = 0;
+          if (FAILED(hr))
+          {
+            return hr;
+          }
+          if (wire_size == 0)
+          {
+            // the connection was closed before the end of the compressed stream
+            return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+          }
+        }
+        size_t consumed = 0;
+        hr = inflater->decode(wire.data() + wire_pos, wire_size - wire_pos, buf, size, consumed, read);
+        if (FAILED(hr))
+        {
+          return hr;
+        }
+        wire_pos += consumed;
+        decoded += read;
+        if (read > 0)
+        {
+          return S_OK;
+        }
+        if (inflater->done())
+        {
+          // the body has to end with the stream for the connection to be reused
+          size_t extra = 0;
+          if (wire_pos == wire_size && SUCCEEDED(read_wire(wire.data(), wire.size(), extra)) && extra > 0)
+          {
+            complete = false;
+          }
+          return S_OK;
+        }
+      }
+    };
+  }
+  hr = transfer_to_file(
+      source,
+      inflater ? 0 : content_length,
+      file,
+      [&r, &complete]()
+      {
+        // the connection goes back to the transport for the next download, unless the body
+        // was left unread
+        if (!complete)
+        {
+          r->cancel();
+        }
+        r.reset();
+      },
+      &hasher);
+  offset += decoded;
+  sample.bytes = received;
+  if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+  {
+    // the connection was closed before the whole body arrived
+    network_failed = true;
+  }
+  retryable = FAILED(hr) && network_failed;
+  sample.failed = retryable;
+  return hr;
+}
+
+HRESULT download(
+    LPCWSTR user_agent,
+    LPCWSTR url,
+    LPCWSTR filepath,
+    const download_options &options,
+    const std::atomic<bool> *cancelled,
+    Hasher *hasher,
+    const download_progress &progress,
+    uint64_t *received)
+{
+  Transport &transport = options.transport ? *options.transport : default_transport();
+  wstr part = filepath;
+  part += WIDE(".part");
+  // a resumed transfer continues the hash of the part already written
+  Hasher unused;
+  Hasher &h = hasher ? *hasher : unused;
+  uint64_t offset = 0;
+  HRESULT hr = S_OK;
+  if (received)
+  {
+    *received = 0;
+  }
+  for (int attempt = 0;; ++attempt)
+  {
+    bool retryable = false;
+    if (options.limiter)
+    {
+      hr = options.limiter->acquire(options.interactive, cancelled);
+      if (FAILED(hr))
+      {
+        file_delete(part.c_str());
+        return hr;
+      }
+    }
+    transfer_sample sample;
+    hr = fetch(transport, user_agent, url, part.c_str(), offset, options, cancelled, h, progress, sample, retryable);
+    if (options.limiter)
+    {
+      options.limiter->release(sample);
+    }
+    if (received)
+    {
+      *received += sample.bytes;
+    }
+    if (SUCCEEDED(hr))
+    {
+      break;
+    }
+    if (hr == E_ABORT || !retryable || attempt >= options.retries || !wait_for_retry(attempt, cancelled))
+    {
+      file_delete(part.c_str());
+      return cancelled && cancelled->load() ? E_ABORT : hr;
+    }
+  }
+  hr = file_move(part.c_str(), filepath);
+  if (FAILED(hr))
+  {
+    file_delete(part.c_str());
+  }
+  return hr;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+#include "hash.h"
+#include "limiter.h"
+#include "platform.h"
+#include "throttle.h"
+#include "transport.h"
+
+struct download_options
+{
+  // Timeouts in milliseconds.
+  int connect_timeout;
+  int receive_timeout;
+  // Number of times an interrupted transfer is resumed before it fails.
+  int retries;
+  // Limits the rate of the transfer together with the others using it; nullptr for no limit.
+  Throttle *throttle;
+  // Limits the number of requests running at once and learns from their outcome; nullptr for no limit.
+  Limiter *limiter;
+  // Sends the requests; nullptr for default_transport().
+  Transport *transport;
+  // Whether the user is waiting for this transfer rather than a background batch.
+  bool interactive;
+};
+
+void default_download_options(download_options &dest);
+
+// Receives the bytes of the file received so far and its length, 0 if unknown.
+// Called on the downloading thread after each read, so it has to be cheap.
+typedef std::function<void(uint64_t bytes, uint64_t total)> download_progress;
+
+// Downloads url into filepath.
+// The body is written to filepath + ".part", which is renamed to filepath once complete,
+// so filepath never holds a truncated file. If the connection breaks, the transfer is
+// resumed from the last byte written with a Range request after an exponential backoff.
+// Connections are kept alive and reused by later downloads with the same user agent.
+// The body is requested with gzip or deflate where the server supports it and decoded as it
+// arrives; progress then counts the compressed bytes.
+// Returns E_ABORT if cancelled becomes true during the transfer.
+// If given, hasher receives the content of the file as it is written, and received the number
+// of bytes that came over the network for it, which is less than the file if it was compressed.
+HRESULT download(
+    LPCWSTR user_agent,
+    LPCWSTR url,
+    LPCWSTR filepath,
+    const download_options &options,
+    const std::atomic<bool> *cancelled = nullptr,
+    Hasher *hasher = nullptr,
+    const download_progress &progress = nullptr,
+    uint64_t *received = nullptr);
+
+// Connects to the host of url so that the next download from there can skip the handshake.
+// This blocks until the connection is made. Uses default_transport().
+HRESULT warm_up(LPCWSTR user_agent, LPCWSTR url);
+
+// Closes the connections kept for reuse.
+void close_sessions();
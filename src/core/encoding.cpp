@@ -0,0 +1,553 @@
+#include "encoding.h"
+
+#include <array>
+#include <string.h>
+
+#include "simd.h"
+
+// UTF-16 to UTF-8
+
+// Encodes the code point at src[i] and advances i.
+// Unpaired surrogates are replaced with U+FFFD as WideCharToMultiByte does.
+static inline size_t u16_to_u8_one(const WCHAR *src, const size_t n, size_t &i, uint8_t *d)
+{
+  uint32_t cp = src[i++];
+  if (cp < 0x80)
+  {
+    d[0] = (uint8_t)cp;
+    return 1;
+  }
+  if (cp < 0x800)
+  {
+    d[0] = (uint8_t)(0xc0 | (cp >> 6));
+    d[1] = (uint8_t)(0x80 | (cp & 0x3f));
+    return 2;
+  }
+  if (cp >= 0xd800 && cp <= 0xdfff)
+  {
+    if (cp <= 0xdbff && i < n && src[i] >= 0xdc00 && src[i] <= 0xdfff)
+    {
+      cp = 0x10000 + ((cp - 0xd800) << 10) + (src[i++] - 0xdc00);
+      d[0] = (uint8_t)(0xf0 | (cp >> 18));
+      d[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3f));
+      d[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+      d[3] = (uint8_t)(0x80 | (cp & 0x3f));
+      return 4;
+    }
+    cp = 0xfffd;
+  }
+  d[0] = (uint8_t)(0xe0 | (cp >> 12));
+  d[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+  d[2] = (uint8_t)(0x80 | (cp & 0x3f));
+  return 3;
+}
+
+static size_t u16_to_u8_scalar(const WCHAR *src, const size_t n, uint8_t *dest)
+{
+  uint8_t *d = dest;
+  size_t i = 0;
+  while (i < n)
+  {
+    if (src[i] < 0x80)
+    {
+      *d++ = (uint8_t)src[i++];
+      continue;
+    }
+    d += u16_to_u8_one(src, n, i, d);
+  }
+  return (size_t)(d - dest);
+}
+
+#ifdef CFS_SIMD_X86
+
+namespace
+{
+  struct u8_shuffle
+  {
+    uint8_t shuffle[16];
+    uint8_t len;
+  };
+
+  // The vector kernels expand each BMP code unit into a 32-bit lane that holds
+  // its 1-3 byte UTF-8 sequence. This table packs four such lanes together.
+  // Index: bit k is set if lane k is >= 0x80, bit k+4 is set if lane k is >= 0x800.
+  constexpr std::array<u8_shuffle, 256> make_u8_shuffles()
+  {
+    std::array<u8_shuffle, 256> r{};
+    for (int idx = 0; idx < 256; ++idx)
+    {
+      u8_shuffle &s = r[idx];
+      int pos = 0;
+      for (int lane = 0; lane < 4; ++lane)
+      {
+        const int len = 1 + ((idx >> lane) & 1) + ((idx >> (lane + 4)) & 1);
+        for (int j = 0; j < len && pos < 16; ++j)
+        {
+          s.shuffle[pos++] = (uint8_t)(lane * 4 + j);
+        }
+      }
+      s.len = (uint8_t)pos;
+      while (pos < 16)
+      {
+        s.shuffle[pos++] = 0x80;
+      }
+    }
+    return r;
+  }
+  constexpr std::array<u8_shuffle, 256> u8_shuffles = make_u8_shuffles();
+}
+
+CFS_TARGET_SSE41 static inline uint8_t *u16_to_u8_bmp4_sse41(const __m128i x, uint8_t *d)
+{
+  const __m128i m3f = _mm_set1_epi32(0x3f);
+  const __m128i ge80 = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7f));
+  const __m128i ge800 = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7ff));
+  const __m128i lo6 = _mm_and_si128(x, m3f);
+  const __m128i mid6 = _mm_and_si128(_mm_srli_epi32(x, 6), m3f);
+  const __m128i two = _mm_or_si128(
+      _mm_or_si128(_mm_srli_epi32(x, 6), _mm_slli_epi32(lo6, 8)),
+      _mm_set1_epi32(0x80c0));
+  const __m128i three = _mm_or_si128(
+      _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(mid6, 8)),
+      _mm_or_si128(_mm_slli_epi32(lo6, 16), _mm_set1_epi32(0x8080e0)));
+  const __m128i r = _mm_blendv_epi8(_mm_blendv_epi8(x, two, ge80), three, ge800);
+  const u8_shuffle &s = u8_shuffles[_mm_movemask_ps(_mm_castsi128_ps(ge80)) | (_mm_movemask_ps(_mm_castsi128_ps(ge800)) << 4)];
+  _mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(r, _mm_loadu_si128((const __m128i *)s.shuffle)));
+  return d + s.len;
+}
+
+CFS_TARGET_SSE41 static size_t u16_to_u8_sse41(const WCHAR *src, const size_t n, uint8_t *dest)
+{
+  const __m128i ascii = _mm_set1_epi16((short)0xff80);
+  const __m128i surrogate_mask = _mm_set1_epi16((short)0xf800);
+  const __m128i surrogate = _mm_set1_epi16((short)0xd800);
+  uint8_t *d = dest;
+  size_t i = 0;
+  while (i + 8 <= n)
+  {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    if (_mm_testz_si128(v, ascii))
+    {
+      _mm_storel_epi64((__m128i *)d, _mm_packus_epi16(v, v));
+      d += 8;
+      i += 8;
+      continue;
+    }
+    const __m128i sur = _mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate);
+    if (!_mm_testz_si128(sur, sur))
+    {
+      const size_t end = i + 8;
+      while (i < end)
+      {
+        d += u16_to_u8_one(src, n, i, d);
+      }
+      continue;
+    }
+    d = u16_to_u8_bmp4_sse41(_mm_cvtepu16_epi32(v), d);
+    d = u16_to_u8_bmp4_sse41(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)), d);
+    i += 8;
+  }
+  return (size_t)(d - dest) + u16_to_u8_scalar(src + i, n - i, d);
+}
+
+CFS_TARGET_AVX2 static inline uint8_t *u16_to_u8_bmp8_avx2(const __m256i x, uint8_t *d)
+{
+  const __m256i m3f = _mm256_set1_epi32(0x3f);
+  const __m256i ge80 = _mm256_cmpgt_epi32(x, _mm256_set1_epi32(0x7f));
+  const __m256i ge800 = _mm256_cmpgt_epi32(x, _mm256_set1_epi32(0x7ff));
+  const __m256i lo6 = _mm256_and_si256(x, m3f);
+  const __m256i mid6 = _mm256_and_si256(_mm256_srli_epi32(x, 6), m3f);
+  const __m256i two = _mm256_or_si256(
+      _mm256_or_si256(_mm256_srli_epi32(x, 6), _mm256_slli_epi32(lo6, 8)),
+      _mm256_set1_epi32(0x80c0));
+  const __m256i three = _mm256_or_si256(
+      _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(mid6, 8)),
+      _mm256_or_si256(_mm256_slli_epi32(lo6, 16), _mm256_set1_epi32(0x8080e0)));
+  const __m256i r = _mm256_blendv_epi8(_mm256_blendv_epi8(x, two, ge80), three, ge800);
+  const int m1 = _mm256_movemask_ps(_mm256_castsi256_ps(ge80));
+  const int m2 = _mm256_movemask_ps(_mm256_castsi256_ps(ge800));
+  const u8_shuffle &s0 = u8_shuffles[(m1 & 0x0f) | ((m2 & 0x0f) << 4)];
+  const u8_shuffle &s1 = u8_shuffles[(m1 >> 4) | (m2 & 0xf0)];
+  const __m256i shuffle = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s0.shuffle)),
+      _mm_loadu_si128((const __m128i *)s1.shuffle), 1);
+  const __m256i packed = _mm256_shuffle_epi8(r, shuffle);
+  _mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(packed));
+  d += s0.len;
+  _mm_storeu_si128((__m128i *)d, _mm256_extracti128_si256(packed, 1));
+  return d + s1.len;
+}
+
+CFS_TARGET_AVX2 static size_t u16_to_u8_avx2(const WCHAR *src, const size_t n, uint8_t *dest)
+{
+  const __m256i ascii = _mm256_set1_epi16((short)0xff80);
+  const __m256i surrogate_mask = _mm256_set1_epi16((short)0xf800);
+  const __m256i surrogate = _mm256_set1_epi16((short)0xd800);
+  uint8_t *d = dest;
+  size_t i = 0;
+  while (i + 16 <= n)
+  {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (_mm256_testz_si256(v, ascii))
+    {
+      const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+      _mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(packed));
+      d += 16;
+      i += 16;
+      continue;
+    }
+    const __m256i sur = _mm256_cmpeq_epi16(_mm256_and_si256(v, surrogate_mask), surrogate);
+    if (!_mm256_testz_si256(sur, sur))
+    {
+      const size_t end = i + 16;
+      while (i < end)
+      {
+        d += u16_to_u8_one(src, n, i, d);
+      }
+      continue;
+    }
+    d = u16_to_u8_bmp8_avx2(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), d);
+    d = u16_to_u8_bmp8_avx2(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)), d);
+    i += 16;
+  }
+  return (size_t)(d - dest) + u16_to_u8_sse41(src + i, n - i, d);
+}
+
+#endif
+
+size_t u16_to_u8(LPCWSTR src, const size_t n, char *dest)
+{
+#ifdef CFS_SIMD_X86
+  switch (simd_level())
+  {
+  case SIMD_AVX2:
+    return u16_to_u8_avx2(src, n, (uint8_t *)dest);
+  case SIMD_SSE41:
+    return u16_to_u8_sse41(src, n, (uint8_t *)dest);
+  }
+#endif
+  return u16_to_u8_scalar(src, n, (uint8_t *)dest);
+}
+
+HRESULT to_u8(LPCWSTR src, const int srclen, std::string &dest)
+{
+  const size_t n = srclen == -1 ? std::char_traits<WCHAR>::length(src) : (size_t)srclen;
+  if (n == 0)
+  {
+    dest.resize(0);
+    return S_OK;
+  }
+  dest.resize(u8_buffer_size(n));
+  dest.resize(u16_to_u8(src, n, &dest[0]));
+  return S_OK;
+}
+
+// UTF-8 to UTF-16
+
+// Decodes the sequence at src[i], writes it to d and advances i.
+// Invalid sequences are replaced with U+FFFD as MultiByteToWideChar does.
+static inline size_t u8_to_u16_one(const uint8_t *src, const size_t n, size_t &i, WCHAR *d)
+{
+  const uint8_t c = src[i];
+  if (c < 0x80)
+  {
+    d[0] = c;
+    ++i;
+    return 1;
+  }
+  uint32_t cp = 0;
+  size_t len = 0;
+  uint8_t lo = 0x80, hi = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf)
+  {
+    len = 2;
+    cp = c & 0x1f;
+  }
+  else if (c >= 0xe0 && c <= 0xef)
+  {
+    len = 3;
+    cp = c & 0x0f;
+    lo = c == 0xe0 ? 0xa0 : 0x80;
+    hi = c == 0xed ? 0x9f : 0xbf;
+  }
+  else if (c >= 0xf0 && c <= 0xf4)
+  {
+    len = 4;
+    cp = c & 0x07;
+    lo = c == 0xf0 ? 0x90 : 0x80;
+    hi = c == 0xf4 ? 0x8f : 0xbf;
+  }
+  else
+  {
+    d[0] = 0xfffd;
+    ++i;
+    return 1;
+  }
+  size_t j = 1;
+  for (; j < len && i + j < n; ++j)
+  {
+    const uint8_t t = src[i + j];
+    if (t < lo || t > hi)
+    {
+      break;
+    }
+    cp = (cp << 6) | (t & 0x3f);
+    lo = 0x80;
+    hi = 0xbf;
+  }
+  if (j < len)
+  {
+    d[0] = 0xfffd;
+    i += j;
+    return 1;
+  }
+  i += len;
+  if (cp >= 0x10000)
+  {
+    d[0] = (WCHAR)(0xd800 | ((cp - 0x10000) >> 10));
+    d[1] = (WCHAR)(0xdc00 | (cp & 0x3ff));
+    return 2;
+  }
+  d[0] = (WCHAR)cp;
+  return 1;
+}
+
+static size_t u8_to_u16_scalar(const uint8_t *src, const size_t n, WCHAR *dest)
+{
+  WCHAR *d = dest;
+  size_t i = 0;
+  while (i < n)
+  {
+    if (src[i] < 0x80)
+    {
+      *d++ = src[i++];
+      continue;
+    }
+    d += u8_to_u16_one(src, n, i, d);
+  }
+  return (size_t)(d - dest);
+}
+
+#ifdef CFS_SIMD_X86
+
+// Decodes four consecutive 3-byte sequences from the first 12 bytes of v.
+// Returns false if the bytes are not exactly four valid 3-byte sequences.
+CFS_TARGET_SSE41 static inline bool u8_to_u16_cjk4_sse41(const __m128i v, WCHAR *d)
+{
+  const __m128i mask = _mm_setr_epi8(
+      (char)0xf0, (char)0xc0, (char)0xc0, (char)0xf0, (char)0xc0, (char)0xc0,
+      (char)0xf0, (char)0xc0, (char)0xc0, (char)0xf0, (char)0xc0, (char)0xc0,
+      0, 0, 0, 0);
+  const __m128i expected = _mm_setr_epi8(
+      (char)0xe0, (char)0x80, (char)0x80, (char)0xe0, (char)0x80, (char)0x80,
+      (char)0xe0, (char)0x80, (char)0x80, (char)0xe0, (char)0x80, (char)0x80,
+      0, 0, 0, 0);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask), expected)) != 0xffff)
+  {
+    return false;
+  }
+  // each 32-bit lane becomes (lead << 16) | (second << 8) | third
+  const __m128i lanes = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+  const __m128i cp = _mm_or_si128(
+      _mm_or_si128(
+          _mm_and_si128(lanes, _mm_set1_epi32(0x3f)),
+          _mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xfc0))),
+      _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xf000)));
+  // reject overlong forms and surrogates
+  const __m128i overlong = _mm_cmplt_epi32(cp, _mm_set1_epi32(0x800));
+  const __m128i surrogate = _mm_cmpeq_epi32(_mm_and_si128(cp, _mm_set1_epi32(0xf800)), _mm_set1_epi32(0xd800));
+  const __m128i bad = _mm_or_si128(overlong, surrogate);
+  if (!_mm_testz_si128(bad, bad))
+  {
+    return false;
+  }
+  _mm_storel_epi64((__m128i *)d, _mm_packus_epi32(cp, cp));
+  return true;
+}
+
+// Decodes at least one code point from src[i] and advances i. Needs 16 readable bytes.
+CFS_TARGET_SSE41 static inline size_t u8_to_u16_step_sse41(const uint8_t *src, const size_t n, size_t &i, WCHAR *d)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+  const int nonascii = _mm_movemask_epi8(v);
+  if ((nonascii & 1) == 0)
+  {
+    // Copy the leading ASCII run. The output never has more units than the
+    // bytes consumed, so the 16 units store stays within the buffer.
+    const int ascii = nonascii ? __builtin_ctz(nonascii) : 16;
+    _mm_storeu_si128((__m128i *)d, _mm_cvtepu8_epi16(v));
+    _mm_storeu_si128((__m128i *)(d + 8), _mm_cvtepu8_epi16(_mm_srli_si128(v, 8)));
+    i += ascii;
+    return ascii;
+  }
+  if (u8_to_u16_cjk4_sse41(v, d))
+  {
+    i += 12;
+    return 4;
+  }
+  return u8_to_u16_one(src, n, i, d);
+}
+
+CFS_TARGET_SSE41 static size_t u8_to_u16_sse41(const uint8_t *src, const size_t n, WCHAR *dest)
+{
+  WCHAR *d = dest;
+  size_t i = 0;
+  while (i + 16 <= n)
+  {
+    d += u8_to_u16_step_sse41(src, n, i, d);
+  }
+  return (size_t)(d - dest) + u8_to_u16_scalar(src + i, n - i, d);
+}
+
+CFS_TARGET_AVX2 static size_t u8_to_u16_avx2(const uint8_t *src, const size_t n, WCHAR *dest)
+{
+  WCHAR *d = dest;
+  size_t i = 0;
+  while (i + 32 <= n)
+  {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (_mm256_movemask_epi8(v) == 0)
+    {
+      _mm256_storeu_si256((__m256i *)d, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+      _mm256_storeu_si256((__m256i *)(d + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+      d += 32;
+      i += 32;
+      continue;
+    }
+    d += u8_to_u16_step_sse41(src, n, i, d);
+  }
+  return (size_t)(d - dest) + u8_to_u16_sse41(src + i, n - i, d);
+}
+
+#endif
+
+size_t u8_to_u16(LPCSTR src, const size_t n, WCHAR *dest)
+{
+#ifdef CFS_SIMD_X86
+  switch (simd_level())
+  {
+  case SIMD_AVX2:
+    return u8_to_u16_avx2((const uint8_t *)src, n, dest);
+  case SIMD_SSE41:
+    return u8_to_u16_sse41((const uint8_t *)src, n, dest);
+  }
+#endif
+  return u8_to_u16_scalar((const uint8_t *)src, n, dest);
+}
+
+HRESULT to_u16(LPCSTR src, const int srclen, wstr &dest)
+{
+  const size_t n = srclen == -1 ? strlen(src) : (size_t)srclen;
+  if (n == 0)
+  {
+    dest.resize(0);
+    return S_OK;
+  }
+  dest.resize(u16_buffer_size(n));
+  dest.resize(u8_to_u16(src, n, &dest[0]));
+  return S_OK;
+}
+
+HRESULT to_sjis(LPCWSTR src, const int srclen, std::string &dest, size_t &unmappable)
+{
+  const size_t n = srclen == -1 ? std::char_traits<WCHAR>::length(src) : (size_t)srclen;
+  unmappable = n;
+  if (n == 0)
+  {
+    dest.resize(0);
+    return S_OK;
+  }
+  dest.resize(sjis_buffer_size(n));
+  size_t consumed = 0;
+  dest.resize(u16_to_sjis(src, n, &dest[0], consumed));
+  if (consumed < n)
+  {
+    unmappable = consumed;
+    return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+  }
+  return S_OK;
+}
+
+// Byte swap
+
+static inline void u16_swap_scalar(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    dest[i] = (WCHAR)((src[i] << 8) | (src[i] >> 8));
+  }
+}
+
+#ifdef CFS_SIMD_X86
+
+CFS_TARGET_SSE41 static void u16_swap_sse41(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  const __m128i shuf = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(a, shuf));
+    _mm_storeu_si128((__m128i *)(dest + i + 8), _mm_shuffle_epi8(b, shuf));
+  }
+  if (i + 8 <= n)
+  {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(a, shuf));
+    i += 8;
+  }
+  u16_swap_scalar(src + i, n - i, dest + i);
+}
+
+CFS_TARGET_AVX2 static void u16_swap_avx2(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  const __m256i shuf = _mm256_setr_epi8(
+      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+    _mm256_storeu_si256((__m256i *)(dest + i), _mm256_shuffle_epi8(a, shuf));
+    _mm256_storeu_si256((__m256i *)(dest + i + 16), _mm256_shuffle_epi8(b, shuf));
+  }
+  u16_swap_sse41(src + i, n - i, dest + i);
+}
+
+#elif defined(CFS_SIMD_NEON)
+
+static void u16_swap_neon(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const uint8x16_t a = vld1q_u8((const uint8_t *)(src + i));
+    const uint8x16_t b = vld1q_u8((const uint8_t *)(src + i + 8));
+    vst1q_u8((uint8_t *)(dest + i), vrev16q_u8(a));
+    vst1q_u8((uint8_t *)(dest + i + 8), vrev16q_u8(b));
+  }
+  u16_swap_scalar(src + i, n - i, dest + i);
+}
+
+#endif
+
+void u16_swap(LPCWSTR src, const size_t n, WCHAR *dest)
+{
+#ifdef CFS_SIMD_X86
+  switch (simd_level())
+  {
+  case SIMD_AVX2:
+    return u16_swap_avx2(src, n, dest);
+  case SIMD_SSE41:
+    return u16_swap_sse41(src, n, dest);
+  }
+#elif defined(CFS_SIMD_NEON)
+  if (simd_level() == SIMD_NEON)
+  {
+    return u16_swap_neon(src, n, dest);
+  }
+#endif
+  u16_swap_scalar(src, n, dest);
+}
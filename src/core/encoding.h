@@ -0,0 +1,48 @@
+#pragma once
+
+#include "platform.h"
+
+// If srclen is -1, src is treated as a null-terminated string.
+HRESULT to_u16(LPCSTR src, const int srclen, wstr &dest);
+HRESULT to_u8(LPCWSTR src, const int srclen, std::string &dest);
+
+// Converts src to Shift_JIS (CP932). Unlike WideCharToMultiByte, characters that
+// cannot be represented are not replaced with '?'. The conversion stops there and
+// returns HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION); unmappable receives
+// the offset of the character. Otherwise unmappable is the length of src.
+HRESULT to_sjis(LPCWSTR src, const int srclen, std::string &dest, size_t &unmappable);
+
+// Returns the buffer size required by u16_to_u8 to convert n code units.
+// This is the worst case of 3 bytes per unit plus room for the vector stores.
+inline size_t u8_buffer_size(const size_t n)
+{
+  return n * 3 + 16;
+}
+
+// Converts n UTF-16 code units to UTF-8 in a single pass and returns the number of bytes written.
+// Unpaired surrogates are replaced with U+FFFD as WideCharToMultiByte does.
+size_t u16_to_u8(LPCWSTR src, const size_t n, char *dest);
+
+// Returns the buffer size required by u8_to_u16 to convert n bytes.
+inline size_t u16_buffer_size(const size_t n)
+{
+  return n;
+}
+
+// Converts n bytes of UTF-8 to UTF-16 and returns the number of code units written.
+// Invalid sequences are replaced with U+FFFD as MultiByteToWideChar does.
+size_t u8_to_u16(LPCSTR src, const size_t n, WCHAR *dest);
+
+// Returns the buffer size required by u16_to_sjis to convert n code units.
+inline size_t sjis_buffer_size(const size_t n)
+{
+  return n * 2 + 16;
+}
+
+// Converts n UTF-16 code units to CP932 and returns the number of bytes written.
+// Stops at the first character that has no CP932 code; consumed receives the
+// number of code units converted.
+size_t u16_to_sjis(LPCWSTR src, const size_t n, char *dest, size_t &consumed);
+
+// Swaps the byte order of n UTF-16 code units. src and dest may point to the same buffer.
+void u16_swap(LPCWSTR src, const size_t n, WCHAR *dest);
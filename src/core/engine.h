@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "download.h"
+#include "platform.h"
+
+#if defined(__linux__)
+#define CFS_HAVE_ENGINE 1
+#endif
+
+#ifdef CFS_HAVE_ENGINE
+
+struct engine_job
+{
+  wstr user_agent;
+  wstr url;
+  // The body is written to filepath + ".part", which is renamed to filepath once complete.
+  wstr filepath;
+  // Only the timeouts and retries are used. The limiter is left to the caller, which can hold
+  // a request for each job and release it with the sample the completion receives.
+  download_options options;
+  const std::atomic<bool> *cancelled;
+  // Called on an engine thread as the body arrives, so it has to be cheap.
+  download_progress progress;
+};
+
+// Receives the result of a job, the XXH64 and the length of the file, and one sample for all of
+// its attempts to hand to a Limiter: a 429 or 503 from any attempt, whether a connection failed,
+// the latency of the last response, and in bytes what came over the network for the file, which
+// is less than its length if the body was compressed.
+// Called once for every job that was accepted, on an engine thread, so it has to return quickly.
+typedef std::function<void(HRESULT hr, uint64_t hash, uint64_t size, const transfer_sample &sample)> engine_completion;
+
+// Downloads many files at once over HTTP/1.1 on a few threads that multiplex every
+// connection with epoll, instead of blocking a thread per transfer as download() does.
+// Connections are kept alive and reused, bodies are written to the files as they arrive,
+// decoded if the server compressed them, and broken transfers are resumed with Range
+// requests like download() does.
+// There is no TLS, so https URLs are refused with E_NOTIMPL.
+class DownloadEngine
+{
+public:
+  // threads is the number of event loops. Each loop keeps at most connections_per_host
+  // connections to a host; the jobs beyond that wait for one of them to be free.
+  DownloadEngine(const size_t threads, const size_t connections_per_host);
+  ~DownloadEngine();
+
+  // Queues job. fn is not called if this fails: E_INVALIDARG or E_NOTIMPL for a URL
+  // that cannot be requested and E_ABORT after shutdown.
+  HRESULT submit(engine_job job, engine_completion fn);
+
+  // Cancels all jobs, which complete with E_ABORT, and waits for the threads.
+  void shutdown();
+
+  class loop;
+
+private:
+  const size_t threads_;
+  const size_t connections_per_host_;
+  std::mutex mtx_;
+  std::vector<std::unique_ptr<loop>> loops_;
+  size_t next_;
+  bool stopping_;
+};
+
+#endif
@@ -0,0 +1,1032 @@
+#include "engine.h"
+
+#ifdef CFS_HAVE_ENGINE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <thread>
+
+#include "encoding.h"
+#include "hash.h"
+#include "http.h"
+#include "inflate.h"
+
+namespace
+{
+  typedef std::chrono::steady_clock steady;
+
+  constexpr size_t read_buffer_bytes = 256 * 1024;
+  constexpr size_t max_head_bytes = 64 * 1024;
+  // A connection gets this many reads per wakeup, so that one fast transfer cannot starve the others.
+  constexpr int reads_per_event = 8;
+  // Timeouts, cancellations and retries are checked this often in milliseconds.
+  constexpr int tick = 50;
+
+  struct transfer
+  {
+    engine_job job;
+    engine_completion fn;
+    http_url url;
+    std::string key;
+    std::string user_agent;
+    wstr part;
+    file_t file;
+    uint64_t offset;
+    uint64_t total;
+    // body bytes that came over the network, for all attempts and for this response
+    uint64_t received;
+    uint64_t response_received;
+    // decodes a compressed response
+    std::unique_ptr<Inflater> inflater;
+    Hasher hasher;
+    int attempt;
+    steady::time_point retry_at;
+    // when the current request was sent, and what the attempts told about the server
+    steady::time_point sent;
+    transfer_sample sample;
+
+    bool cancelled() const
+    {
+      return job.cancelled && job.cancelled->load();
+    }
+  };
+
+  enum
+  {
+    conn_connecting,
+    conn_sending,
+    conn_head,
+    conn_body,
+    conn_idle,
+  };
+
+  typedef std::vector<std::pair<sockaddr_storage, socklen_t>> address_list;
+
+  struct connection
+  {
+    int fd;
+    std::string key;
+    // the index of the address in the resolved list that the connection went to
+    size_t addr;
+    int state;
+    // whether the connection has served a request before, so the server may have dropped it
+    bool reused;
+    // whether any of the current response has arrived
+    bool received;
+    std::string out;
+    size_t out_pos;
+    std::string head_buf;
+    http_head head;
+    uint64_t left;
+    ChunkedDecoder chunked;
+    std::unique_ptr<transfer> t;
+    steady::time_point deadline;
+  };
+}
+
+// One event loop thread with its own connections.
+class DownloadEngine::loop
+{
+public:
+  explicit loop(const size_t connections_per_host);
+  ~loop();
+
+  HRESULT start();
+  void post(std::unique_ptr<transfer> t);
+  // Completes the jobs with E_ABORT and waits for the thread.
+  void stop();
+
+private:
+  const size_t connections_per_host_;
+  int epoll_;
+  int wake_;
+  std::thread thread_;
+  std::mutex mtx_;
+  std::vector<std::unique_ptr<transfer>> incoming_;
+  bool stopping_;
+
+  // everything below belongs to the loop thread
+  std::map<connection *, std::unique_ptr<connection>> connections_;
+  std::map<std::string, std::vector<connection *>> idle_;
+  std::map<std::string, size_t> open_;
+  std::map<std::string, std::deque<std::unique_ptr<transfer>>> waiting_;
+  std::vector<std::unique_ptr<transfer>> retrying_;
+  std::map<std::string, address_list> resolved_;
+  std::vector<char> buf_;
+  std::vector<char> inflated_;
+
+  void run();
+  void dispatch();
+  void scan(const steady::time_point now);
+  void abort_all();
+
+  connection *open_connection(const transfer &t, const size_t first, HRESULT &hr);
+  void close_connection(connection *c);
+  void set_events(connection *c, const uint32_t events);
+  void start_request(connection *c, std::unique_ptr<transfer> t);
+  void send_request(connection *c);
+  void handle(connection *c, const uint32_t events);
+  void receive(connection *c);
+  bool consume(connection *c, const char *p, size_t n);
+  bool begin_body(connection *c);
+  bool body(connection *c, const char *p, size_t n);
+  bool write_body(connection *c, const char *p, const size_t n);
+  static HRESULT write_file(transfer &t, const char *p, const size_t n);
+  void finish_body(connection *c);
+  void connection_failed(connection *c, const HRESULT hr);
+  void connect_failed(connection *c, const HRESULT hr);
+
+  void fail(std::unique_ptr<transfer> t, const HRESULT hr, const bool retryable);
+  static void complete(std::unique_ptr<transfer> t, HRESULT hr);
+};
+
+DownloadEngine::loop::loop(const size_t connections_per_host)
+    : connections_per_host_(connections_per_host), epoll_(-1), wake_(-1), stopping_(false), buf_(read_buffer_bytes), inflated_(read_buffer_bytes)
+{
+}
+
+DownloadEngine::loop::~loop()
+{
+  stop();
+  if (wake_ != -1)
+  {
+    close(wake_);
+  }
+  if (epoll_ != -1)
+  {
+    close(epoll_);
+  }
+}
+
+HRESULT DownloadEngine::loop::start()
+{
+  epoll_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_ == -1)
+  {
+    return last_error();
+  }
+  wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_ == -1)
+  {
+    return last_error();
+  }
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &ev) == -1)
+  {
+    return last_error();
+  }
+  thread_ = std::thread(&loop::run, this);
+  return S_OK;
+}
+
+void DownloadEngine::loop::post(std::unique_ptr<transfer> t)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    incoming_.push_back(std::move(t));
+  }
+  const uint64_t one = 1;
+  (void)!write(wake_, &one, sizeof(one));
+}
+
+void DownloadEngine::loop::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stopping_ = true;
+  }
+  if (thread_.joinable())
+  {
+    const uint64_t one = 1;
+    (void)!write(wake_, &one, sizeof(one));
+    thread_.join();
+  }
+}
+
+void DownloadEngine::loop::run()
+{
+  epoll_event events[128];
+  steady::time_point last_scan = steady::now();
+  for (;;)
+  {
+    const int n = epoll_wait(epoll_, events, sizeof(events) / sizeof(events[0]), tick);
+    for (int i = 0; i < n; ++i)
+    {
+      connection *c = (connection *)events[i].data.ptr;
+      if (!c)
+      {
+        uint64_t v = 0;
+        (void)!read(wake_, &v, sizeof(v));
+        continue;
+      }
+      handle(c, events[i].events);
+    }
+    std::vector<std::unique_ptr<transfer>> incoming;
+    bool stopping = false;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      incoming.swap(incoming_);
+      stopping = stopping_;
+    }
+    for (std::unique_ptr<transfer> &t : incoming)
+    {
+      const std::string key = t->key;
+      waiting_[key].push_back(std::move(t));
+    }
+    if (stopping)
+    {
+      abort_all();
+      return;
+    }
+    const steady::time_point now = steady::now();
+    if (now - last_scan >= std::chrono::milliseconds(tick))
+    {
+      scan(now);
+      last_scan = now;
+    }
+    dispatch();
+  }
+}
+
+// Starts the waiting jobs on idle connections or new ones, as far as the limit allows.
+void DownloadEngine::loop::dispatch()
+{
+  for (auto &w : waiting_)
+  {
+    std::deque<std::unique_ptr<transfer>> &q = w.second;
+    while (!q.empty())
+    {
+      if (q.front()->cancelled())
+      {
+        complete(std::move(q.front()), E_ABORT);
+        q.pop_front();
+        continue;
+      }
+      connection *c = nullptr;
+      std::vector<connection *> &idle = idle_[w.first];
+      if (!idle.empty())
+      {
+        c = idle.back();
+        idle.pop_back();
+      }
+      else
+      {
+        if (open_[w.first] >= connections_per_host_)
+        {
+          break;
+        }
+        HRESULT hr = S_OK;
+        c = open_connection(*q.front(), 0, hr);
+        if (!c)
+        {
+          q.front()->sample.failed = true;
+          fail(std::move(q.front()), hr, true);
+          q.pop_front();
+          continue;
+        }
+      }
+      std::unique_ptr<transfer> t = std::move(q.front());
+      q.pop_front();
+      start_request(c, std::move(t));
+    }
+  }
+}
+
+void DownloadEngine::loop::scan(const steady::time_point now)
+{
+  std::vector<connection *> expired;
+  for (const auto &c : connections_)
+  {
+    if (c.second->t && (c.second->t->cancelled() || now > c.second->deadline))
+    {
+      expired.push_back(c.first);
+    }
+  }
+  for (connection *c : expired)
+  {
+    if (c->t->cancelled())
+    {
+      std::unique_ptr<transfer> t = std::move(c->t);
+      close_connection(c);
+      complete(std::move(t), E_ABORT);
+    }
+    else if (c->state == conn_connecting)
+    {
+      connect_failed(c, HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+    }
+    else
+    {
+      connection_failed(c, HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+    }
+  }
+  std::vector<std::unique_ptr<transfer>> retrying;
+  retrying.swap(retrying_);
+  for (std::unique_ptr<transfer> &t : retrying)
+  {
+    if (t->cancelled())
+    {
+      complete(std::move(t), E_ABORT);
+    }
+    else if (now >= t->retry_at)
+    {
+      const std::string key = t->key;
+      waiting_[key].push_back(std::move(t));
+    }
+    else
+    {
+      retrying_.push_back(std::move(t));
+    }
+  }
+}
+
+void DownloadEngine::loop::abort_all()
+{
+  while (!connections_.empty())
+  {
+    connection *c = connections_.begin()->first;
+    std::unique_ptr<transfer> t = std::move(c->t);
+    close_connection(c);
+    if (t)
+    {
+      complete(std::move(t), E_ABORT);
+    }
+  }
+  for (auto &w : waiting_)
+  {
+    for (std::unique_ptr<transfer> &t : w.second)
+    {
+      complete(std::move(t), E_ABORT);
+    }
+  }
+  waiting_.clear();
+  for (std::unique_ptr<transfer> &t : retrying_)
+  {
+    complete(std::move(t), E_ABORT);
+  }
+  retrying_.clear();
+}
+
+// Connects to the addresses of the host from first on, as connect_to in transport_posix.cpp does,
+// and forgets them once none is left so that the next attempt resolves the host again.
+connection *DownloadEngine::loop::open_connection(const transfer &t, const size_t first, HRESULT &hr)
+{
+  auto it = resolved_.find(t.key);
+  if (it == resolved_.end())
+  {
+    // getaddrinfo blocks this loop, and the transfers of every other host on it, until it returns.
+    // That happens once per host until its addresses fail, which is rare enough with a single host
+    // that it is not worth a resolver thread.
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *list = nullptr;
+    if (getaddrinfo(t.url.host.c_str(), t.url.port.c_str(), &hints, &list) != 0 || !list)
+    {
+      hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+      return nullptr;
+    }
+    address_list addrs;
+    for (addrinfo *a = list; a; a = a->ai_next)
+    {
+      std::pair<sockaddr_storage, socklen_t> addr = {};
+      memcpy(&addr.first, a->ai_addr, a->ai_addrlen);
+      addr.second = a->ai_addrlen;
+      addrs.push_back(addr);
+    }
+    freeaddrinfo(list);
+    it = resolved_.emplace(t.key, std::move(addrs)).first;
+  }
+  const address_list &addrs = it->second;
+  int fd = -1;
+  size_t i = first;
+  hr = E_FAIL;
+  for (; i < addrs.size(); ++i)
+  {
+    const sockaddr_storage &addr = addrs[i].first;
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+      hr = last_error();
+      continue;
+    }
+    if (connect(fd, (const sockaddr *)&addr, addrs[i].second) == -1 && errno != EINPROGRESS)
+    {
+      hr = last_error();
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    break;
+  }
+  if (fd == -1)
+  {
+    resolved_.erase(it);
+    return nullptr;
+  }
+  const int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  std::unique_ptr<connection> c(new connection());
+  c->fd = fd;
+  c->key = t.key;
+  c->addr = i;
+  c->state = conn_connecting;
+  c->reused = false;
+  c->received = false;
+  c->out_pos = 0;
+  c->left = 0;
+  epoll_event ev = {};
+  ev.events = EPOLLOUT;
+  ev.data.ptr = c.get();
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) == -1)
+  {
+    hr = last_error();
+    close(fd);
+    return nullptr;
+  }
+  ++open_[t.key];
+  connection *p = c.get();
+  connections_[p] = std::move(c);
+  return p;
+}
+
+void DownloadEngine::loop::close_connection(connection *c)
+{
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, c->fd, nullptr);
+  close(c->fd);
+  --open_[c->key];
+  if (c->state == conn_idle)
+  {
+    std::vector<connection *> &idle = idle_[c->key];
+    for (auto i = idle.begin(); i != idle.end(); ++i)
+    {
+      if (*i == c)
+      {
+        idle.erase(i);
+        break;
+      }
+    }
+  }
+  connections_.erase(c);
+}
+
+void DownloadEngine::loop::set_events(connection *c, const uint32_t events)
+{
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.ptr = c;
+  epoll_ctl(epoll_, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void DownloadEngine::loop::start_request(connection *c, std::unique_ptr<transfer> t)
+{
+  if (t->file == INVALID_FILE_HANDLE)
+  {
+    const HRESULT hr = file_create(t->part.c_str(), t->file);
+    if (FAILED(hr))
+    {
+      t->file = INVALID_FILE_HANDLE;
+      if (c->state == conn_idle)
+      {
+        idle_[c->key].push_back(c);
+      }
+      else
+      {
+        close_connection(c);
+      }
+      complete(std::move(t), hr);
+      return;
+    }
+  }
+  // a resumed body is asked for as it is, since the file holds decoded bytes
+  const std::string headers = t->offset > 0 ? "Range: bytes=" + std::to_string(t->offset) + "-\r\n" : std::string(accept_encoding_header());
+  c->out = build_http_get(t->url, t->user_agent, headers);
+  c->out_pos = 0;
+  c->head_buf.clear();
+  c->received = false;
+  c->chunked = ChunkedDecoder();
+  const bool connecting = c->state == conn_connecting;
+  t->sent = steady::now();
+  c->deadline = t->sent + std::chrono::milliseconds(connecting ? t->job.options.connect_timeout : t->job.options.receive_timeout);
+  c->t = std::move(t);
+  if (!connecting)
+  {
+    c->state = conn_sending;
+    send_request(c);
+  }
+}
+
+void DownloadEngine::loop::send_request(connection *c)
+{
+  while (c->out_pos < c->out.size())
+  {
+    const ssize_t r = send(c->fd, c->out.data() + c->out_pos, c->out.size() - c->out_pos, MSG_NOSIGNAL);
+    if (r >= 0)
+    {
+      c->out_pos += (size_t)r;
+      continue;
+    }
+    if (errno == EINTR)
+    {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      set_events(c, EPOLLOUT);
+      return;
+    }
+    connection_failed(c, last_error());
+    return;
+  }
+  c->state = conn_head;
+  c->deadline = steady::now() + std::chrono::milliseconds(c->t->job.options.receive_timeout);
+  set_events(c, EPOLLIN | EPOLLRDHUP);
+}
+
+void DownloadEngine::loop::handle(connection *c, const uint32_t events)
+{
+  switch (c->state)
+  {
+  case conn_idle:
+    // the server closed the kept connection, or sent something it should not have
+    close_connection(c);
+    return;
+  case conn_connecting:
+  {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    {
+      err = errno;
+    }
+    if (err != 0 || (events & EPOLLERR))
+    {
+      connect_failed(c, HRESULT_FROM_WIN32(err != 0 ? err : ECONNREFUSED));
+      return;
+    }
+    c->state = conn_sending;
+    send_request(c);
+    return;
+  }
+  case conn_sending:
+    send_request(c);
+    return;
+  default:
+    receive(c);
+    return;
+  }
+}
+
+void DownloadEngine::loop::receive(connection *c)
+{
+  for (int i = 0; i < reads_per_event; ++i)
+  {
+    const ssize_t r = recv(c->fd, buf_.data(), buf_.size(), 0);
+    if (r < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        connection_failed(c, last_error());
+      }
+      return;
+    }
+    if (r == 0)
+    {
+      if (c->state == conn_body && c->head.body == HTTP_BODY_UNTIL_CLOSE)
+      {
+        finish_body(c);
+        return;
+      }
+      connection_failed(c, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+      return;
+    }
+    c->received = true;
+    c->deadline = steady::now() + std::chrono::milliseconds(c->t->job.options.receive_timeout);
+    if (!consume(c, buf_.data(), (size_t)r))
+    {
+      return;
+    }
+  }
+}
+
+// Returns false once the connection is closed or done with the response.
+bool DownloadEngine::loop::consume(connection *c, const char *p, size_t n)
+{
+  if (c->state == conn_body)
+  {
+    return body(c, p, n);
+  }
+  c->head_buf.append(p, n);
+  size_t end = 0;
+  for (;;)
+  {
+    end = find_http_head_end(c->head_buf.data(), c->head_buf.size());
+    if (end == 0)
+    {
+      if (c->head_buf.size() > max_head_bytes)
+      {
+        std::unique_ptr<transfer> t = std::move(c->t);
+        close_connection(c);
+        fail(std::move(t), HRESULT_FROM_WIN32(ERROR_INVALID_DATA), false);
+        return false;
+      }
+      return true;
+    }
+    const HRESULT hr = parse_http_head(c->head_buf.data(), end, c->head);
+    if (FAILED(hr))
+    {
+      std::unique_ptr<transfer> t = std::move(c->t);
+      close_connection(c);
+      fail(std::move(t), hr, false);
+      return false;
+    }
+    if (c->head.status >= 200)
+    {
+      break;
+    }
+    // an interim response is followed by the real one
+    c->head_buf.erase(0, end);
+  }
+  const std::string rest = c->head_buf.substr(end);
+  c->head_buf.clear();
+  if (!begin_body(c))
+  {
+    return false;
+  }
+  return rest.empty() || body(c, rest.data(), rest.size());
+}
+
+bool DownloadEngine::loop::begin_body(connection *c)
+{
+  transfer &t = *c->t;
+  const int status = c->head.status;
+  // a 429 or 503 on an earlier attempt is what the limiter has to hear about
+  if (t.sample.status != 429 && t.sample.status != 503)
+  {
+    t.sample.status = status;
+  }
+  t.sample.latency = std::chrono::duration<double>(steady::now() - t.sent).count();
+  if (status >= 400)
+  {
+    // the body of an error is not worth reading to keep the connection
+    std::unique_ptr<transfer> p = std::move(c->t);
+    close_connection(c);
+    fail(std::move(p), E_FAIL, status == 408 || status == 429 || status >= 500);
+    return false;
+  }
+  if (status != 200 && !(status == 206 && t.offset > 0))
+  {
+    // as in download(), a redirect or a response without the clip is not saved
+    std::unique_ptr<transfer> p = std::move(c->t);
+    close_connection(c);
+    fail(std::move(p), E_FAIL, false);
+    return false;
+  }
+  if (t.offset > 0 && status != 206)
+  {
+    // the server ignored the range, start over
+    if (ftruncate(t.file, 0) == -1 || lseek(t.file, 0, SEEK_SET) == -1)
+    {
+      const HRESULT hr = last_error();
+      std::unique_ptr<transfer> p = std::move(c->t);
+      close_connection(c);
+      fail(std::move(p), hr, false);
+      return false;
+    }
+    t.offset = 0;
+    t.hasher = Hasher();
+  }
+  std::string v;
+  const int encoding = c->head.find("Content-Encoding", v) ? parse_content_encoding(v) : CONTENT_IDENTITY;
+  if (encoding == CONTENT_UNSUPPORTED || (encoding != CONTENT_IDENTITY && t.offset > 0))
+  {
+    std::unique_ptr<transfer> p = std::move(c->t);
+    close_connection(c);
+    fail(std::move(p), HRESULT_FROM_WIN32(ERROR_INVALID_DATA), false);
+    return false;
+  }
+  t.inflater.reset(encoding != CONTENT_IDENTITY ? new Inflater(encoding) : nullptr);
+  t.response_received = 0;
+  // the length of a compressed body is that of what comes over the network, and so is its progress
+  t.total = c->head.body == HTTP_BODY_LENGTH ? t.offset + c->head.length : 0;
+  if (t.job.progress)
+  {
+    t.job.progress(t.offset, t.total);
+  }
+  c->left = c->head.length;
+  c->state = conn_body;
+  if (c->head.body == HTTP_BODY_LENGTH && c->left == 0)
+  {
+    finish_body(c);
+    return false;
+  }
+  return true;
+}
+
+bool DownloadEngine::loop::body(connection *c, const char *p, size_t n)
+{
+  switch (c->head.body)
+  {
+  case HTTP_BODY_CHUNKED:
+    while (n > 0)
+    {
+      const char *data = nullptr;
+      size_t data_size = 0, consumed = 0;
+      const HRESULT hr = c->chunked.decode(p, n, data, data_size, consumed);
+      if (FAILED(hr))
+      {
+        std::unique_ptr<transfer> t = std::move(c->t);
+        close_connection(c);
+        fail(std::move(t), hr, false);
+        return false;
+      }
+      if (data_size > 0 && !write_body(c, data, data_size))
+      {
+        return false;
+      }
+      p += consumed;
+      n -= consumed;
+      if (c->chunked.done())
+      {
+        c->head.keep_alive = c->head.keep_alive && n == 0;
+        finish_body(c);
+        return false;
+      }
+      if (consumed == 0)
+      {
+        break;
+      }
+    }
+    return true;
+  case HTTP_BODY_LENGTH:
+  {
+    const size_t take = n < c->left ? n : (size_t)c->left;
+    if (!write_body(c, p, take))
+    {
+      return false;
+    }
+    c->left -= take;
+    if (c->left == 0)
+    {
+      // anything after the body was not asked for
+      c->head.keep_alive = c->head.keep_alive && n == take;
+      finish_body(c);
+      return false;
+    }
+    return true;
+  }
+  default:
+    return write_body(c, p, n);
+  }
+}
+
+bool DownloadEngine::loop::write_body(connection *c, const char *p, const size_t n)
+{
+  transfer &t = *c->t;
+  t.received += n;
+  t.response_received += n;
+  HRESULT hr = S_OK;
+  if (!t.inflater)
+  {
+    hr = write_file(t, p, n);
+  }
+  else
+  {
+    size_t pos = 0;
+    for (;;)
+    {
+      size_t consumed = 0, written = 0;
+      hr = t.inflater->decode(p + pos, n - pos, inflated_.data(), inflated_.size(), consumed, written);
+      if (SUCCEEDED(hr) && written > 0)
+      {
+        hr = write_file(t, inflated_.data(), written);
+      }
+      pos += consumed;
+      // the buffer was not filled, so the input is used up or the stream has ended
+      if (FAILED(hr) || written < inflated_.size())
+      {
+        break;
+      }
+    }
+  }
+  if (FAILED(hr))
+  {
+    std::unique_ptr<transfer> failed = std::move(c->t);
+    close_connection(c);
+    fail(std::move(failed), hr, false);
+    return false;
+  }
+  if (t.job.progress)
+  {
+    t.job.progress(t.inflater ? t.response_received : t.offset, t.total);
+  }
+  return true;
+}
+
+HRESULT DownloadEngine::loop::write_file(transfer &t, const char *p, const size_t n)
+{
+  const HRESULT hr = file_write(t.file, p, n);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  t.hasher.update(p, n);
+  t.offset += n;
+  return S_OK;
+}
+
+void DownloadEngine::loop::finish_body(connection *c)
+{
+  std::unique_ptr<transfer> t = std::move(c->t);
+  // a compressed body that ends before its stream was cut short
+  const bool truncated = t->inflater && !t->inflater->done();
+  if (c->head.keep_alive)
+  {
+    c->state = conn_idle;
+    c->reused = true;
+    idle_[c->key].push_back(c);
+  }
+  else
+  {
+    close_connection(c);
+  }
+  if (truncated)
+  {
+    return fail(std::move(t), HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), true);
+  }
+  complete(std::move(t), S_OK);
+}
+
+void DownloadEngine::loop::connection_failed(connection *c, const HRESULT hr)
+{
+  std::unique_ptr<transfer> t = std::move(c->t);
+  // a kept connection that the server closed before answering is not the job's fault
+  const bool stale = c->reused && !c->received;
+  close_connection(c);
+  if (!t)
+  {
+    return;
+  }
+  if (stale)
+  {
+    const std::string key = t->key;
+    waiting_[key].push_front(std::move(t));
+    return;
+  }
+  t->sample.failed = true;
+  fail(std::move(t), hr, true);
+}
+
+// Moves the request of a connection that could not be made on to the next address of the host.
+void DownloadEngine::loop::connect_failed(connection *c, const HRESULT hr)
+{
+  std::unique_ptr<transfer> t = std::move(c->t);
+  const size_t next = c->addr + 1;
+  close_connection(c);
+  if (!t)
+  {
+    return;
+  }
+  HRESULT next_hr = S_OK;
+  connection *n = open_connection(*t, next, next_hr);
+  if (n)
+  {
+    start_request(n, std::move(t));
+    return;
+  }
+  resolved_.erase(t->key);
+  t->sample.failed = true;
+  fail(std::move(t), hr, true);
+}
+
+void DownloadEngine::loop::fail(std::unique_ptr<transfer> t, const HRESULT hr, const bool retryable)
+{
+  if (retryable && !t->cancelled() && t->attempt < t->job.options.retries)
+  {
+    // 0.5 s, 1 s, 2 s, ... up to 8 s as download() waits
+    t->retry_at = steady::now() + std::chrono::milliseconds(500 << (t->attempt < 4 ? t->attempt : 4));
+    ++t->attempt;
+    retrying_.push_back(std::move(t));
+    return;
+  }
+  const bool cancelled = t->cancelled();
+  complete(std::move(t), cancelled ? E_ABORT : hr);
+}
+
+void DownloadEngine::loop::complete(std::unique_ptr<transfer> t, HRESULT hr)
+{
+  if (t->file != INVALID_FILE_HANDLE)
+  {
+    const HRESULT chr = file_close(t->file);
+    hr = FAILED(hr) ? hr : chr;
+    if (SUCCEEDED(hr))
+    {
+      hr = file_move(t->part.c_str(), t->job.filepath.c_str());
+    }
+    if (FAILED(hr))
+    {
+      file_delete(t->part.c_str());
+    }
+  }
+  t->sample.bytes = t->received;
+  if (FAILED(hr))
+  {
+    t->fn(hr, 0, 0, t->sample);
+    return;
+  }
+  t->fn(hr, t->hasher.digest(), t->hasher.length(), t->sample);
+}
+
+DownloadEngine::DownloadEngine(const size_t threads, const size_t connections_per_host)
+    : threads_(threads < 1 ? 1 : threads),
+      connections_per_host_(connections_per_host < 1 ? 1 : connections_per_host),
+      next_(0),
+      stopping_(false)
+{
+}
+
+DownloadEngine::~DownloadEngine()
+{
+  shutdown();
+}
+
+HRESULT DownloadEngine::submit(engine_job job, engine_completion fn)
+{
+  std::unique_ptr<transfer> t(new transfer());
+  HRESULT hr = parse_http_url(job.url.c_str(), t->url);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  hr = to_u8(job.user_agent.c_str(), (int)job.user_agent.size(), t->user_agent);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  t->key = t->url.host + ":" + t->url.port;
+  t->part = job.filepath + WIDE(".part");
+  t->file = INVALID_FILE_HANDLE;
+  t->offset = 0;
+  t->total = 0;
+  t->received = 0;
+  t->response_received = 0;
+  t->attempt = 0;
+  t->sample = {};
+  t->job = std::move(job);
+  t->fn = std::move(fn);
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (stopping_)
+  {
+    return E_ABORT;
+  }
+  // the loops are started on demand so that an idle engine costs nothing
+  if (loops_.empty())
+  {
+    for (size_t i = 0; i < threads_; ++i)
+    {
+      std::unique_ptr<loop> l(new loop(connections_per_host_));
+      hr = l->start();
+      if (FAILED(hr))
+      {
+        loops_.clear();
+        return hr;
+      }
+      loops_.push_back(std::move(l));
+    }
+  }
+  loops_[next_++ % loops_.size()]->post(std::move(t));
+  return S_OK;
+}
+
+void DownloadEngine::shutdown()
+{
+  std::vector<std::unique_ptr<loop>> loops;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stopping_ = true;
+    loops.swap(loops_);
+  }
+  for (std::unique_ptr<loop> &l : loops)
+  {
+    l->stop();
+  }
+}
+
+#endif
@@ -0,0 +1,558 @@
+#include "filename.h"
+
+#include "simd.h"
+
+namespace
+{
+  // Bitmap of the ASCII characters that cannot be used in a filename.
+  struct forbidden_bitmap
+  {
+    uint64_t bits[2];
+
+    constexpr bool test(const WCHAR c) const
+    {
+      return c < 0x80 && (bits[c >> 6] >> (c & 63)) & 1;
+    }
+  };
+
+  constexpr forbidden_bitmap build_forbidden()
+  {
+    forbidden_bitmap m = {};
+    const char chars[] = "\"*/:<>?\\|\x7f";
+    for (int c = 0; c < 0x20; ++c)
+    {
+      m.bits[0] |= uint64_t(1) << c;
+    }
+    for (const char *p = chars; *p; ++p)
+    {
+      m.bits[*p >> 6] |= uint64_t(1) << (*p & 63);
+    }
+    return m;
+  }
+
+  constexpr forbidden_bitmap forbidden = build_forbidden();
+  static_assert(forbidden.test(0x00) && forbidden.test(0x1f) && forbidden.test(0x5c) && forbidden.test(0x7f));
+  static_assert(!forbidden.test(0x20) && !forbidden.test(0x5f) && !forbidden.test(0x7e) && !forbidden.test(0xff1f));
+
+  // Nibble tables for the vectorized scan: c is forbidden if lo[c & 0xf] & hi[c >> 4].
+  // hi is 0 for 0x80-0xff so bytes that were clamped from non-ASCII never match.
+  struct nibble_tables
+  {
+    uint8_t lo[16];
+    uint8_t hi[16];
+  };
+
+  constexpr nibble_tables build_nibble_tables()
+  {
+    nibble_tables t = {};
+    for (int c = 0; c < 0x80; ++c)
+    {
+      if (forbidden.test((WCHAR)c))
+      {
+        t.lo[c & 0xf] |= (uint8_t)(1 << (c >> 4));
+      }
+    }
+    for (int h = 0; h < 8; ++h)
+    {
+      t.hi[h] = (uint8_t)(1 << h);
+    }
+    return t;
+  }
+
+  constexpr nibble_tables nibbles = build_nibble_tables();
+}
+
+static inline void sanitize_chars_scalar(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    dest[i] = forbidden.test(src[i]) ? WIDE('_') : src[i];
+  }
+}
+
+#ifdef CFS_SIMD_X86
+
+CFS_TARGET_SSE41 static void sanitize_chars_sse41(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  const __m128i lo = _mm_loadu_si128((const __m128i *)nibbles.lo);
+  const __m128i hi = _mm_loadu_si128((const __m128i *)nibbles.hi);
+  const __m128i x0f = _mm_set1_epi8(0x0f);
+  const __m128i xff = _mm_set1_epi16(0xff);
+  const __m128i underscore = _mm_set1_epi16(WIDE('_'));
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    const __m128i bytes = _mm_packus_epi16(_mm_min_epu16(a, xff), _mm_min_epu16(b, xff));
+    const __m128i ok = _mm_cmpeq_epi8(
+        _mm_and_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(bytes, x0f)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(bytes, 4), x0f))),
+        _mm_setzero_si128());
+    if (_mm_movemask_epi8(ok) == 0xffff)
+    {
+      _mm_storeu_si128((__m128i *)(dest + i), a);
+      _mm_storeu_si128((__m128i *)(dest + i + 8), b);
+      continue;
+    }
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_blendv_epi8(underscore, a, _mm_unpacklo_epi8(ok, ok)));
+    _mm_storeu_si128((__m128i *)(dest + i + 8), _mm_blendv_epi8(underscore, b, _mm_unpackhi_epi8(ok, ok)));
+  }
+  sanitize_chars_scalar(src + i, n - i, dest + i);
+}
+
+CFS_TARGET_AVX2 static void sanitize_chars_avx2(const WCHAR *src, const size_t n, WCHAR *dest)
+{
+  const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)nibbles.lo));
+  const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)nibbles.hi));
+  const __m256i x0f = _mm256_set1_epi8(0x0f);
+  const __m256i xff = _mm256_set1_epi16(0xff);
+  const __m256i underscore = _mm256_set1_epi16(WIDE('_'));
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+    // packus works per 128-bit lane, so bytes holds a0-7 b0-7 a8-15 b8-15
+    // and unpacklo/unpackhi below restore the order of a and b.
+    const __m256i bytes = _mm256_packus_epi16(_mm256_min_epu16(a, xff), _mm256_min_epu16(b, xff));
+    const __m256i ok = _mm256_cmpeq_epi8(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(bytes, x0f)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), x0f))),
+        _mm256_setzero_si256());
+    if (_mm256_movemask_epi8(ok) == -1)
+    {
+      _mm256_storeu_si256((__m256i *)(dest + i), a);
+      _mm256_storeu_si256((__m256i *)(dest + i + 16), b);
+      continue;
+    }
+    _mm256_storeu_si256((__m256i *)(dest + i), _mm256_blendv_epi8(underscore, a, _mm256_unpacklo_epi8(ok, ok)));
+    _mm256_storeu_si256((__m256i *)(dest + i + 16), _mm256_blendv_epi8(underscore, b, _mm256_unpackhi_epi8(ok, ok)));
+  }
+  sanitize_chars_sse41(src + i, n - i, dest + i);
+}
+
+#endif
+
+void sanitize_chars(LPCWSTR src, const size_t n, WCHAR *dest)
+{
+#ifdef CFS_SIMD_X86
+  switch (simd_level())
+  {
+  case SIMD_AVX2:
+    return sanitize_chars_avx2(src, n, dest);
+  case SIMD_SSE41:
+    return sanitize_chars_sse41(src, n, dest);
+  }
+#endif
+  sanitize_chars_scalar(src, n, dest);
+}
+
+static inline WCHAR to_upper_ascii(const WCHAR c)
+{
+  return c >= WIDE('a') && c <= WIDE('z') ? (WCHAR)(c - 0x20) : c;
+}
+
+// Returns the length of the reserved device name at the beginning of name, or 0.
+// "CON", "con.txt" and "NUL .wav" are reserved but "CONSOLE" is not.
+static size_t reserved_device_name(const WCHAR *name, const size_t n)
+{
+  static const char names[][4] = {"CON", "PRN", "AUX", "NUL", "COM", "LPT"};
+  if (n < 3)
+  {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+  {
+    if (to_upper_ascii(name[0]) != names[i][0] ||
+        to_upper_ascii(name[1]) != names[i][1] ||
+        to_upper_ascii(name[2]) != names[i][2])
+    {
+      continue;
+    }
+    size_t len = 3;
+    if (i >= 4)
+    {
+      // COM1-COM9, LPT1-LPT9
+      if (n < 4 || name[3] < WIDE('1') || name[3] > WIDE('9'))
+      {
+        return 0;
+      }
+      len = 4;
+    }
+    size_t end = len;
+    while (end < n && name[end] == WIDE(' '))
+    {
+      ++end;
+    }
+    return end == n || name[end] == WIDE('.') ? len : 0;
+  }
+  return 0;
+}
+
+// Replaces trailing dots and spaces and appends '_' to a reserved device name.
+// dest must have room for one more character.
+static void fix_name(wstr &dest, const size_t begin)
+{
+  WCHAR *d = &dest[begin];
+  const size_t n = dest.size() - begin;
+  // Windows drops trailing dots and spaces
+  for (size_t i = n; i > 0 && (d[i - 1] == WIDE('.') || d[i - 1] == WIDE(' ')); --i)
+  {
+    d[i - 1] = WIDE('_');
+  }
+  const size_t len = reserved_device_name(d, n);
+  if (len)
+  {
+    dest.insert(begin + len, 1, WIDE('_'));
+  }
+}
+
+void sanitize(LPCWSTR src, wstr &dest)
+{
+  const size_t n = std::char_traits<WCHAR>::length(src);
+  // one more for the '_' that is appended to a reserved device name
+  dest.reserve(n + 1);
+  dest.resize(n);
+  if (n == 0)
+  {
+    return;
+  }
+  sanitize_chars(src, n, &dest[0]);
+  fix_name(dest, 0);
+}
+
+const WCHAR default_filename_template[] = WIDE("{date:%Y%m%d_%H%M%S}_{character}_{text:10}");
+
+enum
+{
+  OP_LITERAL,
+  OP_YEAR,
+  OP_MONTH,
+  OP_DAY,
+  OP_HOUR,
+  OP_MINUTE,
+  OP_SECOND,
+  OP_SEQ,
+  OP_SEQ_ZERO,
+  OP_CHARACTER,
+  OP_TEXT,
+};
+
+static void add_literal(filename_template &t, const WCHAR c)
+{
+  if (t.ops.empty() || t.ops.back().type != OP_LITERAL)
+  {
+    t.ops.push_back({OP_LITERAL, 0, t.literals.size()});
+  }
+  t.literals += forbidden.test(c) ? WIDE('_') : c;
+  ++t.ops.back().width;
+}
+
+// Parses the optional number after ':'. Returns false if arg is not a number in 1-255.
+static bool parse_width(const wstr &arg, int &width)
+{
+  if (arg.empty())
+  {
+    return true;
+  }
+  if (arg.size() > 3)
+  {
+    return false;
+  }
+  int v = 0;
+  for (const WCHAR c : arg)
+  {
+    if (c < WIDE('0') || c > WIDE('9'))
+    {
+      return false;
+    }
+    v = v * 10 + (c - WIDE('0'));
+  }
+  if (v < 1 || v > 255)
+  {
+    return false;
+  }
+  width = v;
+  return true;
+}
+
+static bool compile_date(const wstr &format, filename_template &t)
+{
+  for (size_t i = 0; i < format.size(); ++i)
+  {
+    if (format[i] != WIDE('%'))
+    {
+      add_literal(t, format[i]);
+      continue;
+    }
+    if (++i == format.size())
+    {
+      return false;
+    }
+    int type;
+    switch (format[i])
+    {
+    case WIDE('Y'):
+      type = OP_YEAR;
+      break;
+    case WIDE('m'):
+      type = OP_MONTH;
+      break;
+    case WIDE('d'):
+      type = OP_DAY;
+      break;
+    case WIDE('H'):
+      type = OP_HOUR;
+      break;
+    case WIDE('M'):
+      type = OP_MINUTE;
+      break;
+    case WIDE('S'):
+      type = OP_SECOND;
+      break;
+    case WIDE('%'):
+      add_literal(t, WIDE('%'));
+      continue;
+    default:
+      return false;
+    }
+    t.ops.push_back({type, type == OP_YEAR ? 4 : 2, 0});
+    t.uses_time = true;
+  }
+  return true;
+}
+
+static bool compile_field(const wstr &name, const wstr &arg, const bool has_arg, filename_template &t)
+{
+  if (name == WIDE("date"))
+  {
+    return compile_date(has_arg ? arg : wstr(WIDE("%Y%m%d")), t);
+  }
+  int width = 0;
+  if (name == WIDE("seq"))
+  {
+    if (!parse_width(arg, width))
+    {
+      return false;
+    }
+    t.ops.push_back({arg.size() > 1 && arg[0] == WIDE('0') ? OP_SEQ_ZERO : OP_SEQ, width, 0});
+    return true;
+  }
+  if (name == WIDE("character") || name == WIDE("text"))
+  {
+    if (!parse_width(arg, width))
+    {
+      return false;
+    }
+    t.ops.push_back({name == WIDE("text") ? OP_TEXT : OP_CHARACTER, width, 0});
+    return true;
+  }
+  return false;
+}
+
+HRESULT compile_filename_template(LPCWSTR pattern, filename_template &dest)
+{
+  filename_template t = {};
+  for (LPCWSTR p = pattern; *p != WIDE('\0'); ++p)
+  {
+    if (*p == WIDE('}'))
+    {
+      if (p[1] != WIDE('}'))
+      {
+        return E_INVALIDARG;
+      }
+      add_literal(t, *p++);
+      continue;
+    }
+    if (*p != WIDE('{'))
+    {
+      add_literal(t, *p);
+      continue;
+    }
+    if (p[1] == WIDE('{'))
+    {
+      add_literal(t, *++p);
+      continue;
+    }
+    LPCWSTR end = p + 1;
+    while (*end != WIDE('}') && *end != WIDE('\0'))
+    {
+      ++end;
+    }
+    if (*end == WIDE('\0'))
+    {
+      return E_INVALIDARG;
+    }
+    const wstr field(p + 1, end);
+    const size_t colon = field.find(WIDE(':'));
+    const bool has_arg = colon != wstr::npos;
+    if (!compile_field(field.substr(0, colon), has_arg ? field.substr(colon + 1) : wstr(), has_arg, t))
+    {
+      return E_INVALIDARG;
+    }
+    p = end;
+  }
+  dest = std::move(t);
+  return S_OK;
+}
+
+static inline uint32_t code_point_at(LPCWSTR s, size_t &i)
+{
+  const uint32_t c = s[i++];
+  if (c >= 0xd800 && c <= 0xdbff && s[i] >= 0xdc00 && s[i] <= 0xdfff)
+  {
+    return 0x10000 + ((c - 0xd800) << 10) + (s[i++] - 0xdc00);
+  }
+  return c;
+}
+
+// Code points that attach to the preceding character.
+static inline bool is_extender(const uint32_t c)
+{
+  return (c >= 0x0300 && c <= 0x036f) ||   // combining diacritical marks
+         (c >= 0x1ab0 && c <= 0x1aff) ||   //
+         (c >= 0x1dc0 && c <= 0x1dff) ||   //
+         (c >= 0x200c && c <= 0x200d) ||   // ZWNJ, ZWJ
+         (c >= 0x20d0 && c <= 0x20ff) ||   // combining marks for symbols, keycap
+         (c >= 0x3099 && c <= 0x309a) ||   // combining (semi-)voiced sound marks
+         (c >= 0xfe00 && c <= 0xfe0f) ||   // variation selectors
+         (c >= 0xfe20 && c <= 0xfe2f) ||   //
+         (c >= 0x1f3fb && c <= 0x1f3ff) || // emoji skin tone modifiers
+         (c >= 0xe0020 && c <= 0xe007f) || // tag characters
+         (c >= 0xe0100 && c <= 0xe01ef);   // ideographic variation selectors
+}
+
+// Finds the end of the first max characters of s without scanning the rest of it.
+// Sets truncated if s is longer, and prev to the end of the first max - 1 characters.
+static size_t prefix_length(LPCWSTR s, const int max, size_t &prev, bool &truncated)
+{
+  size_t i = 0;
+  prev = 0;
+  truncated = false;
+  for (int count = 0; s[i] != WIDE('\0'); ++count)
+  {
+    if (count == max)
+    {
+      truncated = true;
+      break;
+    }
+    prev = i;
+    uint32_t c = code_point_at(s, i);
+    while (s[i] != WIDE('\0'))
+    {
+      size_t next = i;
+      const uint32_t e = code_point_at(s, next);
+      if (!is_extender(e) && c != 0x200d)
+      {
+        break;
+      }
+      c = e;
+      i = next;
+    }
+  }
+  return i;
+}
+
+static void append_number(int v, int digits, wstr &dest)
+{
+  WCHAR buf[16];
+  int n = 0;
+  do
+  {
+    buf[15 - n++] = (WCHAR)(WIDE('0') + v % 10);
+    v /= 10;
+  } while (v > 0 && n < 16);
+  while (n < digits && n < 16)
+  {
+    buf[15 - n++] = WIDE('0');
+  }
+  dest.append(buf + 16 - n, n);
+}
+
+static void append_sanitized(LPCWSTR src, const int max, const bool ellipsis, wstr &dest)
+{
+  size_t n;
+  bool truncated = false;
+  if (max == 0)
+  {
+    n = std::char_traits<WCHAR>::length(src);
+  }
+  else
+  {
+    size_t prev = 0;
+    n = prefix_length(src, max, prev, truncated);
+    if (truncated && ellipsis)
+    {
+      n = prev;
+    }
+  }
+  const size_t pos = dest.size();
+  dest.append(src, n);
+  sanitize_chars(&dest[pos], n, &dest[pos]);
+  if (truncated && ellipsis)
+  {
+    dest += WIDE("…");
+  }
+}
+
+void format_filename(const filename_template &t, const filename_params &params, LPCWSTR ext, wstr &dest)
+{
+  dest.resize(0);
+  dest.reserve(260);
+  local_time tm = {};
+  if (t.uses_time)
+  {
+    get_local_time(tm);
+  }
+  for (const filename_template::op &op : t.ops)
+  {
+    switch (op.type)
+    {
+    case OP_LITERAL:
+      dest.append(t.literals, op.pos, op.width);
+      break;
+    case OP_YEAR:
+      append_number(tm.year, op.width, dest);
+      break;
+    case OP_MONTH:
+      append_number(tm.month, op.width, dest);
+      break;
+    case OP_DAY:
+      append_number(tm.day, op.width, dest);
+      break;
+    case OP_HOUR:
+      append_number(tm.hour, op.width, dest);
+      break;
+    case OP_MINUTE:
+      append_number(tm.minute, op.width, dest);
+      break;
+    case OP_SECOND:
+      append_number(tm.second, op.width, dest);
+      break;
+    case OP_SEQ_ZERO:
+      append_number(params.seq, op.width, dest);
+      break;
+    case OP_SEQ:
+    {
+      const size_t pos = dest.size();
+      append_number(params.seq, 0, dest);
+      if (dest.size() - pos < (size_t)op.width)
+      {
+        dest.insert(pos, op.width - (dest.size() - pos), WIDE(' '));
+      }
+      break;
+    }
+    case OP_CHARACTER:
+      append_sanitized(params.character, op.width, false, dest);
+      break;
+    case OP_TEXT:
+      append_sanitized(params.text, op.width, true, dest);
+      break;
+    }
+  }
+  fix_name(dest, 0);
+  dest += ext;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "platform.h"
+
+// Makes src usable as a filename on Windows.
+// Characters that cannot be used in a filename and trailing dots and spaces are replaced with '_',
+// and '_' is appended to reserved device names such as "CON" or "COM1".
+void sanitize(LPCWSTR src, wstr &dest);
+
+// Replaces characters that cannot be used in a filename with '_'.
+// Writes n code units to dest, which may be the same as src.
+void sanitize_chars(LPCWSTR src, const size_t n, WCHAR *dest);
+
+// Filename pattern used when the setting has none.
+// This gives the names of the earlier versions, "YYYYMMDD_hhmmss_<character>_<text>".
+extern const WCHAR default_filename_template[];
+
+// Filename pattern compiled by compile_filename_template.
+struct filename_template
+{
+  struct op
+  {
+    int type;
+    int width;
+    size_t pos; // literal: offset in literals
+  };
+  wstr literals;
+  std::vector<op> ops;
+  bool uses_time;
+};
+
+struct filename_params
+{
+  LPCWSTR character;
+  LPCWSTR text;
+  int seq;
+};
+
+// Compiles a pattern such as "{date:%Y%m%d}_{seq:05}_{character}_{text:20}".
+//   {date:FORMAT}   local time, FORMAT supports %Y %m %d %H %M %S and %%
+//   {seq:WIDTH}     params.seq, padded with zeros if WIDTH starts with 0
+//   {character:N}   the first N characters of params.character
+//   {text:N}        the first N characters of params.text, or N-1 characters and "…" if longer
+// N counts user-perceived characters, so surrogate pairs and combining marks are never split.
+// Use {{ and }} for braces. Returns E_INVALIDARG if the pattern is malformed.
+HRESULT compile_filename_template(LPCWSTR pattern, filename_template &dest);
+
+// Builds the filename for params and appends ext (e.g. ".wav").
+// Only the characters that are actually used are sanitized.
+void format_filename(const filename_template &t, const filename_params &params, LPCWSTR ext, wstr &dest);
@@ -0,0 +1,152 @@
+#include "hash.h"
+
+#include <string.h>
+
+namespace
+{
+  constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+  constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+  constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+  inline uint64_t rotl(const uint64_t x, const int r)
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  inline uint64_t read64(const uint8_t *p)
+  {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+  }
+
+  inline uint32_t read32(const uint8_t *p)
+  {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+
+  inline uint64_t round(uint64_t acc, const uint64_t input)
+  {
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+  }
+
+  inline uint64_t merge(uint64_t acc, const uint64_t v)
+  {
+    acc ^= round(0, v);
+    return acc * prime1 + prime4;
+  }
+
+  // Consumes whole 32-byte stripes and returns the number of bytes used.
+  inline size_t consume(uint64_t *acc, const uint8_t *p, const size_t n)
+  {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+      acc[0] = round(acc[0], read64(p + i));
+      acc[1] = round(acc[1], read64(p + i + 8));
+      acc[2] = round(acc[2], read64(p + i + 16));
+      acc[3] = round(acc[3], read64(p + i + 24));
+    }
+    return i;
+  }
+}
+
+Hasher::Hasher(const uint64_t seed) : buf_(), buffered_(0), total_(0), seed_(seed)
+{
+  acc_[0] = seed + prime1 + prime2;
+  acc_[1] = seed + prime2;
+  acc_[2] = seed;
+  acc_[3] = seed - prime1;
+}
+
+void Hasher::update(const void *p, const size_t n)
+{
+  const uint8_t *s = (const uint8_t *)p;
+  size_t pos = 0;
+  total_ += n;
+  if (buffered_ > 0)
+  {
+    const size_t fill = n < 32 - buffered_ ? n : 32 - buffered_;
+    memcpy(buf_ + buffered_, s, fill);
+    buffered_ += fill;
+    pos = fill;
+    if (buffered_ < 32)
+    {
+      return;
+    }
+    consume(acc_, buf_, 32);
+    buffered_ = 0;
+  }
+  pos += consume(acc_, s + pos, n - pos);
+  memcpy(buf_, s + pos, n - pos);
+  buffered_ = n - pos;
+}
+
+uint64_t Hasher::digest() const
+{
+  uint64_t h;
+  if (total_ >= 32)
+  {
+    h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+    for (const uint64_t v : acc_)
+    {
+      h = merge(h, v);
+    }
+  }
+  else
+  {
+    h = seed_ + prime5;
+  }
+  h += total_;
+  size_t i = 0;
+  for (; i + 8 <= buffered_; i += 8)
+  {
+    h ^= round(0, read64(buf_ + i));
+    h = rotl(h, 27) * prime1 + prime4;
+  }
+  if (i + 4 <= buffered_)
+  {
+    h ^= (uint64_t)read32(buf_ + i) * prime1;
+    h = rotl(h, 23) * prime2 + prime3;
+    i += 4;
+  }
+  for (; i < buffered_; ++i)
+  {
+    h ^= buf_[i] * prime5;
+    h = rotl(h, 11) * prime1;
+  }
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t Hasher::length() const
+{
+  return total_;
+}
+
+uint64_t Hasher::hash(const void *p, const size_t n, const uint64_t seed)
+{
+  Hasher h(seed);
+  h.update(p, n);
+  return h.digest();
+}
+
+void hash_to_hex(const uint64_t h, wstr &dest)
+{
+  static const char digits[] = "0123456789abcdef";
+  dest.resize(16);
+  for (int i = 0; i < 16; ++i)
+  {
+    dest[i] = (WCHAR)digits[(h >> (60 - i * 4)) & 0xf];
+  }
+}
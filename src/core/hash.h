@@ -0,0 +1,28 @@
+#pragma once
+
+#include "platform.h"
+
+// XXH64, fed incrementally so that data can be hashed as it streams past.
+class Hasher
+{
+public:
+  explicit Hasher(const uint64_t seed = 0);
+
+  void update(const void *p, const size_t n);
+  // Returns the hash of everything given so far. More data may be added afterwards.
+  uint64_t digest() const;
+  // Returns the number of bytes given so far.
+  uint64_t length() const;
+
+  static uint64_t hash(const void *p, const size_t n, const uint64_t seed = 0);
+
+private:
+  uint64_t acc_[4];
+  uint8_t buf_[32];
+  size_t buffered_;
+  uint64_t total_;
+  uint64_t seed_;
+};
+
+// Formats h as 16 lowercase hex digits.
+void hash_to_hex(const uint64_t h, wstr &dest);
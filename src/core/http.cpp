@@ -0,0 +1,258 @@
+#include "http.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "encoding.h"
+
+// Lines longer than this in a chunked body are rejected.
+static constexpr size_t max_line_bytes = 4096;
+
+static bool equal_nocase(const std::string &a, const char *b)
+{
+  const size_t n = strlen(b);
+  if (a.size() != n)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+HRESULT parse_http_url(LPCWSTR url, http_url &dest)
+{
+  std::string u;
+  const HRESULT hr = to_u8(url, -1, u);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (u.compare(0, 8, "https://") == 0)
+  {
+    return E_NOTIMPL;
+  }
+  if (u.compare(0, 7, "http://") != 0)
+  {
+    return E_INVALIDARG;
+  }
+  const size_t end = u.find_first_of("/?#", 7);
+  const std::string authority = u.substr(7, end == std::string::npos ? std::string::npos : end - 7);
+  dest.target = end == std::string::npos ? "/" : u.substr(end, u.find('#', end) - end);
+  if (dest.target.empty() || dest.target[0] != '/')
+  {
+    dest.target.insert(0, 1, '/');
+  }
+  size_t colon = std::string::npos;
+  if (!authority.empty() && authority[0] == '[')
+  {
+    const size_t close = authority.find(']');
+    if (close == std::string::npos)
+    {
+      return E_INVALIDARG;
+    }
+    dest.host = authority.substr(1, close - 1);
+    colon = authority.size() > close + 1 && authority[close + 1] == ':' ? close + 1 : std::string::npos;
+  }
+  else
+  {
+    colon = authority.rfind(':');
+    dest.host = authority.substr(0, colon);
+  }
+  dest.port = colon != std::string::npos ? authority.substr(colon + 1) : "80";
+  if (dest.host.empty() || dest.port.empty())
+  {
+    return E_INVALIDARG;
+  }
+  return S_OK;
+}
+
+std::string build_http_get(const http_url &url, const std::string &user_agent, const std::string &headers)
+{
+  std::string host = url.host.find(':') != std::string::npos ? "[" + url.host + "]" : url.host;
+  if (url.port != "80")
+  {
+    host += ":" + url.port;
+  }
+  return "GET " + url.target + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: " + user_agent +
+         "\r\nAccept: */*\r\nConnection: keep-alive\r\n" + headers + "\r\n";
+}
+
+bool http_head::find(const char *name, std::string &value) const
+{
+  for (const auto &h : headers)
+  {
+    if (equal_nocase(h.first, name))
+    {
+      value = h.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t find_http_head_end(const char *p, const size_t n)
+{
+  for (size_t i = 0; i + 1 < n; ++i)
+  {
+    // the lines end with CRLF, but a bare LF is accepted as well
+    if (p[i] == '\n' && (p[i + 1] == '\n' || (p[i + 1] == '\r' && i + 2 < n && p[i + 2] == '\n')))
+    {
+      return p[i + 1] == '\n' ? i + 2 : i + 3;
+    }
+  }
+  return 0;
+}
+
+HRESULT parse_http_head(const char *p, const size_t n, http_head &dest)
+{
+  dest.status = 0;
+  dest.keep_alive = false;
+  dest.body = HTTP_BODY_LENGTH;
+  dest.length = 0;
+  dest.headers.clear();
+  size_t pos = 0;
+  bool first = true;
+  while (pos < n)
+  {
+    const char *lf = (const char *)memchr(p + pos, '\n', n - pos);
+    const size_t end = lf ? (size_t)(lf - p) : n;
+    const std::string line(p + pos, (end > pos && p[end - 1] == '\r' ? end - 1 : end) - pos);
+    pos = end + 1;
+    if (first)
+    {
+      // HTTP/1.1 200 OK
+      if (line.compare(0, 5, "HTTP/") != 0 || line.size() < 12)
+      {
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+      }
+      dest.status = atoi(line.c_str() + 9);
+      dest.keep_alive = line.compare(5, 3, "1.1") == 0;
+      first = false;
+      continue;
+    }
+    if (line.empty())
+    {
+      break;
+    }
+    const size_t colon = line.find(':');
+    if (colon == std::string::npos)
+    {
+      continue;
+    }
+    const size_t v = line.find_first_not_of(" \t", colon + 1);
+    const size_t e = line.find_last_not_of(" \t");
+    dest.headers.emplace_back(line.substr(0, colon), v == std::string::npos ? std::string() : line.substr(v, e - v + 1));
+  }
+  if (first)
+  {
+    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+  }
+
+  std::string v;
+  if (dest.find("Connection", v))
+  {
+    if (equal_nocase(v, "close"))
+    {
+      dest.keep_alive = false;
+    }
+    else if (equal_nocase(v, "keep-alive"))
+    {
+      dest.keep_alive = true;
+    }
+  }
+  if (dest.status == 204 || dest.status == 304 || (dest.status >= 100 && dest.status < 200))
+  {
+    dest.body = HTTP_BODY_LENGTH;
+  }
+  else if (dest.find("Transfer-Encoding", v) && v.find("chunked") != std::string::npos)
+  {
+    dest.body = HTTP_BODY_CHUNKED;
+  }
+  else if (dest.find("Content-Length", v))
+  {
+    dest.body = HTTP_BODY_LENGTH;
+    dest.length = strtoull(v.c_str(), nullptr, 10);
+  }
+  else
+  {
+    dest.body = HTTP_BODY_UNTIL_CLOSE;
+    dest.keep_alive = false;
+  }
+  return S_OK;
+}
+
+ChunkedDecoder::ChunkedDecoder() : state_(state_size), left_(0)
+{
+}
+
+HRESULT ChunkedDecoder::decode(const char *p, const size_t n, const char *&data, size_t &data_size, size_t &consumed)
+{
+  data = nullptr;
+  data_size = 0;
+  consumed = 0;
+  if (n == 0 || state_ == state_done)
+  {
+    return S_OK;
+  }
+  if (state_ == state_data)
+  {
+    data = p;
+    data_size = n < left_ ? n : (size_t)left_;
+    consumed = data_size;
+    left_ -= data_size;
+    if (left_ == 0)
+    {
+      state_ = state_data_end;
+    }
+    return S_OK;
+  }
+  // the other states read a line
+  const char *lf = (const char *)memchr(p, '\n', n);
+  if (!lf)
+  {
+    line_.append(p, n);
+    consumed = n;
+    return line_.size() > max_line_bytes ? HRESULT_FROM_WIN32(ERROR_INVALID_DATA) : S_OK;
+  }
+  line_.append(p, lf);
+  consumed = (size_t)(lf - p) + 1;
+  if (!line_.empty() && line_.back() == '\r')
+  {
+    line_.pop_back();
+  }
+  switch (state_)
+  {
+  case state_size:
+  {
+    char *end = nullptr;
+    left_ = strtoull(line_.c_str(), &end, 16);
+    if (end == line_.c_str())
+    {
+      return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    state_ = left_ > 0 ? state_data : state_trailer;
+    break;
+  }
+  case state_data_end:
+    if (!line_.empty())
+    {
+      return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    state_ = state_size;
+    break;
+  case state_trailer:
+    if (line_.empty())
+    {
+      state_ = state_done;
+    }
+    break;
+  }
+  line_.clear();
+  return S_OK;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "platform.h"
+
+// HTTP/1.1 message handling shared by the socket transport and the download engine.
+
+struct http_url
+{
+  std::string host;
+  std::string port;
+  // path and query
+  std::string target;
+};
+
+// Splits an http URL. Returns E_NOTIMPL for https, which needs TLS, and E_INVALIDARG
+// for anything else that is not http.
+HRESULT parse_http_url(LPCWSTR url, http_url &dest);
+
+// Builds a keep-alive GET request. headers holds extra lines, each ending with "\r\n".
+std::string build_http_get(const http_url &url, const std::string &user_agent, const std::string &headers);
+
+enum
+{
+  HTTP_BODY_LENGTH = 0,
+  HTTP_BODY_CHUNKED = 1,
+  HTTP_BODY_UNTIL_CLOSE = 2,
+};
+
+struct http_head
+{
+  int status;
+  // whether the connection can be used again after the body
+  bool keep_alive;
+  // HTTP_BODY_*
+  int body;
+  // length of the body for HTTP_BODY_LENGTH
+  uint64_t length;
+  std::vector<std::pair<std::string, std::string>> headers;
+
+  // Finds a header by its name, which is not case sensitive.
+  bool find(const char *name, std::string &value) const;
+};
+
+// Returns the length of the response head at p, including the empty line that ends it,
+// or 0 if the head is not complete yet.
+size_t find_http_head_end(const char *p, const size_t n);
+
+// Parses a complete response head of n bytes.
+HRESULT parse_http_head(const char *p, const size_t n, http_head &dest);
+
+// Decodes a chunked body as it arrives.
+class ChunkedDecoder
+{
+public:
+  ChunkedDecoder();
+
+  // Consumes up to n bytes at p. data receives the address of the body bytes found at the
+  // start of them and data_size their number; consumed is the number of bytes used.
+  // Call again with the rest until consumed is 0, which means more input is needed.
+  HRESULT decode(const char *p, const size_t n, const char *&data, size_t &data_size, size_t &consumed);
+  bool done() const
+  {
+    return state_ == state_done;
+  }
+
+private:
+  enum
+  {
+    state_size,
+    state_data,
+    state_data_end,
+    state_trailer,
+    state_done,
+  };
+
+  int state_;
+  uint64_t left_;
+  std::string line_;
+};
@@ -0,0 +1,158 @@
+#include "inflate.h"
+
+#include <ctype.h>
+#include <limits.h>
+
+#ifdef CFS_HAVE_ZLIB
+#include <zlib.h>
+#else
+struct z_stream_s
+{
+};
+#endif
+
+int parse_content_encoding(const std::string &value)
+{
+  std::string v;
+  for (const char c : value)
+  {
+    if (c != ' ' && c != '\t')
+    {
+      v += (char)tolower((unsigned char)c);
+    }
+  }
+  if (v.empty() || v == "identity")
+  {
+    return CONTENT_IDENTITY;
+  }
+#ifdef CFS_HAVE_ZLIB
+  if (v == "gzip" || v == "x-gzip")
+  {
+    return CONTENT_GZIP;
+  }
+  if (v == "deflate")
+  {
+    return CONTENT_DEFLATE;
+  }
+#endif
+  return CONTENT_UNSUPPORTED;
+}
+
+const char *accept_encoding_header()
+{
+#ifdef CFS_HAVE_ZLIB
+  return "Accept-Encoding: gzip, deflate\r\n";
+#else
+  return "";
+#endif
+}
+
+Inflater::Inflater(const int encoding)
+    : encoding_(encoding), stream_(new z_stream_s()), initialized_(false), raw_(false), done_(false), head_(), head_size_(0), head_pos_(0)
+{
+}
+
+Inflater::~Inflater()
+{
+#ifdef CFS_HAVE_ZLIB
+  if (initialized_)
+  {
+    inflateEnd(stream_.get());
+  }
+#endif
+}
+
+HRESULT Inflater::decode(const void *p, const size_t n, void *dest, const size_t dest_size, size_t &consumed, size_t &written)
+{
+  consumed = 0;
+  written = 0;
+#ifdef CFS_HAVE_ZLIB
+  if (done_)
+  {
+    return S_OK;
+  }
+  if (!initialized_)
+  {
+    if (encoding_ == CONTENT_DEFLATE)
+    {
+      // "deflate" was meant to have the zlib header, but not every server adds it
+      while (head_size_ < 2 && consumed < n)
+      {
+        head_[head_size_++] = ((const uint8_t *)p)[consumed++];
+      }
+      if (head_size_ < 2)
+      {
+        return S_OK;
+      }
+      raw_ = (head_[0] & 0x0f) != Z_DEFLATED || (head_[0] >> 4) + 8 > MAX_WBITS || (head_[0] * 256 + head_[1]) % 31 != 0;
+    }
+    // 16 + 15 reads the gzip wrapper, 15 the zlib one and -15 none
+    if (inflateInit2(stream_.get(), encoding_ == CONTENT_GZIP ? 16 + MAX_WBITS : raw_ ? -MAX_WBITS : MAX_WBITS) != Z_OK)
+    {
+      return E_OUTOFMEMORY;
+    }
+    initialized_ = true;
+  }
+  uint8_t *out = (uint8_t *)dest;
+  size_t out_size = dest_size;
+  if (head_pos_ < head_size_)
+  {
+    size_t used = 0;
+    const HRESULT hr = inflate_some(head_ + head_pos_, head_size_ - head_pos_, out, out_size, used, written);
+    head_pos_ += used;
+    if (FAILED(hr) || head_pos_ < head_size_ || done_)
+    {
+      return hr;
+    }
+    out += written;
+    out_size -= written;
+  }
+  size_t used = 0, decoded = 0;
+  const HRESULT hr = inflate_some((const uint8_t *)p + consumed, n - consumed, out, out_size, used, decoded);
+  consumed += used;
+  written += decoded;
+  return hr;
+#else
+  (void)p;
+  (void)n;
+  (void)dest;
+  (void)dest_size;
+  return E_NOTIMPL;
+#endif
+}
+
+HRESULT Inflater::inflate_some(const void *p, const size_t n, void *dest, const size_t dest_size, size_t &consumed, size_t &written)
+{
+#ifdef CFS_HAVE_ZLIB
+  z_stream *z = stream_.get();
+  z->next_in = (Bytef *)p;
+  z->avail_in = n < UINT_MAX ? (uInt)n : UINT_MAX;
+  z->next_out = (Bytef *)dest;
+  z->avail_out = dest_size < UINT_MAX ? (uInt)dest_size : UINT_MAX;
+  const uInt avail_in = z->avail_in, avail_out = z->avail_out;
+  const int r = inflate(z, Z_NO_FLUSH);
+  consumed = avail_in - z->avail_in;
+  written = avail_out - z->avail_out;
+  switch (r)
+  {
+  case Z_STREAM_END:
+    done_ = true;
+    return S_OK;
+  case Z_OK:
+  case Z_BUF_ERROR:
+    return S_OK;
+  case Z_MEM_ERROR:
+    return E_OUTOFMEMORY;
+  default:
+    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+  }
+#else
+  (void)p;
+  (void)n;
+  (void)dest;
+  (void)dest_size;
+  consumed = 0;
+  written = 0;
+  return E_NOTIMPL;
+#endif
+}
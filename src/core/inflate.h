@@ -0,0 +1,58 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "platform.h"
+
+// Content codings of a response body.
+enum
+{
+  CONTENT_IDENTITY = 0,
+  CONTENT_GZIP = 1,
+  CONTENT_DEFLATE = 2,
+  // anything else, which cannot be decoded
+  CONTENT_UNSUPPORTED = 3,
+};
+
+// Returns the CONTENT_* for the value of a Content-Encoding header.
+// gzip and deflate are CONTENT_UNSUPPORTED when built without zlib.
+int parse_content_encoding(const std::string &value);
+
+// Returns the Accept-Encoding line for a request that can take a compressed body,
+// or an empty string without zlib. Not for Range requests: the range of a compressed
+// body counts compressed bytes, which say nothing about what has been written.
+const char *accept_encoding_header();
+
+struct z_stream_s;
+
+// Decodes a gzip or deflate body as it arrives.
+class Inflater
+{
+public:
+  explicit Inflater(const int encoding);
+  ~Inflater();
+
+  // Decodes up to n bytes at p into dest of dest_size bytes. consumed receives the number of
+  // input bytes used and written the number of bytes decoded. Call again with the rest of
+  // the input; when dest was filled, there may be more output even without more input.
+  HRESULT decode(const void *p, const size_t n, void *dest, const size_t dest_size, size_t &consumed, size_t &written);
+  // Whether the end of the compressed stream has been reached.
+  bool done() const
+  {
+    return done_;
+  }
+
+private:
+  const int encoding_;
+  std::unique_ptr<z_stream_s> stream_;
+  bool initialized_;
+  // deflate without the zlib header, which some servers send
+  bool raw_;
+  bool done_;
+  // the first two bytes of a deflate body, which tell whether it has the zlib header
+  uint8_t head_[2];
+  size_t head_size_, head_pos_;
+
+  HRESULT inflate_some(const void *p, const size_t n, void *dest, const size_t dest_size, size_t &consumed, size_t &written);
+};
@@ -0,0 +1,145 @@
+#include "limiter.h"
+
+namespace
+{
+  // The requests in flight when the server starts to struggle all fail together,
+  // which has to count as a single signal.
+  constexpr std::chrono::seconds cut_interval(1);
+  // A request this much slower than usual means the server is queueing.
+  constexpr double latency_spike = 3.0;
+  constexpr double min_latency_spike = 0.2;
+  // The throughput has to grow by this much for a round to raise the limit.
+  constexpr double throughput_gain = 1.05;
+  constexpr size_t history_size = 128;
+}
+
+Limiter::Limiter(const int initial, const int max)
+    : max_(max < 1 ? 1 : max),
+      limit_(1),
+      running_(0),
+      latency_(0),
+      samples_(0),
+      round_done_(0),
+      round_bytes_(0),
+      round_start_(clock::now()),
+      last_throughput_(0),
+      last_cut_()
+{
+  set_limit(initial < 1 ? 1 : initial > max_ ? max_
+                                             : initial,
+            "start");
+}
+
+HRESULT Limiter::acquire(const bool interactive, const std::atomic<bool> *cancelled)
+{
+  std::unique_lock<std::mutex> lock(mtx_);
+  while (!interactive && running_ >= limit_)
+  {
+    if (cancelled && cancelled->load())
+    {
+      return E_ABORT;
+    }
+    cv_.wait_for(lock, std::chrono::milliseconds(100));
+  }
+  ++running_;
+  return S_OK;
+}
+
+void Limiter::release(const transfer_sample &s)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    --running_;
+    if (s.status == 429 || s.status == 503)
+    {
+      cut(0.5, "throttled");
+    }
+    else if (s.failed)
+    {
+      cut(0.5, "failed");
+    }
+    else if (s.status >= 200 && s.status < 400)
+    {
+      const bool spike = samples_ >= 5 && s.latency > latency_ * latency_spike && s.latency > min_latency_spike;
+      latency_ = samples_ > 0 ? latency_ * 0.9 + s.latency * 0.1 : s.latency;
+      ++samples_;
+      if (spike)
+      {
+        cut(0.75, "latency");
+      }
+      else
+      {
+        round_bytes_ += s.bytes;
+        if (++round_done_ >= limit_)
+        {
+          const double seconds = std::chrono::duration<double>(clock::now() - round_start_).count();
+          const double throughput = seconds > 0 ? (double)round_bytes_ / seconds : 0;
+          if (limit_ < max_ && throughput > last_throughput_ * throughput_gain)
+          {
+            set_limit(limit_ + 1, "increase");
+          }
+          else
+          {
+            round_done_ = 0;
+            round_bytes_ = 0;
+            round_start_ = clock::now();
+          }
+          last_throughput_ = throughput;
+        }
+      }
+    }
+  }
+  cv_.notify_all();
+}
+
+int Limiter::limit() const
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  return limit_;
+}
+
+void Limiter::get_state(picojson::object &dest) const
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  dest["limit"] = picojson::value((double)limit_);
+  dest["max"] = picojson::value((double)max_);
+  dest["running"] = picojson::value((double)running_);
+  picojson::array history;
+  for (const change &c : history_)
+  {
+    picojson::object o;
+    o["time"] = picojson::value((double)c.time);
+    o["limit"] = picojson::value((double)c.limit);
+    o["reason"].set<std::string>(c.reason);
+    history.push_back(picojson::value(o));
+  }
+  dest["history"] = picojson::value(history);
+}
+
+void Limiter::set_limit(const int limit, const char *reason)
+{
+  limit_ = limit;
+  round_done_ = 0;
+  round_bytes_ = 0;
+  round_start_ = clock::now();
+  const auto now = std::chrono::system_clock::now().time_since_epoch();
+  history_.push_back({std::chrono::duration_cast<std::chrono::milliseconds>(now).count(), limit, reason});
+  if (history_.size() > history_size)
+  {
+    history_.pop_front();
+  }
+}
+
+void Limiter::cut(const double factor, const char *reason)
+{
+  const clock::time_point now = clock::now();
+  if (now - last_cut_ < cut_interval)
+  {
+    return;
+  }
+  last_cut_ = now;
+  // the throughput measured at the old limit says nothing about the new one
+  last_throughput_ = 0;
+  const int limit = (int)((double)limit_ * factor);
+  set_limit(limit < 1 ? 1 : limit, reason);
+}
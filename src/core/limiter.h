@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "platform.h"
+#include "picojson.h"
+
+// What a finished request tells about the server.
+struct transfer_sample
+{
+  // HTTP status, 0 if no response arrived.
+  int status;
+  // Whether the connection failed or timed out.
+  bool failed;
+  // Seconds from sending the request to receiving the response headers.
+  double latency;
+  uint64_t bytes;
+};
+
+// Adapts the number of requests sent at once to what the server copes with (AIMD).
+// The limit grows by one for each round of requests that raised the throughput,
+// and is cut by a factor on 429/503, failed connections and latency spikes.
+class Limiter
+{
+public:
+  Limiter(const int initial, const int max);
+
+  // Waits until fewer requests than the limit are running and counts one more.
+  // Interactive requests are counted without waiting.
+  // Returns E_ABORT if cancelled becomes true while waiting.
+  HRESULT acquire(const bool interactive, const std::atomic<bool> *cancelled);
+  // Ends a request counted by acquire.
+  void release(const transfer_sample &s);
+
+  int limit() const;
+  // Receives {limit, max, running, history: [{time, limit, reason}, ...]}.
+  // time is in milliseconds since the Unix epoch.
+  void get_state(picojson::object &dest) const;
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  struct change
+  {
+    int64_t time;
+    int limit;
+    const char *reason;
+  };
+
+  const int max_;
+  mutable std::mutex mtx_;
+  std::condition_variable cv_;
+  int limit_;
+  int running_;
+  // smoothed latency of the successful requests
+  double latency_;
+  int samples_;
+  // the requests finished since the limit last changed or was confirmed
+  int round_done_;
+  uint64_t round_bytes_;
+  clock::time_point round_start_;
+  double last_throughput_;
+  clock::time_point last_cut_;
+  std::deque<change> history_;
+
+  void set_limit(const int limit, const char *reason);
+  void cut(const double factor, const char *reason);
+};
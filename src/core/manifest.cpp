@@ -0,0 +1,139 @@
+#include "manifest.h"
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include "encoding.h"
+#include "hash.h"
+#include "picojson.h"
+
+namespace
+{
+  // A group is written after this delay, or earlier once this many bytes are waiting.
+  constexpr auto commit_interval = std::chrono::milliseconds(500);
+  constexpr size_t commit_bytes = 64 * 1024;
+}
+
+const WCHAR Manifest::filename[] = WIDE("cfs_manifest.jsonl");
+
+Manifest::Manifest() : pending_bytes_(0), stop_(false)
+{
+}
+
+Manifest::~Manifest()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  flush();
+}
+
+void Manifest::add(LPCWSTR filepath, const uint64_t size, const uint64_t hash)
+{
+  const wstr path = filepath;
+  const size_t sep = path.find_last_of(WIDE("\\/"));
+  const size_t name_pos = sep == wstr::npos ? 0 : sep + 1;
+
+  std::string name, hex;
+  if (report(to_u8(path.c_str() + name_pos, (int)(path.size() - name_pos), name), WIDE("failed to convert to UTF-8")))
+  {
+    return;
+  }
+  {
+    wstr h;
+    hash_to_hex(hash, h);
+    hex.assign(h.begin(), h.end());
+  }
+  local_time t;
+  get_local_time(t);
+  char time[32];
+  snprintf(time, sizeof(time), "%04d-%02d-%02dT%02d:%02d:%02d", t.year, t.month, t.day, t.hour, t.minute, t.second);
+
+  picojson::object o;
+  o["file"].set<std::string>(name);
+  o["size"] = picojson::value((double)size);
+  o["time"].set<std::string>(time);
+  o["xxh64"].set<std::string>(hex);
+  std::string line = picojson::value(o).serialize();
+  line += '\n';
+
+  bool full = false;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    pending_[path.substr(0, name_pos) + filename] += line;
+    pending_bytes_ += line.size();
+    full = pending_bytes_ >= commit_bytes;
+    if (!thread_.joinable() && !stop_)
+    {
+      thread_ = std::thread(&Manifest::run, this);
+    }
+  }
+  if (full)
+  {
+    cv_.notify_all();
+  }
+}
+
+HRESULT Manifest::flush()
+{
+  std::map<wstr, std::string> group;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    group.swap(pending_);
+    pending_bytes_ = 0;
+  }
+  return write(group);
+}
+
+void Manifest::run()
+{
+  std::unique_lock<std::mutex> lock(mtx_);
+  while (!stop_)
+  {
+    cv_.wait_for(lock, commit_interval, [this]()
+                 { return stop_ || pending_bytes_ >= commit_bytes; });
+    if (pending_.empty())
+    {
+      continue;
+    }
+    std::map<wstr, std::string> group;
+    group.swap(pending_);
+    pending_bytes_ = 0;
+    lock.unlock();
+    report(write(group), WIDE("failed to write the manifest"));
+    lock.lock();
+  }
+}
+
+HRESULT Manifest::write(std::map<wstr, std::string> &group)
+{
+  std::lock_guard<std::mutex> lock(write_mtx_);
+  HRESULT result = S_OK;
+  for (const auto &g : group)
+  {
+    file_t file = INVALID_FILE_HANDLE;
+    uint64_t size = 0;
+    HRESULT hr = file_append(g.first.c_str(), file, size);
+    if (SUCCEEDED(hr))
+    {
+      hr = file_write(file, g.second.data(), g.second.size());
+      const HRESULT closed = file_close(file);
+      if (SUCCEEDED(hr))
+      {
+        hr = closed;
+      }
+    }
+    if (FAILED(hr))
+    {
+      result = hr;
+    }
+  }
+  return result;
+}
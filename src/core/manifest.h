@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "platform.h"
+
+// Records what was saved where in a JSON-lines file in each export folder, one line per file:
+// {"file":"name.wav","size":123,"time":"2024-01-02T03:04:05","xxh64":"0123456789abcdef"}
+// Lines are buffered and appended by a background thread in groups, so adding one only
+// costs a queue insertion.
+class Manifest
+{
+public:
+  Manifest();
+  ~Manifest();
+
+  // Queues the record of filepath. It goes to the manifest in the folder of filepath.
+  void add(LPCWSTR filepath, const uint64_t size, const uint64_t hash);
+  // Writes everything queued so far and waits for it.
+  HRESULT flush();
+
+  static const WCHAR filename[];
+
+private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  // lines waiting to be written, keyed by the manifest path
+  std::map<wstr, std::string> pending_;
+  size_t pending_bytes_;
+  bool stop_;
+  std::thread thread_;
+  // held while writing so that groups reach each file in order
+  std::mutex write_mtx_;
+
+  void run();
+  HRESULT write(std::map<wstr, std::string> &group);
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#define WIDE(s) L##s
+
+typedef HANDLE file_t;
+#define INVALID_FILE_HANDLE INVALID_HANDLE_VALUE
+
+#else
+
+// Minimal subset of the Win32 vocabulary so that the portable code can keep
+// using HRESULT based error handling and UTF-16 strings on POSIX systems.
+typedef int32_t HRESULT;
+typedef char16_t WCHAR;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *LPCWSTR;
+typedef char *LPSTR;
+typedef const char *LPCSTR;
+
+#define WIDE(s) u##s
+
+#define S_OK ((HRESULT)0)
+#define S_FALSE ((HRESULT)1)
+#define E_NOTIMPL ((HRESULT)0x80004001)
+#define E_ABORT ((HRESULT)0x80004004)
+#define E_FAIL ((HRESULT)0x80004005)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000E)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define HRESULT_FROM_WIN32(x) ((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : ((HRESULT)(((x)&0x0000FFFF) | (7 << 16) | 0x80000000)))
+
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_INVALID_DATA 13L
+#define ERROR_HANDLE_EOF 38L
+#define ERROR_BUSY 170L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_NO_UNICODE_TRANSLATION 1113L
+#define ERROR_CANCELLED 1223L
+#define ERROR_TIMEOUT 1460L
+
+typedef int file_t;
+#define INVALID_FILE_HANDLE (-1)
+
+#endif
+
+// UTF-16 string. This is std::wstring on Windows.
+typedef std::basic_string<WCHAR> wstr;
+
+struct local_time
+{
+  int year;
+  int month;
+  int day;
+  int hour;
+  int minute;
+  int second;
+};
+
+// Writes the message and the description of hr to the debug output.
+// Returns true if hr is a failure code.
+bool report(HRESULT hr, LPCWSTR message);
+
+// Returns HRESULT for GetLastError() on Windows and errno on POSIX.
+HRESULT last_error();
+
+void get_local_time(local_time &dest);
+
+HRESULT file_create(LPCWSTR filepath, file_t &dest);
+HRESULT file_open(LPCWSTR filepath, file_t &dest);
+// Opens filepath for writing after its current content, creating it if needed.
+// size receives the length of the existing content.
+HRESULT file_append(LPCWSTR filepath, file_t &dest, uint64_t &size);
+HRESULT file_read(file_t file, void *p, size_t bytes, size_t &read);
+HRESULT file_write(file_t file, const void *p, size_t bytes);
+// Reserves disk space for bytes more bytes after the end of file without changing its size,
+// so that the file can be laid out contiguously. File systems without support return an error,
+// which callers may ignore.
+HRESULT file_reserve(file_t file, uint64_t bytes);
+// Waits until everything written to file has reached the disk.
+HRESULT file_flush(file_t file);
+HRESULT file_close(file_t file);
+HRESULT file_delete(LPCWSTR filepath);
+// Renames src to dest, replacing dest. The rename is atomic when both are on the same volume;
+// otherwise the file is copied and src is deleted.
+HRESULT file_move(LPCWSTR src, LPCWSTR dest);
+// Copies src to dest, replacing dest.
+HRESULT file_copy(LPCWSTR src, LPCWSTR dest);
+HRESULT file_get_size(LPCWSTR filepath, uint64_t &size);
+// Creates the directory dirpath. Succeeds if it already exists.
+HRESULT dir_create(LPCWSTR dirpath);
+// Creates the directory dirpath hidden from file managers, which on POSIX takes a name starting
+// with a dot. Succeeds if it already exists.
+HRESULT dir_create_hidden(LPCWSTR dirpath);
+// Deletes the files in dirpath, which ends with a separator, whose names start with prefix and
+// that were last written more than seconds ago.
+HRESULT dir_sweep(LPCWSTR dirpath, LPCWSTR prefix, uint64_t seconds);
+// dest receives the directory for temporary files with a trailing separator.
+HRESULT get_temp_dir(wstr &dest);
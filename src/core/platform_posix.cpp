@@ -0,0 +1,356 @@
+#include "platform.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "encoding.h"
+
+static HRESULT to_path(LPCWSTR filepath, std::string &dest)
+{
+  return to_u8(filepath, -1, dest);
+}
+
+bool report(HRESULT hr, LPCWSTR message)
+{
+  if (SUCCEEDED(hr))
+  {
+    return false;
+  }
+  std::string m;
+  to_u8(message, -1, m);
+  fprintf(stderr, "%s: 0x%08x\n", m.c_str(), (unsigned int)hr);
+  return true;
+}
+
+HRESULT last_error()
+{
+  return HRESULT_FROM_WIN32(errno);
+}
+
+void get_local_time(local_time &dest)
+{
+  const time_t t = time(nullptr);
+  struct tm tm = {};
+  localtime_r(&t, &tm);
+  dest.year = tm.tm_year + 1900;
+  dest.month = tm.tm_mon + 1;
+  dest.day = tm.tm_mday;
+  dest.hour = tm.tm_hour;
+  dest.minute = tm.tm_min;
+  dest.second = tm.tm_sec;
+}
+
+HRESULT file_create(LPCWSTR filepath, file_t &dest)
+{
+  std::string path;
+  HRESULT hr = to_path(filepath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  dest = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (dest == -1)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_open(LPCWSTR filepath, file_t &dest)
+{
+  std::string path;
+  HRESULT hr = to_path(filepath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  dest = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (dest == -1)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_append(LPCWSTR filepath, file_t &dest, uint64_t &size)
+{
+  std::string path;
+  HRESULT hr = to_path(filepath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  dest = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (dest == -1)
+  {
+    return last_error();
+  }
+  const off_t pos = lseek(dest, 0, SEEK_END);
+  if (pos == -1)
+  {
+    hr = last_error();
+    close(dest);
+    dest = -1;
+    return hr;
+  }
+  size = (uint64_t)pos;
+  return S_OK;
+}
+
+HRESULT file_read(file_t file, void *p, size_t bytes, size_t &read)
+{
+  for (;;)
+  {
+    const ssize_t r = ::read(file, p, bytes);
+    if (r == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      read = 0;
+      return last_error();
+    }
+    read = (size_t)r;
+    return S_OK;
+  }
+}
+
+HRESULT file_write(file_t file, const void *p, size_t bytes)
+{
+  const uint8_t *s = (const uint8_t *)p;
+  size_t pos = 0;
+  while (pos < bytes)
+  {
+    const ssize_t written = ::write(file, &s[pos], bytes - pos);
+    if (written == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return last_error();
+    }
+    pos += (size_t)written;
+  }
+  return S_OK;
+}
+
+HRESULT file_reserve(file_t file, uint64_t bytes)
+{
+#ifdef __linux__
+  struct stat st = {};
+  if (fstat(file, &st) == -1)
+  {
+    return last_error();
+  }
+  if (fallocate(file, FALLOC_FL_KEEP_SIZE, st.st_size, (off_t)bytes) == -1)
+  {
+    return last_error();
+  }
+  return S_OK;
+#else
+  (void)file;
+  (void)bytes;
+  return E_NOTIMPL;
+#endif
+}
+
+HRESULT file_flush(file_t file)
+{
+  if (fsync(file) == -1)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_close(file_t file)
+{
+  if (close(file) == -1)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_delete(LPCWSTR filepath)
+{
+  std::string path;
+  HRESULT hr = to_path(filepath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (unlink(path.c_str()) == -1)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_copy(LPCWSTR src, LPCWSTR dest)
+{
+  file_t in = INVALID_FILE_HANDLE, out = INVALID_FILE_HANDLE;
+  HRESULT hr = file_open(src, in);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  hr = file_create(dest, out);
+  if (FAILED(hr))
+  {
+    file_close(in);
+    return hr;
+  }
+  uint8_t buf[64 * 1024];
+  for (;;)
+  {
+    size_t read = 0;
+    hr = file_read(in, buf, sizeof(buf), read);
+    if (FAILED(hr) || read == 0)
+    {
+      break;
+    }
+    hr = file_write(out, buf, read);
+    if (FAILED(hr))
+    {
+      break;
+    }
+  }
+  file_close(in);
+  const HRESULT closed = file_close(out);
+  if (SUCCEEDED(hr))
+  {
+    hr = closed;
+  }
+  if (FAILED(hr))
+  {
+    file_delete(dest);
+  }
+  return hr;
+}
+
+HRESULT file_move(LPCWSTR src, LPCWSTR dest)
+{
+  std::string from, to;
+  HRESULT hr = to_path(src, from);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  hr = to_path(dest, to);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (rename(from.c_str(), to.c_str()) == 0)
+  {
+    return S_OK;
+  }
+  if (errno != EXDEV)
+  {
+    return last_error();
+  }
+  hr = file_copy(src, dest);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  return file_delete(src);
+}
+
+HRESULT file_get_size(LPCWSTR filepath, uint64_t &size)
+{
+  std::string path;
+  HRESULT hr = to_path(filepath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  struct stat st = {};
+  if (stat(path.c_str(), &st) == -1)
+  {
+    return last_error();
+  }
+  size = (uint64_t)st.st_size;
+  return S_OK;
+}
+
+HRESULT dir_create(LPCWSTR dirpath)
+{
+  std::string path;
+  HRESULT hr = to_path(dirpath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT dir_create_hidden(LPCWSTR dirpath)
+{
+  return dir_create(dirpath);
+}
+
+HRESULT dir_sweep(LPCWSTR dirpath, LPCWSTR prefix, uint64_t seconds)
+{
+  std::string path, start;
+  HRESULT hr = to_path(dirpath, path);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  hr = to_path(prefix, start);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  DIR *d = opendir(path.c_str());
+  if (!d)
+  {
+    return errno == ENOENT ? S_OK : last_error();
+  }
+  const time_t now = time(nullptr);
+  while (const dirent *e = readdir(d))
+  {
+    if (strncmp(e->d_name, start.c_str(), start.size()) != 0)
+    {
+      continue;
+    }
+    const std::string name = path + e->d_name;
+    struct stat st = {};
+    if (stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_mtime + seconds < (uint64_t)now)
+    {
+      unlink(name.c_str());
+    }
+  }
+  closedir(d);
+  return S_OK;
+}
+
+HRESULT get_temp_dir(wstr &dest)
+{
+  const char *dir = getenv("TMPDIR");
+  HRESULT hr = to_u16(dir && *dir ? dir : "/tmp", -1, dest);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (dest.back() != WIDE('/'))
+  {
+    dest += WIDE('/');
+  }
+  return S_OK;
+}
@@ -0,0 +1,260 @@
+#include "platform.h"
+
+bool report(HRESULT hr, LPCWSTR message)
+{
+  if (SUCCEEDED(hr))
+  {
+    return false;
+  }
+  std::wstring m(message);
+  m += L": ";
+  {
+    LPWSTR t = NULL;
+    FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER |
+            FORMAT_MESSAGE_FROM_SYSTEM,
+        NULL,
+        hr,
+        LANG_USER_DEFAULT,
+        (LPWSTR)&t,
+        0,
+        NULL);
+    if (t)
+    {
+      m += t;
+      LocalFree(t);
+    }
+  }
+  m += L"\n";
+  OutputDebugStringW(m.c_str());
+  return true;
+}
+
+HRESULT last_error()
+{
+  return HRESULT_FROM_WIN32(GetLastError());
+}
+
+void get_local_time(local_time &dest)
+{
+  SYSTEMTIME st = {};
+  GetLocalTime(&st);
+  dest.year = st.wYear;
+  dest.month = st.wMonth;
+  dest.day = st.wDay;
+  dest.hour = st.wHour;
+  dest.minute = st.wMinute;
+  dest.second = st.wSecond;
+}
+
+HRESULT file_create(LPCWSTR filepath, file_t &dest)
+{
+  dest = CreateFileW(filepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (dest == INVALID_HANDLE_VALUE)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_open(LPCWSTR filepath, file_t &dest)
+{
+  dest = CreateFileW(filepath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (dest == INVALID_HANDLE_VALUE)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_append(LPCWSTR filepath, file_t &dest, uint64_t &size)
+{
+  dest = CreateFileW(filepath, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (dest == INVALID_HANDLE_VALUE)
+  {
+    return last_error();
+  }
+  LARGE_INTEGER pos = {};
+  if (!SetFilePointerEx(dest, pos, &pos, FILE_END))
+  {
+    const HRESULT hr = last_error();
+    CloseHandle(dest);
+    dest = INVALID_HANDLE_VALUE;
+    return hr;
+  }
+  size = (uint64_t)pos.QuadPart;
+  return S_OK;
+}
+
+HRESULT file_read(file_t file, void *p, size_t bytes, size_t &read)
+{
+  DWORD r = 0;
+  if (!ReadFile(file, p, bytes > 0x40000000 ? 0x40000000 : (DWORD)bytes, &r, NULL))
+  {
+    read = 0;
+    return last_error();
+  }
+  read = r;
+  return S_OK;
+}
+
+HRESULT file_write(file_t file, const void *p, size_t bytes)
+{
+  const uint8_t *s = (const uint8_t *)p;
+  size_t pos = 0;
+  while (pos < bytes)
+  {
+    const size_t n = bytes - pos;
+    DWORD written = 0;
+    if (!WriteFile(file, &s[pos], n > 0x40000000 ? 0x40000000 : (DWORD)n, &written, nullptr))
+    {
+      return last_error();
+    }
+    pos += written;
+  }
+  return S_OK;
+}
+
+HRESULT file_reserve(file_t file, uint64_t bytes)
+{
+  LARGE_INTEGER size = {};
+  if (!GetFileSizeEx(file, &size))
+  {
+    return last_error();
+  }
+  FILE_ALLOCATION_INFO info = {};
+  info.AllocationSize.QuadPart = size.QuadPart + (LONGLONG)bytes;
+  if (!SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info)))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_flush(file_t file)
+{
+  if (!FlushFileBuffers(file))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_close(file_t file)
+{
+  if (!CloseHandle(file))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_delete(LPCWSTR filepath)
+{
+  if (!DeleteFileW(filepath))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_move(LPCWSTR src, LPCWSTR dest)
+{
+  if (!MoveFileExW(src, dest, MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED | MOVEFILE_WRITE_THROUGH))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_copy(LPCWSTR src, LPCWSTR dest)
+{
+  if (!CopyFileW(src, dest, FALSE))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT file_get_size(LPCWSTR filepath, uint64_t &size)
+{
+  WIN32_FILE_ATTRIBUTE_DATA data = {};
+  if (!GetFileAttributesExW(filepath, GetFileExInfoStandard, &data))
+  {
+    return last_error();
+  }
+  size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  return S_OK;
+}
+
+HRESULT dir_create(LPCWSTR dirpath)
+{
+  if (!CreateDirectoryW(dirpath, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT dir_create_hidden(LPCWSTR dirpath)
+{
+  const HRESULT hr = dir_create(dirpath);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  const DWORD attrs = GetFileAttributesW(dirpath);
+  if (attrs == INVALID_FILE_ATTRIBUTES)
+  {
+    return last_error();
+  }
+  if (!(attrs & FILE_ATTRIBUTE_HIDDEN) && !SetFileAttributesW(dirpath, attrs | FILE_ATTRIBUTE_HIDDEN))
+  {
+    return last_error();
+  }
+  return S_OK;
+}
+
+HRESULT dir_sweep(LPCWSTR dirpath, LPCWSTR prefix, uint64_t seconds)
+{
+  const wstr pattern = wstr(dirpath) + prefix + L"*";
+  WIN32_FIND_DATAW fd = {};
+  HANDLE h = FindFirstFileW(pattern.c_str(), &fd);
+  if (h == INVALID_HANDLE_VALUE)
+  {
+    const DWORD err = GetLastError();
+    return err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND ? S_OK : HRESULT_FROM_WIN32(err);
+  }
+  FILETIME now_ft;
+  GetSystemTimeAsFileTime(&now_ft);
+  const uint64_t now = ((uint64_t)now_ft.dwHighDateTime << 32) | now_ft.dwLowDateTime;
+  // FILETIME counts 100 ns
+  const uint64_t age = seconds * 10000000;
+  do
+  {
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+      continue;
+    }
+    const uint64_t t = ((uint64_t)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime;
+    if (t + age < now)
+    {
+      // a file still open elsewhere cannot be deleted and is left alone
+      DeleteFileW((wstr(dirpath) + fd.cFileName).c_str());
+    }
+  } while (FindNextFileW(h, &fd));
+  FindClose(h);
+  return S_OK;
+}
+
+HRESULT get_temp_dir(wstr &dest)
+{
+  WCHAR buf[MAX_PATH + 1];
+  const DWORD n = GetTempPathW(MAX_PATH + 1, buf);
+  if (n == 0 || n > MAX_PATH)
+  {
+    return last_error();
+  }
+  dest.assign(buf, n);
+  return S_OK;
+}
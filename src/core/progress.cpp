@@ -0,0 +1,151 @@
+#include "progress.h"
+
+Progress::Progress(const int per_second, sink fn)
+    : interval_(1000 / (per_second > 0 ? per_second : 1)), fn_(std::move(fn)), changed_(false), stopping_(false)
+{
+}
+
+Progress::~Progress()
+{
+  stop();
+}
+
+void Progress::start(const std::string &job_id, const uint64_t count)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (stopping_)
+  {
+    return;
+  }
+  entry &e = jobs_[job_id];
+  e = {};
+  e.count = count;
+  e.reported_at = std::chrono::steady_clock::now();
+  // the reporting thread is started on demand so that an idle instance costs nothing
+  if (!thread_.joinable())
+  {
+    thread_ = std::thread(&Progress::run, this);
+  }
+}
+
+void Progress::add(const std::string &job_id, const int64_t bytes, const int64_t total)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto it = jobs_.find(job_id);
+    if (it == jobs_.end())
+    {
+      return;
+    }
+    entry &e = it->second;
+    e.bytes += (uint64_t)bytes;
+    e.total += (uint64_t)total;
+    if (bytes < 0)
+    {
+      e.reported_bytes = e.bytes < e.reported_bytes ? e.bytes : e.reported_bytes;
+    }
+    e.changed = true;
+    if (changed_)
+    {
+      return;
+    }
+    changed_ = true;
+  }
+  cv_.notify_all();
+}
+
+void Progress::file_done(const std::string &job_id)
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto it = jobs_.find(job_id);
+    if (it == jobs_.end())
+    {
+      return;
+    }
+    ++it->second.done;
+    it->second.changed = true;
+    changed_ = true;
+  }
+  cv_.notify_all();
+}
+
+void Progress::finish(const std::string &job_id)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  jobs_.erase(job_id);
+}
+
+void Progress::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stopping_ = true;
+    jobs_.clear();
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+}
+
+void Progress::run()
+{
+  std::unique_lock<std::mutex> lock(mtx_);
+  auto last = std::chrono::steady_clock::now() - interval_;
+  for (;;)
+  {
+    cv_.wait(lock, [this]()
+             { return changed_ || stopping_; });
+    if (stopping_)
+    {
+      break;
+    }
+    // whatever changes during the rest of the interval goes into the same report
+    const auto next = last + interval_;
+    if (cv_.wait_until(lock, next, [this]()
+                       { return stopping_; }))
+    {
+      break;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    last = now;
+    changed_ = false;
+    picojson::array jobs;
+    for (auto &j : jobs_)
+    {
+      entry &e = j.second;
+      if (!e.changed)
+      {
+        continue;
+      }
+      e.changed = false;
+      const double seconds = std::chrono::duration<double>(now - e.reported_at).count();
+      if (seconds > 0)
+      {
+        // smoothed so that the figure does not jump with every report
+        const double r = (double)(e.bytes - e.reported_bytes) / seconds;
+        e.rate = e.rate > 0 ? e.rate * 0.5 + r * 0.5 : r;
+      }
+      e.reported_bytes = e.bytes;
+      e.reported_at = now;
+      picojson::object o;
+      o["jobId"].set<std::string>(j.first);
+      o["bytes"] = picojson::value((double)e.bytes);
+      o["total"] = picojson::value((double)e.total);
+      o["rate"] = picojson::value(e.rate);
+      o["done"] = picojson::value((double)e.done);
+      o["count"] = picojson::value((double)e.count);
+      jobs.push_back(picojson::value(o));
+    }
+    if (jobs.empty())
+    {
+      continue;
+    }
+    // the sink may post to another thread, which must not wait for this lock
+    lock.unlock();
+    fn_(jobs);
+    lock.lock();
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "platform.h"
+#include "picojson.h"
+
+// Collects the progress of running jobs and reports it at most a fixed number of times
+// per second, with every job that has moved since the last report in one batch, so that
+// a fast transfer cannot flood the UI thread.
+class Progress
+{
+public:
+  // Receives [{jobId, bytes, total, rate, done, count}, ...]. total is 0 if unknown and
+  // rate is in bytes per second. done and count are the numbers of finished and all files.
+  typedef std::function<void(const picojson::array &jobs)> sink;
+
+  Progress(const int per_second, sink fn);
+  ~Progress();
+
+  void start(const std::string &job_id, const uint64_t count);
+  // Adds to the bytes received and the bytes expected. A negative bytes means a transfer started over.
+  void add(const std::string &job_id, const int64_t bytes, const int64_t total);
+  void file_done(const std::string &job_id);
+  // Forgets the job. Nothing is reported for it afterwards.
+  void finish(const std::string &job_id);
+
+  // Stops reporting. Called before the sink becomes invalid.
+  void stop();
+
+private:
+  struct entry
+  {
+    uint64_t bytes;
+    uint64_t total;
+    uint64_t done;
+    uint64_t count;
+    bool changed;
+    uint64_t reported_bytes;
+    std::chrono::steady_clock::time_point reported_at;
+    double rate;
+  };
+
+  const std::chrono::milliseconds interval_;
+  sink fn_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::map<std::string, entry> jobs_;
+  bool changed_;
+  bool stopping_;
+  std::thread thread_;
+
+  void run();
+};
@@ -0,0 +1,145 @@
+#include "scheduler.h"
+
+Scheduler::Scheduler(size_t workers, size_t capacity)
+    : workers_(workers), batch_workers_(workers > 1 ? workers - 1 : 1), capacity_(capacity), running_batch_(0), stopping_(false)
+{
+}
+
+Scheduler::~Scheduler()
+{
+  shutdown();
+}
+
+HRESULT Scheduler::submit(const std::string &id, job fn, const int priority)
+{
+  if (priority != PRIORITY_INTERACTIVE && priority != PRIORITY_BATCH)
+  {
+    return E_INVALIDARG;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (stopping_)
+    {
+      return E_ABORT;
+    }
+    if (!id.empty() && jobs_.find(id) != jobs_.end())
+    {
+      return E_INVALIDARG;
+    }
+    std::deque<entry> &queue = queues_[priority];
+    if (queue.size() >= capacity_)
+    {
+      return HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    if (!id.empty())
+    {
+      jobs_[id] = cancelled;
+    }
+    queue.push_back({id, std::move(fn), cancelled});
+    // threads are started on demand so that an idle scheduler costs nothing
+    if (threads_.size() < workers_)
+    {
+      threads_.emplace_back(&Scheduler::run, this);
+    }
+  }
+  cv_.notify_one();
+  return S_OK;
+}
+
+bool Scheduler::cancel(const std::string &id)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  bool found = false;
+  const auto it = jobs_.find(id);
+  if (it != jobs_.end())
+  {
+    it->second->store(true);
+    found = true;
+  }
+  const std::string prefix = id + "/";
+  for (auto i = jobs_.lower_bound(prefix); i != jobs_.end() && i->first.compare(0, prefix.size(), prefix) == 0; ++i)
+  {
+    i->second->store(true);
+    found = true;
+  }
+  return found;
+}
+
+void Scheduler::shutdown()
+{
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stopping_ = true;
+    for (const std::deque<entry> &queue : queues_)
+    {
+      for (const entry &e : queue)
+      {
+        e.cancelled->store(true);
+      }
+    }
+    for (const auto &j : jobs_)
+    {
+      j.second->store(true);
+    }
+    threads.swap(threads_);
+  }
+  cv_.notify_all();
+  for (std::thread &t : threads)
+  {
+    t.join();
+  }
+}
+
+std::deque<Scheduler::entry> *Scheduler::next_queue()
+{
+  if (!queues_[PRIORITY_INTERACTIVE].empty())
+  {
+    return &queues_[PRIORITY_INTERACTIVE];
+  }
+  if (!queues_[PRIORITY_BATCH].empty() && running_batch_ < batch_workers_)
+  {
+    return &queues_[PRIORITY_BATCH];
+  }
+  return nullptr;
+}
+
+void Scheduler::run()
+{
+  for (;;)
+  {
+    entry e;
+    bool batch = false;
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      std::deque<entry> *queue = nullptr;
+      // a batch job left behind at shutdown is started when a running one finishes
+      cv_.wait(lock, [this, &queue]()
+               { return (queue = next_queue()) != nullptr ||
+                        (stopping_ && queues_[PRIORITY_INTERACTIVE].empty() && queues_[PRIORITY_BATCH].empty()); });
+      if (!queue)
+      {
+        return;
+      }
+      batch = queue == &queues_[PRIORITY_BATCH];
+      running_batch_ += batch ? 1 : 0;
+      e = std::move(queue->front());
+      queue->pop_front();
+    }
+    e.fn(*e.cancelled);
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      if (!e.id.empty())
+      {
+        jobs_.erase(e.id);
+      }
+      running_batch_ -= batch ? 1 : 0;
+    }
+    if (batch)
+    {
+      // another worker may be waiting for the batch slot
+      cv_.notify_one();
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "platform.h"
+
+enum
+{
+  // Started by a click, someone is waiting for it.
+  PRIORITY_INTERACTIVE = 0,
+  // Part of a batch running in the background.
+  PRIORITY_BATCH = 1,
+};
+
+// Runs jobs on a fixed number of worker threads.
+// Jobs wait in a queue of limited size and can be cancelled by id.
+// Interactive jobs are always taken before batch jobs, and batch jobs never occupy
+// the last worker, so a click does not wait behind a running batch.
+class Scheduler
+{
+public:
+  // cancelled becomes true when the job is cancelled or the scheduler shuts down.
+  // A job cancelled while queued still runs, so that it can report the cancellation.
+  typedef std::function<void(const std::atomic<bool> &cancelled)> job;
+
+  Scheduler(size_t workers, size_t capacity);
+  ~Scheduler();
+
+  // Queues fn. id is used by cancel and may be empty.
+  // Each priority has its own queue, so a full batch queue does not turn away interactive jobs.
+  // Returns HRESULT_FROM_WIN32(ERROR_BUSY) if the queue is full, E_INVALIDARG if id is in use
+  // and E_ABORT after shutdown.
+  HRESULT submit(const std::string &id, job fn, const int priority = PRIORITY_INTERACTIVE);
+
+  // Cancels the job with id and the jobs whose ids start with id + "/", which is how
+  // the jobs of a batch are named. Returns false if there is no such job.
+  bool cancel(const std::string &id);
+
+  // Cancels all jobs and waits for the workers to finish.
+  void shutdown();
+
+private:
+  struct entry
+  {
+    std::string id;
+    job fn;
+    std::shared_ptr<std::atomic<bool>> cancelled;
+  };
+
+  const size_t workers_;
+  const size_t batch_workers_;
+  const size_t capacity_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<entry> queues_[2];
+  size_t running_batch_;
+  std::map<std::string, std::shared_ptr<std::atomic<bool>>> jobs_;
+  std::vector<std::thread> threads_;
+  bool stopping_;
+
+  // Returns the queue to take the next job from, or nullptr if no job can be started.
+  std::deque<entry> *next_queue();
+  void run();
+};
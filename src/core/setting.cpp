@@ -0,0 +1,267 @@
+#include "setting.h"
+
+#include "encoding.h"
+
+HRESULT load_json(LPCWSTR filepath, picojson::value &dest)
+{
+  file_t file = INVALID_FILE_HANDLE;
+  HRESULT hr = file_open(filepath, file);
+  if (FAILED(hr))
+  {
+    dest = picojson::value();
+    return hr;
+  }
+  std::string s;
+  {
+    char buf[4096] = {};
+    size_t read = 0;
+    do
+    {
+      hr = file_read(file, buf, 4096, read);
+      if (FAILED(hr))
+      {
+        file_close(file);
+        dest = picojson::value();
+        return hr;
+      }
+      if (read > 0)
+      {
+        s.append(buf, read);
+      }
+    } while (read > 0);
+  }
+  file_close(file);
+
+  const std::string err = picojson::parse(dest, s);
+  if (!err.empty())
+  {
+    return E_FAIL;
+  }
+  return S_OK;
+}
+
+HRESULT save_json(LPCWSTR filepath, const picojson::value src)
+{
+  // write a sibling file and rename it over the old one so that the file is never left half written
+  wstr temp = filepath;
+  temp += WIDE(".tmp");
+  file_t file = INVALID_FILE_HANDLE;
+  HRESULT hr = file_create(temp.c_str(), file);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  std::string s = src.serialize();
+  hr = file_write(file, &s[0], s.size());
+  if (SUCCEEDED(hr))
+  {
+    hr = file_flush(file);
+  }
+  if (FAILED(hr))
+  {
+    file_close(file);
+    file_delete(temp.c_str());
+    return hr;
+  }
+  hr = file_close(file);
+  if (SUCCEEDED(hr))
+  {
+    hr = file_move(temp.c_str(), filepath);
+  }
+  if (FAILED(hr))
+  {
+    file_delete(temp.c_str());
+  }
+  return hr;
+}
+
+void default_setting(setting &dest)
+{
+  dest.text_encoding = ENCODING_UTF8BOM;
+  dest.filename_pattern.clear();
+  dest.download_concurrency = 0;
+  dest.connect_timeout = 15000;
+  dest.receive_timeout = 30000;
+  dest.download_retries = 3;
+  dest.cache_size = 512;
+  dest.write_manifest = true;
+  dest.max_bytes_per_second = 0;
+}
+
+HRESULT load_setting(LPCWSTR filepath, setting &dest)
+{
+  default_setting(dest);
+
+  picojson::value v;
+  HRESULT hr = load_json(filepath, v);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (!v.is<picojson::object>())
+  {
+    return E_FAIL;
+  }
+  const picojson::object &obj = v.get<picojson::object>();
+  {
+    const auto it = obj.find("textEncoding");
+    if (it != obj.end())
+    {
+      const auto e = it->second.to_str();
+      if (e == "utf8")
+      {
+        dest.text_encoding = ENCODING_UTF8;
+      }
+      else if (e == "utf8bom")
+      {
+        dest.text_encoding = ENCODING_UTF8BOM;
+      }
+      else if (e == "utf16le")
+      {
+        dest.text_encoding = ENCODING_UTF16LE;
+      }
+      else if (e == "utf16lebom")
+      {
+        dest.text_encoding = ENCODING_UTF16LEBOM;
+      }
+      else if (e == "utf16be")
+      {
+        dest.text_encoding = ENCODING_UTF16BE;
+      }
+      else if (e == "utf16bebom")
+      {
+        dest.text_encoding = ENCODING_UTF16BEBOM;
+      }
+      else if (e == "sjis")
+      {
+        dest.text_encoding = ENCODING_SHIFTJIS;
+      }
+    }
+  }
+  {
+    const auto it = obj.find("filenameTemplate");
+    if (it != obj.end() && it->second.is<std::string>())
+    {
+      const std::string &e = it->second.get<std::string>();
+      hr = to_u16(e.data(), (int)e.size(), dest.filename_pattern);
+      if (FAILED(hr))
+      {
+        dest.filename_pattern.clear();
+      }
+    }
+  }
+  {
+    const auto it = obj.find("downloadConcurrency");
+    if (it != obj.end() && it->second.is<double>())
+    {
+      const double v = it->second.get<double>();
+      dest.download_concurrency = v < 0 ? 0 : v > 8 ? 8
+                                                    : (int)v;
+    }
+  }
+  {
+    const auto it = obj.find("connectTimeout");
+    if (it != obj.end() && it->second.is<double>())
+    {
+      const double v = it->second.get<double>();
+      dest.connect_timeout = v < 1000 ? 1000 : v > 300000 ? 300000
+                                                           : (int)v;
+    }
+  }
+  {
+    const auto it = obj.find("receiveTimeout");
+    if (it != obj.end() && it->second.is<double>())
+    {
+      const double v = it->second.get<double>();
+      dest.receive_timeout = v < 1000 ? 1000 : v > 300000 ? 300000
+                                                           : (int)v;
+    }
+  }
+  {
+    const auto it = obj.find("downloadRetries");
+    if (it != obj.end() && it->second.is<double>())
+    {
+      const double v = it->second.get<double>();
+      dest.download_retries = v < 0 ? 0 : v > 10 ? 10
+                                                 : (int)v;
+    }
+  }
+  {
+    const auto it = obj.find("cacheSize");
+    if (it != obj.end() && it->second.is<double>())
+    {
+      const double v = it->second.get<double>();
+      dest.cache_size = v < 0 ? 0 : v > 65536 ? 65536
+                                              : (int)v;
+    }
+  }
+  {
+    const auto it = obj.find("manifest");
+    if (it != obj.end() && it->second.is<bool>())
+    {
+      dest.write_manifest = it->second.get<bool>();
+    }
+  }
+  {
+    const auto it = obj.find("maxBytesPerSecond");
+    if (it != obj.end() && it->second.is<double>())
+    {
+      // anything below 16 KiB/s would starve the connections into timing out
+      const double v = it->second.get<double>();
+      dest.max_bytes_per_second = v <= 0 ? 0 : v < 16384 ? 16384 : v > 1073741824 ? 1073741824
+                                                                                    : (int)v;
+    }
+  }
+  return S_OK;
+}
+
+HRESULT save_setting(LPCWSTR filepath, const setting &dest)
+{
+  picojson::object obj;
+  std::string s;
+  switch (dest.text_encoding)
+  {
+  case ENCODING_UTF8:
+    s = "utf8";
+    break;
+  case ENCODING_UTF8BOM:
+    s = "utf8bom";
+    break;
+  case ENCODING_UTF16LE:
+    s = "utf16le";
+    break;
+  case ENCODING_UTF16LEBOM:
+    s = "utf16lebom";
+    break;
+  case ENCODING_UTF16BE:
+    s = "utf16be";
+    break;
+  case ENCODING_UTF16BEBOM:
+    s = "utf16bebom";
+    break;
+  case ENCODING_SHIFTJIS:
+    s = "sjis";
+    break;
+  default:
+    s = "utf8bom";
+    break;
+  }
+  obj["textEncoding"].set<std::string>(s);
+  if (!dest.filename_pattern.empty())
+  {
+    HRESULT hr = to_u8(dest.filename_pattern.c_str(), (int)dest.filename_pattern.size(), s);
+    if (FAILED(hr))
+    {
+      return hr;
+    }
+    obj["filenameTemplate"].set<std::string>(s);
+  }
+  obj["downloadConcurrency"] = picojson::value((double)dest.download_concurrency);
+  obj["connectTimeout"] = picojson::value((double)dest.connect_timeout);
+  obj["receiveTimeout"] = picojson::value((double)dest.receive_timeout);
+  obj["downloadRetries"] = picojson::value((double)dest.download_retries);
+  obj["cacheSize"] = picojson::value((double)dest.cache_size);
+  obj["manifest"] = picojson::value(dest.write_manifest);
+  obj["maxBytesPerSecond"] = picojson::value((double)dest.max_bytes_per_second);
+  return save_json(filepath, picojson::value(obj));
+}
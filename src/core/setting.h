@@ -0,0 +1,43 @@
+#pragma once
+
+#include "platform.h"
+#include "picojson.h"
+
+enum
+{
+  ENCODING_UTF8 = 0,
+  ENCODING_UTF8BOM = 1,
+  ENCODING_UTF16LE = 2,
+  ENCODING_UTF16LEBOM = 3,
+  ENCODING_UTF16BE = 4,
+  ENCODING_UTF16BEBOM = 5,
+  ENCODING_SHIFTJIS = 6,
+};
+
+struct setting
+{
+  int text_encoding;
+  // See compile_filename_template. Empty means default_filename_template.
+  wstr filename_pattern;
+  // Number of parallel downloads used by downloadAll. 0 adapts it to the server.
+  int download_concurrency;
+  // Network timeouts in milliseconds.
+  int connect_timeout;
+  int receive_timeout;
+  // Number of times an interrupted download is resumed before it fails.
+  int download_retries;
+  // Size limit of the audio cache in MiB. 0 disables the cache.
+  int cache_size;
+  // Whether a manifest of the saved files is kept in each folder.
+  bool write_manifest;
+  // Limit of the combined download rate in bytes per second. 0 means no limit.
+  int max_bytes_per_second;
+};
+
+void default_setting(setting &dest);
+
+HRESULT load_json(LPCWSTR filepath, picojson::value &dest);
+HRESULT save_json(LPCWSTR filepath, const picojson::value src);
+
+HRESULT load_setting(LPCWSTR filepath, setting &dest);
+HRESULT save_setting(LPCWSTR filepath, const setting &dest);
@@ -0,0 +1,40 @@
+#include "simd.h"
+
+#include <atomic>
+
+static std::atomic<int> current_level(-1);
+
+static int detect()
+{
+#ifdef CFS_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1"))
+  {
+    return SIMD_SSE41;
+  }
+#elif defined(CFS_SIMD_NEON)
+  return SIMD_NEON;
+#endif
+  return SIMD_NONE;
+}
+
+int simd_level()
+{
+  int level = current_level.load(std::memory_order_relaxed);
+  if (level < 0)
+  {
+    level = detect();
+    current_level.store(level, std::memory_order_relaxed);
+  }
+  return level;
+}
+
+void set_simd_level(int level)
+{
+  const int detected = detect();
+  current_level.store(level < detected ? level : detected, std::memory_order_relaxed);
+}
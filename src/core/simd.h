@@ -0,0 +1,27 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CFS_SIMD_X86 1
+#include <immintrin.h>
+#define CFS_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define CFS_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__ARM_NEON)
+#define CFS_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+enum
+{
+  SIMD_NONE = 0,
+  SIMD_SSE41 = 1,
+  SIMD_NEON = 1, // ARM uses the same level as SSE4.1
+  SIMD_AVX2 = 2,
+};
+
+// Returns the best instruction set that is supported by the CPU.
+// The result is cached, so this is cheap enough to be called per conversion.
+int simd_level();
+
+// Caps the instruction set used by the kernels. Used by the benchmark to compare
+// the scalar code with the vectorized code.
+void set_simd_level(int level);
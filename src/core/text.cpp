@@ -0,0 +1,191 @@
+#include "text.h"
+
+#include <bit>
+#include <type_traits>
+
+#include "encoding.h"
+#include "setting.h"
+
+namespace
+{
+  // Text is encoded into a buffer of this size and written chunk by chunk,
+  // so memory use does not depend on the length of the text.
+  constexpr size_t chunk_bytes = 64 * 1024;
+
+  // Encoders for write_encoded.
+  // encode converts at most max_units code units and returns the number of bytes written;
+  // consumed receives the number of code units converted, which is less than n only if
+  // the text cannot be represented in the encoding.
+  struct utf8_encoder
+  {
+    static constexpr size_t max_units = (chunk_bytes - 16) / 3;
+    static size_t encode(LPCWSTR src, const size_t n, uint8_t *dest, size_t &consumed)
+    {
+      consumed = n;
+      return u16_to_u8(src, n, (char *)dest);
+    }
+  };
+
+  struct sjis_encoder
+  {
+    static constexpr size_t max_units = (chunk_bytes - 16) / 2;
+    static size_t encode(LPCWSTR src, const size_t n, uint8_t *dest, size_t &consumed)
+    {
+      return u16_to_sjis(src, n, (char *)dest, consumed);
+    }
+  };
+
+  // UTF-16 in the byte order of this machine, written straight from the source.
+  struct utf16_native_encoder
+  {
+  };
+
+  struct utf16_swap_encoder
+  {
+    static constexpr size_t max_units = chunk_bytes / 2;
+    static size_t encode(LPCWSTR src, const size_t n, uint8_t *dest, size_t &consumed)
+    {
+      u16_swap(src, n, (WCHAR *)dest);
+      consumed = n;
+      return n * 2;
+    }
+  };
+
+  constexpr bool big_endian = std::endian::native == std::endian::big;
+  using utf16le_encoder = std::conditional_t<big_endian, utf16_swap_encoder, utf16_native_encoder>;
+  using utf16be_encoder = std::conditional_t<big_endian, utf16_native_encoder, utf16_swap_encoder>;
+}
+
+// Writes bytes to file and feeds them to hasher.
+static HRESULT write_hashed(file_t file, const void *p, const size_t bytes, Hasher &hasher)
+{
+  const HRESULT hr = file_write(file, p, bytes);
+  if (SUCCEEDED(hr))
+  {
+    hasher.update(p, bytes);
+  }
+  return hr;
+}
+
+template <class Encoder>
+static HRESULT write_encoded(file_t file, LPCWSTR text, const size_t n, Hasher &hasher)
+{
+  alignas(16) uint8_t buf[chunk_bytes];
+  size_t pos = 0;
+  while (pos < n)
+  {
+    size_t units = n - pos < Encoder::max_units ? n - pos : Encoder::max_units;
+    if (pos + units < n && text[pos + units - 1] >= 0xd800 && text[pos + units - 1] <= 0xdbff)
+    {
+      // do not split a surrogate pair between chunks
+      --units;
+    }
+    size_t consumed = 0;
+    const size_t bytes = Encoder::encode(text + pos, units, buf, consumed);
+    if (bytes > 0)
+    {
+      const HRESULT hr = write_hashed(file, buf, bytes, hasher);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+    }
+    if (consumed < units)
+    {
+      return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+    }
+    pos += units;
+  }
+  return S_OK;
+}
+
+template <>
+HRESULT write_encoded<utf16_native_encoder>(file_t file, LPCWSTR text, const size_t n, Hasher &hasher)
+{
+  return n > 0 ? write_hashed(file, text, n * sizeof(WCHAR), hasher) : S_OK;
+}
+
+HRESULT write_text(LPCWSTR filepath, LPCWSTR text, int text_encoding, Hasher *hasher)
+{
+  Hasher unused;
+  Hasher &h = hasher ? *hasher : unused;
+
+  const uint8_t bom_utf8[3] = {0xef, 0xbb, 0xbf};
+  const uint8_t bom_utf16le[2] = {0xff, 0xfe};
+  const uint8_t bom_utf16be[2] = {0xfe, 0xff};
+
+  file_t file = INVALID_FILE_HANDLE;
+  HRESULT hr = file_create(filepath, file);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+
+  const size_t n = std::char_traits<WCHAR>::length(text);
+  HRESULT result = S_OK;
+  switch (text_encoding)
+  {
+  case ENCODING_UTF8:
+    hr = write_encoded<utf8_encoder>(file, text, n, h);
+    break;
+  case ENCODING_UTF8BOM:
+    hr = write_hashed(file, bom_utf8, 3, h);
+    if (SUCCEEDED(hr))
+    {
+      hr = write_encoded<utf8_encoder>(file, text, n, h);
+    }
+    break;
+  case ENCODING_UTF16LE:
+  case ENCODING_UTF16LEBOM:
+    hr = text_encoding == ENCODING_UTF16LEBOM ? write_hashed(file, bom_utf16le, 2, h) : S_OK;
+    if (SUCCEEDED(hr))
+    {
+      hr = write_encoded<utf16le_encoder>(file, text, n, h);
+    }
+    break;
+  case ENCODING_UTF16BE:
+  case ENCODING_UTF16BEBOM:
+    hr = text_encoding == ENCODING_UTF16BEBOM ? write_hashed(file, bom_utf16be, 2, h) : S_OK;
+    if (SUCCEEDED(hr))
+    {
+      hr = write_encoded<utf16be_encoder>(file, text, n, h);
+    }
+    break;
+  case ENCODING_SHIFTJIS:
+    hr = write_encoded<sjis_encoder>(file, text, n, h);
+    if (hr == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION))
+    {
+      // fall back to UTF-8 rather than writing '?' for the characters Shift_JIS lacks
+      file_close(file);
+      hr = file_create(filepath, file);
+      if (FAILED(hr))
+      {
+        file_delete(filepath);
+        return hr;
+      }
+      h = Hasher();
+      hr = write_hashed(file, bom_utf8, 3, h);
+      if (SUCCEEDED(hr))
+      {
+        hr = write_encoded<utf8_encoder>(file, text, n, h);
+      }
+      result = S_FALSE;
+    }
+    break;
+  default:
+    hr = E_INVALIDARG;
+    break;
+  }
+  if (FAILED(hr))
+  {
+    file_close(file);
+    file_delete(filepath);
+    return hr;
+  }
+  hr = file_close(file);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  return result;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "hash.h"
+#include "platform.h"
+
+// Writes text to filepath in the encoding specified by text_encoding (ENCODING_*).
+// The file is deleted on failure.
+// If text cannot be represented in Shift_JIS, it is written as UTF-8 with BOM and S_FALSE is returned.
+// If given, hasher receives the bytes of the file as they are written.
+HRESULT write_text(LPCWSTR filepath, LPCWSTR text, int text_encoding, Hasher *hasher = nullptr);
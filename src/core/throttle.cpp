@@ -0,0 +1,58 @@
+#include "throttle.h"
+
+#include <algorithm>
+#include <thread>
+
+// The bucket holds this much of a second's worth, so short bursts are not delayed.
+static constexpr std::chrono::milliseconds burst(250);
+
+Throttle::Throttle() : rate_(0), full_at_()
+{
+}
+
+void Throttle::set_rate(const uint64_t bytes_per_second)
+{
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (rate_ != bytes_per_second)
+  {
+    rate_ = bytes_per_second;
+    full_at_ = clock::now();
+  }
+}
+
+HRESULT Throttle::consume(const uint64_t bytes, const bool interactive, const std::atomic<bool> *cancelled)
+{
+  clock::time_point until;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (rate_ == 0)
+    {
+      return S_OK;
+    }
+    const clock::time_point now = clock::now();
+    if (full_at_ < now)
+    {
+      full_at_ = now;
+    }
+    full_at_ += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((double)bytes / (double)rate_));
+    if (interactive)
+    {
+      return S_OK;
+    }
+    until = full_at_ - burst;
+  }
+  // the tokens are already taken, so later callers queue behind this one
+  for (;;)
+  {
+    if (cancelled && cancelled->load())
+    {
+      return E_ABORT;
+    }
+    const clock::time_point now = clock::now();
+    if (now >= until)
+    {
+      return S_OK;
+    }
+    std::this_thread::sleep_for(std::min<clock::duration>(until - now, std::chrono::milliseconds(100)));
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "platform.h"
+
+// Token bucket that caps the combined rate of the transfers sharing it.
+// Interactive transfers take what they receive without waiting, which leaves less for
+// the batch transfers. Batch transfers wait for their share in the order they asked,
+// so the jobs of a batch split what is left evenly.
+class Throttle
+{
+public:
+  Throttle();
+
+  // Sets the limit in bytes per second. 0 removes it.
+  void set_rate(const uint64_t bytes_per_second);
+
+  // Accounts for bytes that have been received and, for a batch transfer, waits until the
+  // rate is back under the limit. Returns E_ABORT if cancelled becomes true while waiting.
+  HRESULT consume(const uint64_t bytes, const bool interactive, const std::atomic<bool> *cancelled);
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  std::mutex mtx_;
+  uint64_t rate_;
+  // when the bucket will be full again with what has been taken so far
+  clock::time_point full_at_;
+};
@@ -0,0 +1,232 @@
+#include "transfer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  constexpr size_t min_buffer_size = 64 * 1024;
+  constexpr size_t max_buffer_size = 1024 * 1024;
+  constexpr size_t default_buffer_size = 256 * 1024;
+  constexpr size_t buffer_count = 3;
+
+  struct chunk
+  {
+    uint8_t *data;
+    size_t size;
+  };
+
+  class writer
+  {
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<chunk> filled_;
+    std::vector<uint8_t *> free_;
+    bool finished_;
+    HRESULT hr_;
+    file_t file_;
+    Hasher *hasher_;
+    std::thread thread_;
+
+  public:
+    writer(file_t file, std::vector<uint8_t *> buffers, Hasher *hasher) : free_(std::move(buffers)), finished_(false), hr_(S_OK), file_(file), hasher_(hasher)
+    {
+      thread_ = std::thread(&writer::run, this);
+    }
+
+    // Waits for a buffer that can be filled. Returns nullptr if writing has failed.
+    uint8_t *acquire()
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      cv_.wait(lock, [this]()
+               { return !free_.empty() || FAILED(hr_); });
+      if (FAILED(hr_))
+      {
+        return nullptr;
+      }
+      uint8_t *p = free_.back();
+      free_.pop_back();
+      return p;
+    }
+
+    void release(uint8_t *p)
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      free_.push_back(p);
+    }
+
+    void push(uint8_t *p, size_t size)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        filled_.push_back({p, size});
+      }
+      cv_.notify_all();
+    }
+
+    // Waits until everything is written and the file is closed.
+    HRESULT finish()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        finished_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
+      return hr_;
+    }
+
+  private:
+    void run()
+    {
+      for (;;)
+      {
+        chunk c;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          cv_.wait(lock, [this]()
+                   { return !filled_.empty() || finished_; });
+          if (filled_.empty())
+          {
+            break;
+          }
+          c = filled_.front();
+          filled_.pop_front();
+        }
+        const HRESULT hr = file_write(file_, c.data, c.size);
+        if (SUCCEEDED(hr) && hasher_)
+        {
+          // the data is still in cache right after the write
+          hasher_->update(c.data, c.size);
+        }
+        {
+          std::lock_guard<std::mutex> lock(mtx_);
+          free_.push_back(c.data);
+          if (FAILED(hr))
+          {
+            hr_ = hr;
+          }
+        }
+        cv_.notify_all();
+        if (FAILED(hr))
+        {
+          break;
+        }
+      }
+      const HRESULT hr = file_close(file_);
+      std::lock_guard<std::mutex> lock(mtx_);
+      if (SUCCEEDED(hr_) && FAILED(hr))
+      {
+        hr_ = hr;
+      }
+    }
+  };
+}
+
+size_t transfer_buffer_size(uint64_t content_length)
+{
+  if (content_length == 0)
+  {
+    return default_buffer_size;
+  }
+  // a quarter of the body so that there are a few buffers to rotate, rounded up to 64 KiB
+  const uint64_t quarter = (content_length / 4 + min_buffer_size - 1) & ~(uint64_t)(min_buffer_size - 1);
+  return quarter < min_buffer_size ? min_buffer_size : quarter > max_buffer_size ? max_buffer_size
+                                                                                  : (size_t)quarter;
+}
+
+HRESULT transfer_to_file(
+    const transfer_source &source,
+    const uint64_t content_length,
+    file_t file,
+    const std::function<void()> &source_done,
+    Hasher *hasher)
+{
+  const size_t size = transfer_buffer_size(content_length);
+  std::unique_ptr<uint8_t[]> storage(new (std::nothrow) uint8_t[size * buffer_count]);
+  if (!storage)
+  {
+    if (source_done)
+    {
+      source_done();
+    }
+    file_close(file);
+    return E_OUTOFMEMORY;
+  }
+  std::vector<uint8_t *> buffers;
+  for (size_t i = 0; i < buffer_count; ++i)
+  {
+    buffers.push_back(storage.get() + i * size);
+  }
+
+  if (content_length > 0)
+  {
+    // only a layout hint, the transfer works without it
+    file_reserve(file, content_length);
+  }
+
+  writer w(file, std::move(buffers), hasher);
+  HRESULT hr = S_OK;
+  uint64_t total = 0;
+  bool eof = false;
+  while (!eof)
+  {
+    uint8_t *p = w.acquire();
+    if (!p)
+    {
+      break;
+    }
+    // fill the whole buffer so that the disk sees large writes
+    size_t filled = 0;
+    while (filled < size)
+    {
+      size_t read = 0;
+      hr = source(p + filled, size - filled, read);
+      if (FAILED(hr))
+      {
+        break;
+      }
+      if (read == 0)
+      {
+        eof = true;
+        break;
+      }
+      filled += read;
+    }
+    total += filled;
+    if (filled > 0)
+    {
+      w.push(p, filled);
+    }
+    else
+    {
+      w.release(p);
+    }
+    if (FAILED(hr))
+    {
+      break;
+    }
+  }
+  if (source_done)
+  {
+    source_done();
+  }
+  const HRESULT whr = w.finish();
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  if (FAILED(whr))
+  {
+    return whr;
+  }
+  if (content_length > 0 && total != content_length)
+  {
+    return HRESULT_FROM_WIN32(total < content_length ? ERROR_HANDLE_EOF : ERROR_INVALID_DATA);
+  }
+  return S_OK;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <functional>
+
+#include "hash.h"
+#include "platform.h"
+
+// Reads up to size bytes into buf. read is 0 at the end of the data.
+typedef std::function<HRESULT(void *buf, size_t size, size_t &read)> transfer_source;
+
+// Returns the size of each rotating buffer for a body of content_length bytes (0 if unknown).
+size_t transfer_buffer_size(uint64_t content_length);
+
+// Copies everything source produces into file.
+// If content_length is not 0, the space for it is reserved in advance and a body of any other
+// length is an error: HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) if it is shorter,
+// HRESULT_FROM_WIN32(ERROR_INVALID_DATA) if it is longer.
+// source is read on the calling thread into rotating buffers while a writer thread writes
+// the filled ones, so reading and writing overlap. The writer thread also closes file,
+// which is always closed when this returns.
+// If given, source_done is called once source is no longer needed, while the writer may
+// still be flushing and closing the file.
+// If given, hasher is fed with the bytes written, on the writer thread after each write.
+HRESULT transfer_to_file(
+    const transfer_source &source,
+    const uint64_t content_length,
+    file_t file,
+    const std::function<void()> &source_done = nullptr,
+    Hasher *hasher = nullptr);
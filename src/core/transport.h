@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "platform.h"
+
+struct http_request
+{
+  LPCWSTR user_agent;
+  LPCWSTR url;
+  // Extra request headers, each line ending with "\r\n".
+  std::string headers;
+  // Timeouts in milliseconds.
+  int connect_timeout;
+  int receive_timeout;
+  // Waits are cut short when this becomes true, where the implementation allows it.
+  const std::atomic<bool> *cancelled;
+};
+
+// The response to a request sent through a Transport.
+// Destroying it gives the connection back for reuse once the whole body has been read.
+class HttpResponse
+{
+public:
+  virtual ~HttpResponse() {}
+
+  virtual int status() const = 0;
+  // Finds a response header by its name, which is not case sensitive.
+  // Returns false if there is no such header.
+  virtual bool header(const char *name, std::string &value) const = 0;
+  // Reads the next part of the body into buf. read is 0 at the end of the body.
+  virtual HRESULT read(void *buf, size_t size, size_t &read) = 0;
+  // Abandons the rest of the body, so the connection is closed rather than reused.
+  // Can be called from another thread to make a blocked read fail.
+  virtual void cancel() = 0;
+};
+
+// Sends HTTP GET requests and keeps the connections alive for later requests.
+class Transport
+{
+public:
+  virtual ~Transport() {}
+
+  // Sends request and waits for the response headers.
+  virtual HRESULT open(const http_request &request, std::unique_ptr<HttpResponse> &dest) = 0;
+  // Connects to the host of url so that the next request there can skip the handshake.
+  virtual HRESULT warm_up(LPCWSTR user_agent, LPCWSTR url) = 0;
+  // Closes the connections kept for reuse.
+  virtual void close() = 0;
+};
+
+// Returns the transport of this platform: WinINet on Windows and plain sockets elsewhere.
+// The socket transport speaks HTTP/1.1 without TLS and fails https URLs with E_NOTIMPL.
+Transport &default_transport();
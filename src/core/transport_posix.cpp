@@ -0,0 +1,526 @@
+#include "transport.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "encoding.h"
+#include "http.h"
+
+namespace
+{
+  // Response headers larger than this are rejected.
+  constexpr size_t max_header_bytes = 64 * 1024;
+  constexpr size_t receive_buffer_bytes = 64 * 1024;
+  constexpr size_t idle_per_host = 16;
+  // Blocking waits wake up this often in milliseconds to notice a cancellation.
+  constexpr int wait_slice = 100;
+
+  // Waits until fd is ready for events, for at most timeout milliseconds.
+  HRESULT wait_fd(const int fd, const short events, const int timeout, const std::atomic<bool> *cancelled, const std::atomic<bool> *aborted)
+  {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    for (;;)
+    {
+      if ((cancelled && cancelled->load()) || (aborted && aborted->load()))
+      {
+        return E_ABORT;
+      }
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (left <= 0)
+      {
+        return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+      }
+      pollfd p = {fd, events, 0};
+      const int r = poll(&p, 1, left < wait_slice ? (int)left : wait_slice);
+      if (r < 0 && errno != EINTR)
+      {
+        return last_error();
+      }
+      if (r > 0)
+      {
+        // errors and hangups are reported by the call that follows
+        return S_OK;
+      }
+    }
+  }
+
+  HRESULT connect_to(const http_url &u, const int timeout, const std::atomic<bool> *cancelled, int &dest)
+  {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *list = nullptr;
+    if (getaddrinfo(u.host.c_str(), u.port.c_str(), &hints, &list) != 0)
+    {
+      return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+    HRESULT hr = E_FAIL;
+    for (addrinfo *a = list; a; a = a->ai_next)
+    {
+      const int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+      if (fd == -1)
+      {
+        hr = last_error();
+        continue;
+      }
+      if (connect(fd, a->ai_addr, a->ai_addrlen) == -1)
+      {
+        if (errno != EINPROGRESS)
+        {
+          hr = last_error();
+          ::close(fd);
+          continue;
+        }
+        hr = wait_fd(fd, POLLOUT, timeout, cancelled, nullptr);
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (SUCCEEDED(hr) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0)
+        {
+          hr = HRESULT_FROM_WIN32(err);
+        }
+        if (FAILED(hr))
+        {
+          ::close(fd);
+          if (hr == E_ABORT)
+          {
+            break;
+          }
+          continue;
+        }
+      }
+      const int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      dest = fd;
+      hr = S_OK;
+      break;
+    }
+    freeaddrinfo(list);
+    return hr;
+  }
+
+  HRESULT send_all(const int fd, const std::string &data, const int timeout, const std::atomic<bool> *cancelled)
+  {
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+      const ssize_t r = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (r >= 0)
+      {
+        sent += (size_t)r;
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        return last_error();
+      }
+      const HRESULT hr = wait_fd(fd, POLLOUT, timeout, cancelled, nullptr);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+    }
+    return S_OK;
+  }
+
+  class SocketTransport;
+
+  class SocketResponse : public HttpResponse
+  {
+  public:
+    SocketResponse(SocketTransport &owner, const std::string &key, const int fd, const http_request &request)
+        : owner_(owner),
+          key_(key),
+          fd_(fd),
+          timeout_(request.receive_timeout),
+          cancelled_(request.cancelled),
+          aborted_(false),
+          buf_(receive_buffer_bytes),
+          pos_(0),
+          end_(0),
+          head_(),
+          left_(0),
+          done_(false)
+    {
+    }
+    ~SocketResponse();
+
+    int status() const override
+    {
+      return head_.status;
+    }
+
+    bool header(const char *name, std::string &value) const override
+    {
+      return head_.find(name, value);
+    }
+
+    HRESULT read(void *buf, size_t size, size_t &read) override;
+
+    void cancel() override
+    {
+      aborted_ = true;
+      shutdown(fd_, SHUT_RDWR);
+    }
+
+    // Reads and parses the response headers. Returns S_FALSE if the connection was closed
+    // before any of the response arrived, which happens to a kept connection the server dropped.
+    HRESULT read_headers();
+
+  private:
+    SocketTransport &owner_;
+    const std::string key_;
+    const int fd_;
+    const int timeout_;
+    const std::atomic<bool> *cancelled_;
+    std::atomic<bool> aborted_;
+    std::vector<char> buf_;
+    size_t pos_;
+    size_t end_;
+    http_head head_;
+    // bytes left in the body for HTTP_BODY_LENGTH
+    uint64_t left_;
+    ChunkedDecoder chunked_;
+    bool done_;
+
+    HRESULT receive(void *p, const size_t size, size_t &got);
+    HRESULT fill(size_t &got);
+  };
+
+  class SocketTransport : public Transport
+  {
+  public:
+    ~SocketTransport()
+    {
+      close();
+    }
+
+    HRESULT open(const http_request &request, std::unique_ptr<HttpResponse> &dest) override
+    {
+      http_url u;
+      HRESULT hr = parse_http_url(request.url, u);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      std::string ua;
+      hr = to_u8(request.user_agent, -1, ua);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      const std::string key = u.host + ":" + u.port;
+      const std::string req = build_http_get(u, ua, request.headers);
+      for (;;)
+      {
+        int fd = -1;
+        const bool reused = acquire(key, fd);
+        if (!reused)
+        {
+          hr = connect_to(u, request.connect_timeout, request.cancelled, fd);
+          if (FAILED(hr))
+          {
+            return hr;
+          }
+        }
+        hr = send_all(fd, req, request.receive_timeout, request.cancelled);
+        if (FAILED(hr))
+        {
+          ::close(fd);
+          if (reused && hr != E_ABORT)
+          {
+            continue;
+          }
+          return hr;
+        }
+        std::unique_ptr<SocketResponse> r(new SocketResponse(*this, key, fd, request));
+        hr = r->read_headers();
+        if (hr == S_FALSE || (FAILED(hr) && reused && hr != E_ABORT && hr != HRESULT_FROM_WIN32(ERROR_TIMEOUT)))
+        {
+          r->cancel();
+          if (reused)
+          {
+            // the server closed the kept connection meanwhile, try a new one
+            continue;
+          }
+          return hr == S_FALSE ? HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) : hr;
+        }
+        if (FAILED(hr))
+        {
+          r->cancel();
+          return hr;
+        }
+        dest = std::move(r);
+        return S_OK;
+      }
+    }
+
+    HRESULT warm_up(LPCWSTR user_agent, LPCWSTR url) override
+    {
+      (void)user_agent;
+      http_url u;
+      HRESULT hr = parse_http_url(url, u);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      int fd = -1;
+      hr = connect_to(u, 15000, nullptr, fd);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      release(u.host + ":" + u.port, fd);
+      return S_OK;
+    }
+
+    void close() override
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      for (const auto &host : idle_)
+      {
+        for (const int fd : host.second)
+        {
+          ::close(fd);
+        }
+      }
+      idle_.clear();
+    }
+
+    // Takes a kept connection to key. Returns false if there is none.
+    bool acquire(const std::string &key, int &fd)
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      const auto it = idle_.find(key);
+      if (it == idle_.end())
+      {
+        return false;
+      }
+      while (!it->second.empty())
+      {
+        fd = it->second.back();
+        it->second.pop_back();
+        // an idle connection that has something to read has been closed by the server
+        pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 0) == 0)
+        {
+          return true;
+        }
+        ::close(fd);
+      }
+      return false;
+    }
+
+    // Keeps the connection fd to key for the next request.
+    void release(const std::string &key, const int fd)
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      std::vector<int> &fds = idle_[key];
+      if (fds.size() >= idle_per_host)
+      {
+        ::close(fd);
+        return;
+      }
+      fds.push_back(fd);
+    }
+
+  private:
+    std::mutex mtx_;
+    std::map<std::string, std::vector<int>> idle_;
+  };
+
+  SocketResponse::~SocketResponse()
+  {
+    if (done_ && head_.keep_alive && !aborted_ && pos_ == end_)
+    {
+      owner_.release(key_, fd_);
+      return;
+    }
+    ::close(fd_);
+  }
+
+  HRESULT SocketResponse::receive(void *p, const size_t size, size_t &got)
+  {
+    for (;;)
+    {
+      const ssize_t r = recv(fd_, p, size, 0);
+      if (r >= 0)
+      {
+        got = (size_t)r;
+        return aborted_ ? E_ABORT : S_OK;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        got = 0;
+        return aborted_ ? E_ABORT : last_error();
+      }
+      const HRESULT hr = wait_fd(fd_, POLLIN, timeout_, cancelled_, &aborted_);
+      if (FAILED(hr))
+      {
+        got = 0;
+        return hr;
+      }
+    }
+  }
+
+  // Appends what arrives to the buffer.
+  HRESULT SocketResponse::fill(size_t &got)
+  {
+    if (pos_ == end_)
+    {
+      pos_ = end_ = 0;
+    }
+    else if (end_ == buf_.size())
+    {
+      memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+      end_ -= pos_;
+      pos_ = 0;
+    }
+    if (end_ == buf_.size())
+    {
+      return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    const HRESULT hr = receive(buf_.data() + end_, buf_.size() - end_, got);
+    end_ += got;
+    return hr;
+  }
+
+  HRESULT SocketResponse::read_headers()
+  {
+    bool received = false;
+    for (;;)
+    {
+      const size_t n = find_http_head_end(buf_.data() + pos_, end_ - pos_);
+      if (n == 0)
+      {
+        size_t got = 0;
+        const HRESULT hr = fill(got);
+        if (FAILED(hr))
+        {
+          return hr;
+        }
+        if (got == 0)
+        {
+          return received ? HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) : S_FALSE;
+        }
+        received = true;
+        continue;
+      }
+      const HRESULT hr = parse_http_head(buf_.data() + pos_, n, head_);
+      pos_ += n;
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      // an interim response is followed by the real one
+      if (head_.status >= 200)
+      {
+        break;
+      }
+    }
+    left_ = head_.body == HTTP_BODY_LENGTH ? head_.length : 0;
+    done_ = head_.body == HTTP_BODY_LENGTH && left_ == 0;
+    return S_OK;
+  }
+
+  HRESULT SocketResponse::read(void *buf, size_t size, size_t &read)
+  {
+    read = 0;
+    if (aborted_)
+    {
+      return E_ABORT;
+    }
+    while (!done_ && size > 0)
+    {
+      if (head_.body == HTTP_BODY_CHUNKED)
+      {
+        if (pos_ == end_)
+        {
+          size_t got = 0;
+          const HRESULT hr = fill(got);
+          if (FAILED(hr))
+          {
+            return hr;
+          }
+          if (got == 0)
+          {
+            return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+          }
+        }
+        const char *data = nullptr;
+        size_t data_size = 0, consumed = 0;
+        const HRESULT hr = chunked_.decode(buf_.data() + pos_, std::min(end_ - pos_, size), data, data_size, consumed);
+        if (FAILED(hr))
+        {
+          return hr;
+        }
+        if (data_size > 0)
+        {
+          memcpy(buf, data, data_size);
+        }
+        pos_ += consumed;
+        done_ = chunked_.done();
+        if (data_size > 0)
+        {
+          read = data_size;
+          return S_OK;
+        }
+        continue;
+      }
+      // a fixed length or everything until the connection closes
+      if (head_.body == HTTP_BODY_LENGTH && size > left_)
+      {
+        size = (size_t)left_;
+      }
+      if (pos_ < end_)
+      {
+        read = std::min(size, end_ - pos_);
+        memcpy(buf, buf_.data() + pos_, read);
+        pos_ += read;
+      }
+      else
+      {
+        // large reads go straight into the caller's buffer
+        const HRESULT hr = receive(buf, size, read);
+        if (FAILED(hr))
+        {
+          return hr;
+        }
+        if (read == 0)
+        {
+          if (head_.body == HTTP_BODY_LENGTH)
+          {
+            return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+          }
+          done_ = true;
+          return S_OK;
+        }
+      }
+      if (head_.body == HTTP_BODY_LENGTH)
+      {
+        left_ -= read;
+        done_ = left_ == 0;
+      }
+      return S_OK;
+    }
+    return S_OK;
+  }
+}
+
+Transport &default_transport()
+{
+  static SocketTransport t;
+  return t;
+}
@@ -0,0 +1,205 @@
+#include "transport.h"
+
+#include <wininet.h>
+
+#include <map>
+#include <mutex>
+
+namespace
+{
+  class WinINetResponse : public HttpResponse
+  {
+  public:
+    WinINetResponse(HINTERNET h, const int status) : h_(h), status_(status) {}
+    ~WinINetResponse()
+    {
+      close();
+    }
+
+    int status() const override
+    {
+      return status_;
+    }
+
+    bool header(const char *name, std::string &value) const override
+    {
+      // HTTP_QUERY_CUSTOM takes the name in the buffer and replaces it with the value
+      char buf[1024];
+      const size_t len = strlen(name);
+      if (len >= sizeof(buf))
+      {
+        return false;
+      }
+      memcpy(buf, name, len + 1);
+      DWORD sz = sizeof(buf);
+      if (!HttpQueryInfoA(h_.load(), HTTP_QUERY_CUSTOM, buf, &sz, NULL))
+      {
+        return false;
+      }
+      value.assign(buf, sz);
+      return true;
+    }
+
+    HRESULT read(void *buf, size_t size, size_t &read) override
+    {
+      DWORD len = 0;
+      if (!InternetReadFile(h_.load(), buf, size > 0x40000000 ? 0x40000000 : (DWORD)size, &len))
+      {
+        read = 0;
+        return HRESULT_FROM_WIN32(GetLastError());
+      }
+      read = len;
+      return S_OK;
+    }
+
+    void cancel() override
+    {
+      // closing the handle is how WinINet aborts a read on another thread
+      close();
+    }
+
+  private:
+    std::atomic<HINTERNET> h_;
+    const int status_;
+
+    void close()
+    {
+      HINTERNET h = h_.exchange(NULL);
+      if (h)
+      {
+        // the connection goes back to the session if the body was read to the end
+        InternetCloseHandle(h);
+      }
+    }
+  };
+
+  // WinINet keeps finished keep-alive connections in the session they were made with,
+  // so sessions are kept open for each user agent instead of per request.
+  class WinINetTransport : public Transport
+  {
+  public:
+    ~WinINetTransport()
+    {
+      close();
+    }
+
+    HRESULT open(const http_request &request, std::unique_ptr<HttpResponse> &dest) override
+    {
+      HINTERNET inet = NULL;
+      HRESULT hr = get_session(request.user_agent, inet);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      {
+        DWORD v = (DWORD)request.connect_timeout;
+        InternetSetOptionW(inet, INTERNET_OPTION_CONNECT_TIMEOUT, &v, sizeof(v));
+        v = (DWORD)request.receive_timeout;
+        InternetSetOptionW(inet, INTERNET_OPTION_RECEIVE_TIMEOUT, &v, sizeof(v));
+      }
+      const wstr headers(request.headers.begin(), request.headers.end());
+      DWORD flags = INTERNET_FLAG_KEEP_CONNECTION;
+      if (request.headers.find("Range:") != std::string::npos)
+      {
+        // a ranged request must reach the server, and its partial body must not be cached
+        flags |= INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE;
+      }
+      HINTERNET h = InternetOpenUrlW(
+          inet, request.url, headers.empty() ? NULL : headers.c_str(), headers.empty() ? 0 : (DWORD)-1L, flags, 0);
+      if (!h)
+      {
+        return HRESULT_FROM_WIN32(GetLastError());
+      }
+      DWORD status = 0, sz = sizeof(status);
+      if (!HttpQueryInfoW(h, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &status, &sz, NULL))
+      {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        InternetCloseHandle(h);
+        return hr;
+      }
+      dest.reset(new WinINetResponse(h, (int)status));
+      return S_OK;
+    }
+
+    HRESULT warm_up(LPCWSTR user_agent, LPCWSTR url) override
+    {
+      URL_COMPONENTSW uc = {};
+      uc.dwStructSize = sizeof(uc);
+      uc.dwSchemeLength = 1;
+      uc.dwHostNameLength = 1;
+      if (!InternetCrackUrlW(url, 0, 0, &uc))
+      {
+        return HRESULT_FROM_WIN32(GetLastError());
+      }
+      HINTERNET inet = NULL;
+      HRESULT hr = get_session(user_agent, inet);
+      if (FAILED(hr))
+      {
+        return hr;
+      }
+      const wstr host(uc.lpszHostName, uc.dwHostNameLength);
+      HINTERNET c = InternetConnectW(inet, host.c_str(), uc.nPort, NULL, NULL, INTERNET_SERVICE_HTTP, 0, 0);
+      if (!c)
+      {
+        return HRESULT_FROM_WIN32(GetLastError());
+      }
+      HINTERNET r = HttpOpenRequestW(
+          c, L"HEAD", L"/", NULL, NULL, NULL,
+          INTERNET_FLAG_KEEP_CONNECTION | (uc.nScheme == INTERNET_SCHEME_HTTPS ? INTERNET_FLAG_SECURE : 0),
+          0);
+      if (!r)
+      {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        InternetCloseHandle(c);
+        return hr;
+      }
+      // The response does not matter, only the connection that is left in the pool.
+      if (!HttpSendRequestW(r, NULL, 0, NULL, 0))
+      {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+      }
+      InternetCloseHandle(r);
+      InternetCloseHandle(c);
+      return hr;
+    }
+
+    void close() override
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      for (const auto &s : sessions_)
+      {
+        InternetCloseHandle(s.second);
+      }
+      sessions_.clear();
+    }
+
+  private:
+    std::mutex mtx_;
+    std::map<wstr, HINTERNET> sessions_;
+
+    HRESULT get_session(LPCWSTR user_agent, HINTERNET &dest)
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      const auto it = sessions_.find(user_agent);
+      if (it != sessions_.end())
+      {
+        dest = it->second;
+        return S_OK;
+      }
+      HINTERNET inet = InternetOpenW(user_agent, INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+      if (!inet)
+      {
+        return HRESULT_FROM_WIN32(GetLastError());
+      }
+      sessions_[user_agent] = inet;
+      dest = inet;
+      return S_OK;
+    }
+  };
+}
+
+Transport &default_transport()
+{
+  static WinINetTransport t;
+  return t;
+}
@@ -2,7 +2,6 @@
 #include <string>
 #include <vector>
 #include <functional>
-#include <thread>
 #include <memory>
 
 #include <windows.h>
@@ -11,7 +10,6 @@
 #include <commctrl.h>
 #include <shlobj.h>
 #include <dwmapi.h>
-#include <wininet.h>
 #include <wrl.h>
 
 #include "picojson.h"
@@ -19,301 +17,60 @@
 #include "WebView2.h"
 #include "version.h"
 
+#include "core/api.h"
+#include "core/download.h"
+#include "core/encoding.h"
+#include "core/setting.h"
+
 #if _DEBUG
 #define FCC_DEVTOOL
 #define FCC_ACCEPTALL
 #endif
 
-enum
-{
-  ENCODING_UTF8 = 0,
-  ENCODING_UTF8BOM = 1,
-  ENCODING_UTF16LE = 2,
-  ENCODING_UTF16LEBOM = 3,
-  ENCODING_UTF16BE = 4,
-  ENCODING_UTF16BEBOM = 5,
-  ENCODING_SHIFTJIS = 6,
-};
-
-static bool report(HRESULT hr, LPCWSTR message)
-{
-  if (SUCCEEDED(hr))
-  {
-    return false;
-  }
-  std::wstring m(message);
-  m += L": ";
-  {
-    LPWSTR t = NULL;
-    FormatMessageW(
-        FORMAT_MESSAGE_ALLOCATE_BUFFER |
-            FORMAT_MESSAGE_FROM_SYSTEM,
-        NULL,
-        hr,
-        LANG_USER_DEFAULT,
-        (LPWSTR)&t,
-        0,
-        NULL);
-    m += t;
-    LocalFree(t);
-  }
-  m += L"\n";
-  OutputDebugStringW(m.c_str());
-  return true;
-}
-
-static HRESULT to_u16(LPCSTR src, const int srclen, std::wstring &dest)
-{
-  if (srclen == 0)
-  {
-    dest.resize(0);
-    return S_OK;
-  }
-  const int destlen = MultiByteToWideChar(CP_UTF8, 0, src, srclen, nullptr, 0);
-  if (destlen == 0)
-  {
-    return HRESULT_FROM_WIN32(GetLastError());
-  }
-  dest.resize(destlen);
-  if (MultiByteToWideChar(CP_UTF8, 0, src, srclen, &dest[0], destlen) == 0)
-  {
-    return HRESULT_FROM_WIN32(GetLastError());
-  }
-  if (srclen == -1)
-  {
-    dest.resize(destlen - 1);
-  }
-  return S_OK;
-}
-
-static HRESULT to_u8(LPCWSTR src, const int srclen, std::string &dest)
+static HRESULT get_setting_path(std::wstring &dest)
 {
-  if (srclen == 0)
-  {
-    dest.resize(0);
-    return S_OK;
-  }
-  const int destlen = WideCharToMultiByte(CP_UTF8, 0, src, srclen, nullptr, 0, nullptr, nullptr);
-  if (destlen == 0)
+  dest.resize(MAX_PATH);
+  if (GetModuleFileNameW(nullptr, &dest[0], MAX_PATH) == 0)
   {
     return HRESULT_FROM_WIN32(GetLastError());
   }
-  dest.resize(destlen);
-  if (WideCharToMultiByte(CP_UTF8, 0, src, srclen, &dest[0], destlen, nullptr, nullptr) == 0)
-  {
-    return HRESULT_FROM_WIN32(GetLastError());
-  }
-  if (srclen == -1)
-  {
-    dest.resize(destlen - 1);
-  }
+  dest.resize(dest.rfind(L'.') + 1);
+  dest += L"json";
   return S_OK;
 }
 
-static HRESULT to_sjis(LPCWSTR src, const int srclen, std::string &dest)
+// The cache lives next to the setting file, like the setting file lives next to the executable.
+static HRESULT get_cache_path(std::wstring &dest)
 {
-  if (srclen == 0)
-  {
-    dest.resize(0);
-    return S_OK;
-  }
-  const int destlen = WideCharToMultiByte(932, 0, src, srclen, nullptr, 0, nullptr, nullptr);
-  if (destlen == 0)
-  {
-    return HRESULT_FROM_WIN32(GetLastError());
-  }
-  dest.resize(destlen);
-  if (WideCharToMultiByte(932, 0, src, srclen, &dest[0], destlen, nullptr, nullptr) == 0)
+  dest.resize(MAX_PATH);
+  if (GetModuleFileNameW(nullptr, &dest[0], MAX_PATH) == 0)
   {
     return HRESULT_FROM_WIN32(GetLastError());
   }
-  if (srclen == -1)
-  {
-    dest.resize(destlen - 1);
-  }
-  return S_OK;
-}
-
-static HRESULT write(HANDLE file, const void *p, size_t bytes)
-{
-  uint8_t *s = (uint8_t *)p;
-  size_t pos = 0;
-  while (pos < bytes)
-  {
-    DWORD written = 0;
-    if (!WriteFile(file, &s[pos], bytes - pos, &written, nullptr))
-    {
-      return HRESULT_FROM_WIN32(GetLastError());
-    }
-    pos += written;
-  }
-  return S_OK;
-}
-
-struct setting
-{
-  int text_encoding;
-};
-
-static HRESULT load_json(LPCWSTR filepath, picojson::value &dest)
-{
-  HANDLE file = CreateFileW(filepath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-  if (file == INVALID_HANDLE_VALUE)
-  {
-    HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
-    dest = picojson::value();
-    return hr;
-  }
-  std::string s;
-  {
-    char buf[4096] = {};
-    DWORD read = 0;
-    do
-    {
-      if (!ReadFile(file, buf, 4096, &read, NULL))
-      {
-        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
-        dest = picojson::value();
-        return hr;
-      }
-      if (read > 0)
-      {
-        s.append(buf, read);
-      }
-    } while (read > 0);
-  }
-  CloseHandle(file);
-
-  const std::string err = picojson::parse(dest, s);
-  if (!err.empty())
-  {
-    return E_FAIL;
-  }
-  return S_OK;
-}
-
-static HRESULT save_json(LPCWSTR filepath, const picojson::value src)
-{
-  HRESULT hr = 0;
-  HANDLE file = CreateFileW(filepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-  if (file == INVALID_HANDLE_VALUE)
-  {
-    hr = HRESULT_FROM_WIN32(GetLastError());
-    return hr;
-  }
-  std::string s = src.serialize();
-  hr = write(file, &s[0], s.size());
-  if (FAILED(hr))
-  {
-    CloseHandle(file);
-    return hr;
-  }
-  CloseHandle(file);
-  return S_OK;
-}
-
-static HRESULT load_setting(LPCWSTR filepath, setting &dest)
-{
-  dest.text_encoding = ENCODING_UTF8BOM;
-
-  picojson::value v;
-  HRESULT hr = load_json(filepath, v);
+  dest.resize(dest.rfind(L'.'));
+  dest += L".cache";
+  HRESULT hr = dir_create(dest.c_str());
   if (FAILED(hr))
   {
     return hr;
   }
-  if (!v.is<picojson::object>())
-  {
-    return E_FAIL;
-  }
-  const picojson::object &obj = v.get<picojson::object>();
-  {
-    const auto it = obj.find("textEncoding");
-    if (it != obj.end())
-    {
-      const auto e = it->second.to_str();
-      if (e == "utf8")
-      {
-        dest.text_encoding = ENCODING_UTF8;
-      }
-      else if (e == "utf8bom")
-      {
-        dest.text_encoding = ENCODING_UTF8BOM;
-      }
-      else if (e == "utf16le")
-      {
-        dest.text_encoding = ENCODING_UTF16LE;
-      }
-      else if (e == "utf16lebom")
-      {
-        dest.text_encoding = ENCODING_UTF16LEBOM;
-      }
-      else if (e == "utf16be")
-      {
-        dest.text_encoding = ENCODING_UTF16BE;
-      }
-      else if (e == "utf16bebom")
-      {
-        dest.text_encoding = ENCODING_UTF16BEBOM;
-      }
-      else if (e == "sjis")
-      {
-        dest.text_encoding = ENCODING_SHIFTJIS;
-      }
-    }
-  }
+  dest += L"\\";
   return S_OK;
 }
-static HRESULT save_setting(LPCWSTR filepath, const setting &dest)
-{
-  picojson::object obj;
-  std::string s;
-  switch (dest.text_encoding)
-  {
-  case ENCODING_UTF8:
-    s = "utf8";
-    break;
-  case ENCODING_UTF8BOM:
-    s = "utf8bom";
-    break;
-  case ENCODING_UTF16LE:
-    s = "utf16le";
-    break;
-  case ENCODING_UTF16LEBOM:
-    s = "utf16lebom";
-    break;
-  case ENCODING_UTF16BE:
-    s = "utf16be";
-    break;
-  case ENCODING_UTF16BEBOM:
-    s = "utf16bebom";
-    break;
-  case ENCODING_SHIFTJIS:
-    s = "sjis";
-    break;
-  default:
-    s = "utf8bom";
-    break;
-  }
-  obj["textEncoding"].set<std::string>(s);
-  return save_json(filepath, picojson::value(obj));
-}
 
 static HRESULT CALLBACK show_save_dialog(HWND hWnd, LPCWSTR default_filename, int &text_encoding, std::wstring &dest)
 {
   std::wstring setting_path;
-  setting_path.resize(MAX_PATH);
-  if (GetModuleFileNameW(nullptr, &setting_path[0], MAX_PATH) == 0)
+  HRESULT hr = get_setting_path(setting_path);
+  if (FAILED(hr))
   {
-    return HRESULT_FROM_WIN32(GetLastError());
+    return hr;
   }
-  setting_path.resize(setting_path.rfind(L'.') + 1);
-  setting_path += L"json";
   setting s;
   load_setting(setting_path.c_str(), s);
 
   Microsoft::WRL::ComPtr<IFileSaveDialog> d;
-  HRESULT hr = CoCreateInstance(CLSID_FileSaveDialog, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&d));
+  hr = CoCreateInstance(CLSID_FileSaveDialog, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&d));
   if (FAILED(hr))
   {
     return hr;
@@ -442,263 +199,54 @@ static HRESULT CALLBACK show_save_dialog(HWND hWnd, LPCWSTR default_filename, in
   return S_OK;
 }
 
-static HRESULT download(LPCWSTR user_agent, LPCWSTR url, LPCWSTR filepath)
+static HRESULT show_folder_dialog(HWND hWnd, std::wstring &dest)
 {
-  const HANDLE file = CreateFileW(filepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-  if (file == INVALID_HANDLE_VALUE)
+  Microsoft::WRL::ComPtr<IFileOpenDialog> d;
+  HRESULT hr = CoCreateInstance(CLSID_FileOpenDialog, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&d));
+  if (FAILED(hr))
   {
-    HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
     return hr;
   }
-  HINTERNET inet = InternetOpen(user_agent, INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
-  if (!inet)
-  {
-    CloseHandle(file);
-    return HRESULT_FROM_WIN32(GetLastError());
-  }
-  HINTERNET h = InternetOpenUrl(inet, url, NULL, 0, 0, 0);
-  if (!h)
+  FILEOPENDIALOGOPTIONS options = 0;
+  hr = d->GetOptions(&options);
+  if (FAILED(hr))
   {
-    HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
-    InternetCloseHandle(inet);
-    CloseHandle(file);
     return hr;
   }
-  char buf[4096] = {};
-  DWORD len = 0;
-  do
-  {
-    if (!InternetReadFile(h, buf, 4096, &len))
-    {
-      HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
-      InternetCloseHandle(h);
-      InternetCloseHandle(inet);
-      CloseHandle(file);
-      return hr;
-    }
-    if (len > 0)
-    {
-      DWORD written = 0;
-      if (!WriteFile(file, buf, len, &written, nullptr))
-      {
-        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
-        InternetCloseHandle(h);
-        InternetCloseHandle(inet);
-        CloseHandle(file);
-        return hr;
-      }
-    }
-  } while (len > 0);
-  InternetCloseHandle(h);
-  InternetCloseHandle(inet);
-  CloseHandle(file);
-  return S_OK;
-}
-
-static bool is_big_endian()
-{
-  union
-  {
-    uint32_t i;
-    uint8_t c[4];
-  } u = {0x01020304};
-  return u.c[0] == 1;
-}
-
-static HRESULT write_text(LPCWSTR filepath, LPCWSTR text, int text_encoding)
-{
-  const uint8_t bom_utf8[3] = {0xef, 0xbb, 0xbf};
-  const uint8_t bom_utf16le[2] = {0xff, 0xfe};
-  const uint8_t bom_utf16be[2] = {0xfe, 0xff};
-
-  HRESULT hr = 0;
-  HANDLE file = CreateFileW(filepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-  if (file == INVALID_HANDLE_VALUE)
+  hr = d->SetOptions(options | FOS_PICKFOLDERS | FOS_FORCEFILESYSTEM);
+  if (FAILED(hr))
   {
-    hr = HRESULT_FROM_WIN32(GetLastError());
     return hr;
   }
-
-  std::string s;
-  std::wstring ws;
-
-  const uint8_t *bom = nullptr;
-  size_t bomln = 0;
-  uint8_t *p = nullptr;
-  size_t ln = 0;
-  switch (text_encoding)
-  {
-  case ENCODING_UTF8:
-  case ENCODING_UTF8BOM:
-    if (text_encoding == ENCODING_UTF8BOM)
-    {
-      bom = bom_utf8;
-      bomln = 3;
-    }
-    hr = to_u8(text, -1, s);
-    if (FAILED(hr))
-    {
-      goto failed;
-    }
-    p = (uint8_t *)(&s[0]);
-    ln = s.size();
-    break;
-  case ENCODING_UTF16LE:
-  case ENCODING_UTF16LEBOM:
-  case ENCODING_UTF16BE:
-  case ENCODING_UTF16BEBOM:
-    if (text_encoding == ENCODING_UTF16LEBOM)
-    {
-      bom = bom_utf16le;
-      bomln = 2;
-    }
-    else if (text_encoding == ENCODING_UTF16BEBOM)
-    {
-      bom = bom_utf16be;
-      bomln = 2;
-    }
-    ws = text;
-    {
-      const bool isbe = is_big_endian();
-      if (
-          (!isbe && (text_encoding == ENCODING_UTF16BE || text_encoding == ENCODING_UTF16BEBOM)) ||
-          (isbe && (text_encoding == ENCODING_UTF16LE || text_encoding == ENCODING_UTF16LEBOM)))
-      {
-        for (std::wstring::size_type pos = 0; pos < ws.size(); ++pos)
-        {
-          ws[pos] = ((ws[pos] & 0x00ff) << 8) | ((ws[pos] & 0xff00) >> 8);
-        }
-      }
-    }
-    p = (uint8_t *)(&ws[0]);
-    ln = ws.size() * 2;
-    break;
-  case ENCODING_SHIFTJIS:
-    hr = to_sjis(text, -1, s);
-    if (FAILED(hr))
-    {
-      goto failed;
-    }
-    p = (uint8_t *)(&s[0]);
-    ln = s.size();
-    break;
-  default:
-    hr = E_INVALIDARG;
-    goto failed;
-  }
-  if (bomln > 0)
-  {
-    hr = write(file, bom, bomln);
-    if (FAILED(hr))
-    {
-      goto failed;
-    }
-  }
-  if (ln > 0)
+  hr = d->SetTitle(L"保存先のフォルダーを選択");
+  if (FAILED(hr))
   {
-    hr = write(file, p, ln);
-    if (FAILED(hr))
-    {
-      goto failed;
-    }
+    return hr;
   }
-  CloseHandle(file);
-  return S_OK;
-failed:
-  CloseHandle(file);
-  DeleteFile(filepath);
-  return hr;
-}
-
-static void sanitize(LPCWSTR src, std::wstring &dest)
-{
-  dest.resize(0);
-  while (*src != L'\0')
+  hr = d->Show(hWnd);
+  if (FAILED(hr))
   {
-    switch (*src)
-    {
-    case 0x00:
-    case 0x01:
-    case 0x02:
-    case 0x03:
-    case 0x04:
-    case 0x05:
-    case 0x06:
-    case 0x07:
-    case 0x08:
-    case 0x09:
-    case 0x0a:
-    case 0x0b:
-    case 0x0c:
-    case 0x0d:
-    case 0x0e:
-    case 0x0f:
-    case 0x10:
-    case 0x11:
-    case 0x12:
-    case 0x13:
-    case 0x14:
-    case 0x15:
-    case 0x16:
-    case 0x17:
-    case 0x18:
-    case 0x19:
-    case 0x1a:
-    case 0x1b:
-    case 0x1c:
-    case 0x1d:
-    case 0x1e:
-    case 0x1f:
-    case 0x22:
-    case 0x2a:
-    case 0x2f:
-    case 0x3a:
-    case 0x3c:
-    case 0x3e:
-    case 0x3f:
-    case 0x7c:
-    case 0x7f:
-      dest += L"_";
-      break;
-    default:
-      dest += *src;
-      break;
-    }
-    ++src;
+    return hr;
   }
-}
-
-static void build_default_filename(LPCWSTR character, LPCWSTR text, std::wstring &ret)
-{
-  ret.resize(0);
+  Microsoft::WRL::ComPtr<IShellItem> r;
+  hr = d->GetResult(&r);
+  if (FAILED(hr))
   {
-    SYSTEMTIME st = {};
-    GetLocalTime(&st);
-    wchar_t datetime[128] = {};
-    swprintf_s(datetime, 128, L"%04d%02d%02d_%02d%02d%02d_", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
-    ret += datetime;
+    return hr;
   }
+  PWSTR folder = NULL;
+  hr = r->GetDisplayName(SIGDN_FILESYSPATH, &folder);
+  if (FAILED(hr))
   {
-    std::wstring s;
-    sanitize(character, s);
-    ret += s;
+    return hr;
   }
-  ret += L"_";
+  dest = folder;
+  CoTaskMemFree(folder);
+  if (dest.empty() || dest.back() != L'\\')
   {
-    std::wstring s;
-    sanitize(text, s);
-    if (s.size() > 10)
-    {
-      s.resize(9);
-      ret += s;
-      ret += L"…";
-    }
-    else
-    {
-      ret += s;
-    }
+    dest += L'\\';
   }
-  ret += L".wav";
+  return S_OK;
 }
 
 class DarkMode
@@ -850,23 +398,25 @@ public:
   }
 };
 
-class API
+class WebViewAPI : public API
 {
-  typedef std::function<void(const bool, const picojson::object)> resolver;
   typedef std::function<void()> task;
   HWND window_;
+  ICoreWebView2 *webview_;
   EventRegistrationToken token_;
-  LONG waiting;
-  CRITICAL_SECTION cs;
-  std::vector<task> tasks;
+  // tasks are queued from worker threads, including from const members
+  mutable LONG waiting;
+  mutable CRITICAL_SECTION cs;
+  mutable std::vector<task> tasks;
 
 public:
-  API() : window_(nullptr), cs({})
+  WebViewAPI(LPCWSTR version) : API(version), window_(nullptr), webview_(nullptr), cs({})
   {
     InitializeCriticalSection(&cs);
   }
-  virtual ~API()
+  virtual ~WebViewAPI()
   {
+    shutdown();
     DeleteCriticalSection(&cs);
   }
 
@@ -894,6 +444,7 @@ public:
 
   HRESULT install(Microsoft::WRL::ComPtr<ICoreWebView2> &webview)
   {
+    webview_ = webview.Get();
     Microsoft::WRL::ComPtr<ICoreWebView2WebMessageReceivedEventHandler> insth(new Handler<ICoreWebView2WebMessageReceivedEventHandler, ICoreWebView2 *, ICoreWebView2WebMessageReceivedEventArgs *>(
         [this](ICoreWebView2 *webview, ICoreWebView2WebMessageReceivedEventArgs *args) -> HRESULT
         {
@@ -909,7 +460,50 @@ public:
 "use strict";
 const cbs = {};
 let id = 0;
+let jobs = 0;
+const progress = {};
+let panel = null;
+const renderProgress = () => {
+  const active = Object.values(progress).filter(p => p);
+  if (!active.length) {
+    if (panel) {
+      panel.remove();
+      panel = null;
+    }
+    return;
+  }
+  if (!panel) {
+    panel = document.createElement('div');
+    panel.style.cssText = 'position:fixed;left:16px;bottom:16px;z-index:10000;padding:8px 12px;border-radius:4px;background:rgba(0,0,0,.75);color:#fff;font-size:12px;line-height:1.6;pointer-events:none;';
+    document.body.appendChild(panel);
+  }
+  const mb = v => (v / 1048576).toFixed(1) + ' MB';
+  panel.textContent = '';
+  for (const p of active) {
+    const line = document.createElement('div');
+    line.textContent = '保存中 ' + (p.count > 1 ? `${p.done}/${p.count} 件 ` : '') +
+      (p.total ? `${Math.floor(p.bytes * 100 / p.total)}%` : mb(p.bytes)) + ` (${mb(p.rate)}/s)`;
+    panel.appendChild(line);
+  }
+};
+// progress is only shown for the jobs started here that have not settled yet
+const track = (jobId, promise) => {
+  progress[jobId] = null;
+  return promise.finally(() => {
+    delete progress[jobId];
+    renderProgress();
+  });
+};
 window.chrome.webview.addEventListener("message", e => {
+  if (e.data.event === "progress") {
+    for (const p of e.data.params.jobs) {
+      if (p.jobId in progress) {
+        progress[p.jobId] = p;
+      }
+    }
+    renderProgress();
+    return;
+  }
   if (cbs[e.data.id]) {
 	const cb = cbs[e.data.id];
     delete cbs[e.data.id];
@@ -943,7 +537,8 @@ document.addEventListener('click', e => {
   const url = a.href;
   const text = document.querySelector('.maineditor .focusin .textarea textarea').value;
   const character = document.querySelector('.maineditor .focusin .speaker .v-select__selection').textContent;
-  CoeFontStudioFrontend.download({userAgent, url, text, character}).catch(r => {
+  const jobId = "click" + (++jobs);
+  track(jobId, CoeFontStudioFrontend.download({userAgent, url, text, character, jobId})).catch(r => {
     if (r.code == "abort") {
       return;
     }
@@ -951,6 +546,50 @@ document.addEventListener('click', e => {
   });
 }, true);
 
+const downloadAll = () => {
+  const items = [];
+  for (const a of document.querySelectorAll('.yomi-card-dl-btn a.download-button')) {
+    let card = a.parentElement;
+    while (card && !card.querySelector('.textarea textarea')) {
+      card = card.parentElement;
+    }
+    if (!card || !a.href) {
+      continue;
+    }
+    const speaker = card.querySelector('.speaker .v-select__selection');
+    items.push({
+      url: a.href,
+      text: card.querySelector('.textarea textarea').value,
+      character: speaker ? speaker.textContent : '',
+    });
+  }
+  if (!items.length) {
+    alert('保存できる音声がありません');
+    return;
+  }
+  const userAgent = navigator.userAgent;
+  const jobId = "all" + (++jobs);
+  track(jobId, CoeFontStudioFrontend.downloadAll({userAgent, items, jobId})).then(r => {
+    alert(`${r.saved} 件保存しました` + (r.failed ? `\n${r.failed} 件は保存に失敗しました` : '') + (r.cancelled ? '\n中断されました' : ''));
+  }).catch(r => {
+    if (r.code == "abort") {
+      return;
+    }
+    alert(r.message);
+  });
+};
+document.addEventListener('DOMContentLoaded', () => {
+  const button = document.createElement('button');
+  button.textContent = 'すべて保存';
+  button.title = 'ページ上のすべての音声をフォルダーに保存します';
+  button.style.cssText = 'position:fixed;right:16px;bottom:16px;z-index:10000;padding:8px 16px;border-radius:4px;border:none;background:#1976d2;color:#fff;box-shadow:0 2px 4px rgba(0,0,0,.3);cursor:pointer;';
+  button.addEventListener('click', e => {
+    e.preventDefault();
+    downloadAll();
+  });
+  document.body.appendChild(button);
+});
+
 return new Proxy({}, {
   get: function(obj, prop) {
     if (!(prop in obj)) {
@@ -970,7 +609,7 @@ return new Proxy({}, {
   }
 
 private:
-  void add_task(task t)
+  void add_task(task t) const
   {
     EnterCriticalSection(&cs);
     tasks.push_back(t);
@@ -1025,165 +664,53 @@ private:
           picojson::object robj;
           robj["id"].set<std::string>(id);
           robj[ok ? "params" : "err"].set<picojson::object>(ret);
-          std::wstring ws;
-          {
-            std::string u8(picojson::value(robj).serialize());
-            const HRESULT hr = to_u16(u8.c_str(), (int)u8.size(), ws);
-            if (FAILED(hr))
-            {
-              report(hr, L"to_u16 failed");
-              return;
-            }
-          }
-          add_task(
-              [webview, ws]() -> void
-              { report(webview->PostWebMessageAsJson(ws.c_str()), L"PostWebMessageAsJson failed"); });
+          post(webview, robj);
         });
     return S_OK;
   }
-
-  void dispatch(const std::string &method, picojson::object params, resolver fn) const
-  {
-    if (method == "version")
-    {
-      return api_version(params, fn);
-    }
-    else if (method == "download")
-    {
-      return api_download(params, fn);
-    }
-    return error_invalid_call(fn);
-  }
-
-  void api_version(const picojson::object params, resolver fn) const
+  // Posts message to the page from the UI thread.
+  void post(ICoreWebView2 *webview, const picojson::object &message) const
   {
-    (void)params;
-    picojson::object result;
-    std::string v;
-    to_u8(version, -1, v);
-    result["version"].set<std::string>(v);
-    return fn(true, result);
-  }
-  void api_download(const picojson::object params, resolver fn) const
-  {
-    std::wstring user_agent;
-    if (!get_string(params, "userAgent", user_agent))
-    {
-      return error_invalid_args(fn);
-    }
-    std::wstring url;
-    if (!get_string(params, "url", url))
-    {
-      return error_invalid_args(fn);
-    }
-    std::wstring character;
-    if (!get_string(params, "character", character))
-    {
-      return error_invalid_args(fn);
-    }
-    std::wstring text;
-    if (!get_string(params, "text", text))
-    {
-      return error_invalid_args(fn);
-    }
-
-    int text_encoding = ENCODING_UTF8BOM;
-    std::wstring filename;
+    std::wstring ws;
     {
-      std::wstring default_filename;
-      build_default_filename(character.c_str(), text.c_str(), default_filename);
-      HRESULT hr = show_save_dialog(window_, default_filename.c_str(), text_encoding, filename);
-      if (hr == HRESULT_FROM_WIN32(ERROR_CANCELLED))
-      {
-        return error_abort(fn);
-      }
+      std::string u8(picojson::value(message).serialize());
+      const HRESULT hr = to_u16(u8.c_str(), (int)u8.size(), ws);
       if (FAILED(hr))
       {
-        return error_internal(fn);
+        report(hr, L"to_u16 failed");
+        return;
       }
     }
-    std::thread t1(api_download_worker, user_agent, url, text, text_encoding, filename, fn);
-    t1.detach();
-  }
-  static void api_download_worker(
-      const std::wstring user_agent,
-      const std::wstring url,
-      const std::wstring text,
-      const int text_encoding,
-      const std::wstring filename,
-      resolver fn)
-  {
-    HRESULT hr = download(user_agent.c_str(), url.c_str(), filename.c_str());
-    if (FAILED(hr))
-    {
-      return error_internal(fn);
-    }
-
-    std::wstring textname = filename;
-    textname.resize(textname.rfind(L'.') + 1);
-    textname += L"txt";
-    hr = write_text(textname.c_str(), text.c_str(), text_encoding);
-    if (FAILED(hr))
-    {
-      return error_internal(fn);
-    }
-    picojson::object result;
-    return fn(true, result);
-  }
-
-  static void error(const char *code, const char *message, resolver fn)
-  {
-    picojson::object r;
-    r["code"].set<std::string>(code);
-    r["message"].set<std::string>(message);
-    return fn(false, r);
-  }
-  static void error_abort(resolver fn)
-  {
-    return error("abort", "処理が中断されました", fn);
-  }
-  static void error_internal(resolver fn)
-  {
-    return error("internal error", "内部エラーです", fn);
-  }
-  static void error_invalid_call(resolver fn)
-  {
-    return error("invalid function call", "正しくない呼び出しです", fn);
-  }
-  static void error_invalid_args(resolver fn)
-  {
-    return error("invalid arguments", "引数が正しくありません", fn);
+    add_task(
+        [webview, ws]() -> void
+        { report(webview->PostWebMessageAsJson(ws.c_str()), L"PostWebMessageAsJson failed"); });
   }
-  static void error_open_file(resolver fn)
+  HRESULT show_save_dialog(LPCWSTR default_filename, int &text_encoding, wstr &dest) const override
   {
-    return error("cannot open file", "ファイルが開けません", fn);
+    return ::show_save_dialog(window_, default_filename, text_encoding, dest);
   }
-  static void error_close_file(resolver fn)
+  HRESULT show_folder_dialog(wstr &dest) const override
   {
-    return error("cannot close file", "ファイルが閉じられません", fn);
+    return ::show_folder_dialog(window_, dest);
   }
-  static void error_read_from_file(resolver fn)
+  void get_setting(setting &dest) const override
   {
-    return error("failed to read from file", "ファイルからの読み込みに失敗しました", fn);
+    std::wstring setting_path;
+    if (SUCCEEDED(get_setting_path(setting_path)))
+    {
+      load_setting(setting_path.c_str(), dest);
+    }
   }
-  static void error_write_to_file(resolver fn)
+  HRESULT get_cache_folder(wstr &dest) const override
   {
-    return error("failed to write to file", "ファイルへの書き込みに失敗しました", fn);
+    return get_cache_path(dest);
   }
-  static bool get_string(const picojson::object obj, const char *name, std::wstring &s)
+  void post_event(const picojson::object &message) const override
   {
-    const auto it = obj.find(name);
-    if (it == obj.end() || !it->second.is<std::string>())
+    if (webview_)
     {
-      return false;
+      post(webview_, message);
     }
-    if (report(
-            to_u16(it->second.get<std::string>().c_str(), -1, s),
-            L"failed to convert to UTF-16"))
-    {
-      return false;
-    }
-    return true;
   }
 };
 
@@ -1245,12 +772,48 @@ static const TCHAR szWindowClass[] = _T("cfs_frontend");
 static const TCHAR szTitle[] = _T("非公式 CoeFont STUDIO フロントエンド");
 
 static HINSTANCE hInst;
-static API api;
+static WebViewAPI api(version);
 static DarkMode dark_mode;
 static LRESULT CALLBACK window_proc(HWND, UINT, WPARAM, LPARAM);
 
 static Microsoft::WRL::ComPtr<ICoreWebView2Controller> webview_controller;
 static Microsoft::WRL::ComPtr<ICoreWebView2> webview;
+static bool connection_warmed = false;
+
+// Connects to the site with the browser's user agent in the background,
+// so the first download does not have to wait for the handshake.
+static HRESULT warm_up_connection(ICoreWebView2 *wv)
+{
+  Microsoft::WRL::ComPtr<ICoreWebView2ExecuteScriptCompletedHandler> esh(new Handler<ICoreWebView2ExecuteScriptCompletedHandler, HRESULT, LPCWSTR>(
+      [](HRESULT result, LPCWSTR json) -> HRESULT
+      {
+        if (report(result, L"ICoreWebView2ExecuteScriptCompletedHandler failed"))
+        {
+          return result;
+        }
+        std::string u8;
+        HRESULT hr = to_u8(json, -1, u8);
+        if (FAILED(hr))
+        {
+          return hr;
+        }
+        picojson::value v;
+        if (!picojson::parse(v, u8).empty() || !v.is<std::string>())
+        {
+          return E_FAIL;
+        }
+        std::wstring user_agent;
+        const std::string &ua = v.get<std::string>();
+        hr = to_u16(ua.c_str(), (int)ua.size(), user_agent);
+        if (FAILED(hr))
+        {
+          return hr;
+        }
+        api.start_warm_up(user_agent, L"https://coefont.studio/");
+        return S_OK;
+      }));
+  return wv->ExecuteScript(L"navigator.userAgent", esh.Get());
+}
 
 static HWND create_window(int show)
 {
@@ -1400,6 +963,24 @@ int CALLBACK WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
                 }
               }
 
+              Microsoft::WRL::ComPtr<ICoreWebView2NavigationCompletedEventHandler> navh(new Handler<ICoreWebView2NavigationCompletedEventHandler, ICoreWebView2 *, ICoreWebView2NavigationCompletedEventArgs *>(
+                  [](ICoreWebView2 *webview, ICoreWebView2NavigationCompletedEventArgs *args) -> HRESULT
+                  {
+                    BOOL success = FALSE;
+                    if (connection_warmed || FAILED(args->get_IsSuccess(&success)) || !success)
+                    {
+                      return S_OK;
+                    }
+                    connection_warmed = true;
+                    report(warm_up_connection(webview), L"[WARN] warm_up_connection failed");
+                    return S_OK;
+                  }));
+              EventRegistrationToken ncToken;
+              if (report(webview->add_NavigationCompleted(navh.Get(), &ncToken), L"ICoreWebView2::add_NavigationCompleted failed"))
+              {
+                return E_FAIL;
+              }
+
               if (report(
                       webview->Navigate(L"https://coefont.studio/"),
                       L"ICoreWebView2::Navigate failed"))
@@ -1455,6 +1036,7 @@ int CALLBACK WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     TranslateMessage(&msg);
     DispatchMessage(&msg);
   }
+  close_sessions();
   return (int)msg.wParam;
 }
 
@@ -1484,6 +1066,7 @@ static LRESULT CALLBACK window_proc(HWND hWnd, UINT message, WPARAM wParam, LPAR
     };
     return 0;
   case WM_DESTROY:
+    api.shutdown();
     dark_mode.cleanup(hWnd);
     PostQuitMessage(0);
     return 0;
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+# Generates src/core/cp932_data.h from the CP932 decoder of Python.
+#
+#   python3 tools/gen_cp932_data.py > src/core/cp932_data.h
+#
+# Only the double-byte rows outside of the user-defined area (0xF040-0xF9FC)
+# are emitted. Single-byte codes and the user-defined area are linear and
+# handled in cp932.cpp. The encoder table is derived at compile time.
+
+trails = [t for t in range(0x40, 0xFD) if t != 0x7F]
+rows = []
+for lead in list(range(0x81, 0xA0)) + list(range(0xE0, 0xFD)):
+    if 0xF0 <= lead <= 0xF9:
+        continue
+    row = []
+    for trail in trails:
+        try:
+            u = bytes([lead, trail]).decode('cp932')
+            row.append(ord(u))
+        except UnicodeDecodeError:
+            row.append(0)
+    if any(row):
+        rows.append((lead, row))
+
+print('// Generated by tools/gen_cp932_data.py. Do not edit.')
+print('#pragma once')
+print()
+print('#include <stdint.h>')
+print()
+print('// Lead bytes of the rows in cp932_rows.')
+print('static constexpr uint8_t cp932_leads[%d] = {' % len(rows))
+for i in range(0, len(rows), 16):
+    print('    ' + ', '.join('0x%02x' % lead for lead, _ in rows[i:i + 16]) + ',')
+print('};')
+print()
+print('// Unicode code point of each double-byte code. The columns are the trail bytes')
+print('// 0x40-0x7e and 0x80-0xfc. 0 means the code is not assigned.')
+print('static constexpr uint16_t cp932_rows[%d][%d] = {' % (len(rows), len(trails)))
+for lead, row in rows:
+    print('    // 0x%02x' % lead)
+    print('    {')
+    for i in range(0, len(row), 12):
+        print('        ' + ', '.join('0x%04x' % u for u in row[i:i + 12]) + ',')
+    print('    },')
+print('};')